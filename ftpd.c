@@ -64,12 +64,28 @@
 
 #include "ftpd.h"
 #include "sfifo.h"
+#include "zstream.h"
+#include "writebehind.h"
+#include "sha1.h"
 
 #include "../sdcard/sdcard.h"
 
 #ifndef FTPD_POLL_INTERVAL
 #define FTPD_POLL_INTERVAL 4
 #endif
+#ifndef FTPD_MAX_SESSIONS
+#define FTPD_MAX_SESSIONS 2
+#endif
+#ifndef FTPD_PATH_MAX
+#define FTPD_PATH_MAX 256
+#endif
+// Port range for passive mode data connections.
+#ifndef FTPD_PASV_PORT_MIN
+#define FTPD_PASV_PORT_MIN 4096
+#endif
+#ifndef FTPD_PASV_PORT_MAX
+#define FTPD_PASV_PORT_MAX 0x7fff
+#endif
 
 #ifdef LWIP_DEBUGF
 #undef LWIP_DEBUGF
@@ -101,6 +117,43 @@ void dbg (char *msg, ...)
 #define FTP_TXPOLL 0
 #endif
 
+// RETR reads the file into two blocks that are handed to lwIP without copying,
+// one is refilled from the file while the other is in flight.
+// Block size is a multiple of the sector size, default is half the TCP send buffer
+// rounded down to a whole number of sectors but not larger than a typical FAT cluster.
+#ifndef FTPD_SECTOR_SIZE
+#define FTPD_SECTOR_SIZE 512
+#endif
+#ifndef FTPD_RETR_BLOCK_SIZE
+#if TCP_SND_BUF >= 8192
+#define FTPD_RETR_BLOCK_SIZE 4096
+#elif TCP_SND_BUF >= 2 * FTPD_SECTOR_SIZE
+#define FTPD_RETR_BLOCK_SIZE ((TCP_SND_BUF / 2) & ~(FTPD_SECTOR_SIZE - 1))
+#else
+#define FTPD_RETR_BLOCK_SIZE FTPD_SECTOR_SIZE
+#endif
+#endif
+#ifndef FTPD_RETR_BLOCK_ALIGN
+#define FTPD_RETR_BLOCK_ALIGN 32 // for DMA and cache line maintenance
+#endif
+// Size of the buffer for compressed directory listings in MODE Z.
+#ifndef FTPD_ZOUT_SIZE
+#define FTPD_ZOUT_SIZE 512
+#endif
+
+// Directory listings are served from a snapshot of the directory metadata taken by the first listing,
+// it is reused until the directory is changed via FTP or it is older than FTPD_DIRCACHE_TTL milliseconds.
+// Set to 0 to take a new snapshot for each listing.
+#ifndef FTPD_DIRCACHE_TTL
+#define FTPD_DIRCACHE_TTL 10000
+#endif
+
+#ifdef ESP_PLATFORM
+#define ST_MTIME(st) ((st).st_mtim)
+#else
+#define ST_MTIME(st) ((st).st_mtime)
+#endif
+
 #ifndef EINVAL
 #define EINVAL 1
 #define ENOMEM 2
@@ -125,8 +178,11 @@ PROGMEM static const char *msg150stor = "150 Opening BINARY mode data connection
 PROGMEM static const char *msg200 = "200 Command okay.";
 //PROGMEM static const char *msg202 = "202 Command not implemented, superfluous at this site.";
 //PROGMEM static const char *msg211 = "211 System status, or system help reply.";
+PROGMEM static const char *msg211FEAT = "211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n MLST type*;size*;modify*;perm*;\r\n EPSV\r\n MODE Z\r\n211 End";
 //PROGMEM static const char *msg212 = "212 Directory status.";
 //PROGMEM static const char *msg213 = "213 File status.";
+PROGMEM static const char *msg213SIZE = "213 %" UINT32SFMT;
+PROGMEM static const char *msg213MDTM = "213 %04i%02i%02i%02i%02i%02i";
 //PROGMEM static const char *msg214 = "214 %s.";
 /*
              214 Help message.
@@ -151,6 +207,7 @@ PROGMEM static const char *msg221 = "221 Goodbye.";
 */
 //PROGMEM static const char *msg225 = "225 Data connection open; no transfer in progress.";
 PROGMEM static const char *msg226 = "226 Closing data connection.";
+PROGMEM static const char *msg226stor = "226 Closing data connection, SHA-1 %s.";
 /*
              Requested file action successful (for example, file
              transfer or file abort).
@@ -159,8 +216,10 @@ PROGMEM static const char *msg227 = "227 Entering Passive Mode (%i,%i,%i,%i,%i,%
 /*
          227 Entering Passive Mode (h1,h2,h3,h4,p1,p2).
 */
+PROGMEM static const char *msg229 = "229 Entering Extended Passive Mode (|||%u|)";
 PROGMEM static const char *msg230 = "230 User logged in, proceed.";
 PROGMEM static const char *msg250 = "250 Requested file action okay, completed.";
+PROGMEM static const char *msg250MLST = "250-Listing %s\r\n %s %s\r\n250 End";
 PROGMEM static const char *msg257PWD = "257 \"%s\" is current directory.";
 PROGMEM static const char *msg257 = "257 \"%s\" created.";
 /*
@@ -169,12 +228,13 @@ PROGMEM static const char *msg257 = "257 \"%s\" created.";
 PROGMEM static const char *msg331 = "331 User name okay, need password.";
 //PROGMEM static const char *msg332 = "332 Need account for login.";
 PROGMEM static const char *msg350 = "350 Requested file action pending further information.";
-//PROGMEM static const char *msg421 = "421 Service not available, closing control connection.";
+PROGMEM static const char *msg350REST = "350 Restarting at %" UINT32SFMT ". Send STORE or RETRIEVE.";
+PROGMEM static const char *msg421 = "421 Service not available, closing control connection.";
 /*
              This may be a reply to any command if the service knows it
              must shut down.
 */
-//PROGMEM static const char *msg425 = "425 Can't open data connection.";
+PROGMEM static const char *msg425 = "425 Can't open data connection.";
 //PROGMEM static const char *msg426 = "426 Connection closed; transfer aborted.";
 PROGMEM static const char *msg450 = "450 Requested file action not taken.";
 /*
@@ -192,7 +252,8 @@ PROGMEM static const char *msg452 = "452 Requested action not taken.";
 PROGMEM static const char *msg501 = "501 Syntax error in parameters or arguments.";
 PROGMEM static const char *msg502 = "502 Command not implemented.";
 PROGMEM static const char *msg503 = "503 Bad sequence of commands.";
-//PROGMEM static const char *msg504 = "504 Command not implemented for that parameter.";
+PROGMEM static const char *msg522 = "522 Network protocol not supported, use (1)";
+PROGMEM static const char *msg504 = "504 Command not implemented for that parameter.";
 //PROGMEM static const char *msg530 = "530 Not logged in.";
 //PROGMEM static const char *msg532 = "532 Need account for storing files.";
 PROGMEM static const char *msg550 = "550 Requested action not taken.";
@@ -205,10 +266,11 @@ PROGMEM static const char *msg550 = "550 Requested action not taken.";
              Exceeded storage allocation (for current directory or
              dataset).
 */
-//PROGMEM static const char *msg553 = "553 Requested action not taken.";
+PROGMEM static const char *msg553 = "553 Requested action not taken.";
 /*
              File name not allowed.
 */
+PROGMEM static const char *msg554 = "554 Requested action not taken: invalid REST parameter.";
 
 enum ftpd_state_e {
     FTPD_USER,
@@ -216,6 +278,7 @@ enum ftpd_state_e {
     FTPD_IDLE,
     FTPD_NLST,
     FTPD_LIST,
+    FTPD_MLSD,
     FTPD_RETR,
     FTPD_RNFR,
     FTPD_STOR,
@@ -237,12 +300,56 @@ PROGMEM static const char *month_table[12] = {
     "Dec"
 };
 
+typedef struct {
+    uint8_t *data;
+    u16_t len;      // Number of bytes read into the block, 0 when free.
+    u16_t queued;   // Number of bytes handed to tcp_write().
+    u16_t acked;    // Number of bytes acknowledged by the peer.
+} ftpd_block_t;
+
+typedef struct ftpd_dirent {
+    struct ftpd_dirent *next;
+    uint32_t size;
+    time_t mtime;
+    vfs_st_mode_t st_mode;
+    char name[1];
+} ftpd_dirent_t;
+
+typedef struct {
+    uint_fast8_t refs;
+    bool complete;
+    uint32_t taken;
+    ftpd_dirent_t *head;
+    ftpd_dirent_t *tail;
+    char path[1];
+} ftpd_dircache_t;
+
 typedef struct {
     int connected;
     int eof;
+    int error;
     vfs_dir_t *vfs_dir;
-    vfs_dirent_t *vfs_dirent;
+    ftpd_dircache_t *dir;
+    ftpd_dirent_t *dirent; // Entry pending output.
+    ftpd_dirent_t *dirlast; // Last entry output.
     vfs_file_t *vfs_file;
+    size_t offset;
+    void *blockmem;
+    ftpd_block_t block[2];
+    uint_fast8_t block_head; // Index of the oldest block.
+    zs_deflate_t *deflate;  // MODE Z compressor for RETR and listings,
+    zs_inflate_t *inflate;  // decompressor for STOR.
+    writebehind_t *wb;      // STOR file writer.
+    SHA1_CTX sha1;          // STOR digest of the data received.
+    uint8_t *zin;           // RETR file data to be compressed.
+    size_t zin_len;
+    size_t zin_pos;
+    uint8_t *zout;          // Compressed listing data pending output.
+    u16_t zout_len;
+    u16_t zout_pos;
+#if FTP_TXPOLL
+    bool txpoll;
+#endif
     sfifo_t fifo;
     struct tcp_pcb *msgpcb;
     struct ftpd_msgstate *msgfs;
@@ -263,18 +370,113 @@ typedef struct ftpd_msgstate {
     struct tcp_pcb *datapcb;
     ftpd_datastate_t *datafs;
     int passive;
+    bool mode_z;
+    size_t restart;
     char *renamefrom;
     ftpd_cmd_t cmd;
+    char cwd[FTPD_PATH_MAX];
+    char path[FTPD_PATH_MAX]; // Argument of the current command resolved against cwd.
 } ftpd_msgstate_t;
 
-#if FTP_TXPOLL
-static struct {
-    ftpd_datastate_t *fsd;
-    struct tcp_pcb *pcb;
-} poll;
-#endif
+static ftpd_msgstate_t *sessions[FTPD_MAX_SESSIONS] = {0};
+
+static ftpd_dircache_t *dircache = NULL;
 
 static void send_msg (struct tcp_pcb *pcb, ftpd_msgstate_t *fsm, const char *msg, ...);
+static void pasv_close (ftpd_msgstate_t *fsm);
+
+static void dircache_release (ftpd_dircache_t *dir)
+{
+    ftpd_dirent_t *dirent;
+
+    if(--dir->refs == 0) {
+        while((dirent = dir->head)) {
+            dir->head = dirent->next;
+            free(dirent);
+        }
+        free(dir);
+    }
+}
+
+static void dircache_invalidate (void)
+{
+    if(dircache) {
+        dircache_release(dircache);
+        dircache = NULL;
+    }
+}
+
+// Returns a referenced snapshot of the directory, a new and empty one
+// to be filled by the caller if there is no valid snapshot cached.
+static ftpd_dircache_t *dircache_get (const char *path)
+{
+    if(dircache && !(dircache->complete && !strcmp(dircache->path, path) && (hal.get_elapsed_ticks() - dircache->taken) < FTPD_DIRCACHE_TTL))
+        dircache_invalidate();
+
+    if(dircache == NULL && (dircache = malloc(sizeof(ftpd_dircache_t) + strlen(path)))) {
+        memset(dircache, 0, sizeof(ftpd_dircache_t));
+        strcpy(dircache->path, path);
+        dircache->refs = 1;
+        dircache->taken = hal.get_elapsed_ticks();
+    }
+
+    if(dircache)
+        dircache->refs++;
+
+    return dircache;
+}
+
+static ftpd_dirent_t *dircache_add (ftpd_dircache_t *dir, const char *name, vfs_stat_t *st)
+{
+    ftpd_dirent_t *dirent;
+
+    if((dirent = malloc(sizeof(ftpd_dirent_t) + strlen(name)))) {
+
+        dirent->next = NULL;
+        dirent->size = (uint32_t)st->st_size;
+        dirent->mtime = ST_MTIME(*st);
+        dirent->st_mode = st->st_mode;
+        strcpy(dirent->name, name);
+
+        if(dir->tail)
+            dir->tail->next = dirent;
+        else
+            dir->head = dirent;
+        dir->tail = dirent;
+    }
+
+    return dirent;
+}
+
+static void ftpd_datafree (ftpd_datastate_t *fsd)
+{
+    if(fsd->wb)
+        writebehind_close(fsd->wb);
+
+    if(fsd->vfs_file)
+        vfs_close(fsd->vfs_file);
+
+    if(fsd->vfs_dir)
+        vfs_closedir(fsd->vfs_dir);
+
+    if(fsd->dir)
+        dircache_release(fsd->dir);
+
+    if(fsd->blockmem)
+        free(fsd->blockmem);
+
+    if(fsd->deflate)
+        zs_deflate_free(fsd->deflate);
+
+    if(fsd->inflate)
+        zs_inflate_free(fsd->inflate);
+
+    if(fsd->zout)
+        free(fsd->zout);
+
+    sfifo_close(&fsd->fifo);
+    free(fsd);
+}
 
 static void ftpd_dataerr (void *arg, err_t err)
 {
@@ -283,19 +485,14 @@ static void ftpd_dataerr (void *arg, err_t err)
     LWIP_DEBUGF(FTPD_DEBUG, ("ftpd_dataerr: %s (%i)\n", lwip_strerr(err), err));
     if (fsd != NULL) {
         fsd->msgfs->datafs = NULL;
+        fsd->msgfs->datapcb = NULL;
         fsd->msgfs->state = FTPD_IDLE;
-        free(fsd);
+        ftpd_datafree(fsd);
     }
 }
 
 static void ftpd_dataclose (struct tcp_pcb *pcb, ftpd_datastate_t *fsd)
 {
-    if(fsd->vfs_file)
-        vfs_close(fsd->vfs_file);
-
-    if(fsd->vfs_dir)
-        vfs_closedir(fsd->vfs_dir);
-
     tcp_arg(pcb, NULL);
     tcp_sent(pcb, NULL);
     tcp_recv(pcb, NULL);
@@ -311,17 +508,65 @@ static void ftpd_dataclose (struct tcp_pcb *pcb, ftpd_datastate_t *fsd)
         fsd->msgfs->state = FTPD_IDLE;
     }
 
-    sfifo_close(&fsd->fifo);
-    free(fsd);
+    // Unacknowledged RETR data references the blocks, abort rather than close if the transfer is incomplete.
+    bool inflight = fsd->blockmem && (fsd->block[0].len || fsd->block[1].len);
 
-    tcp_arg(pcb, NULL);
-    tcp_close(pcb);
+    ftpd_datafree(fsd);
+
+    if(inflight) {
+        tcp_err(pcb, NULL);
+        tcp_abort(pcb);
+    } else
+        tcp_close(pcb);
+}
+
+// MODE Z: compresses the data in the fifo, the compressor is finished when eof is set and the fifo is drained.
+static void send_data_z (struct tcp_pcb *pcb, ftpd_datastate_t *fsd)
+{
+    u16_t len;
+    size_t in, used;
+
+    while (1) {
+
+        if (fsd->zout_len) {
+
+            len = fsd->zout_len > tcp_sndbuf(pcb) ? tcp_sndbuf(pcb) : fsd->zout_len;
+
+            if (len == 0 || tcp_write(pcb, fsd->zout + fsd->zout_pos, len, TCP_WRITE_FLAG_COPY) != ERR_OK)
+                break;
+
+            fsd->zout_pos += len;
+            if ((fsd->zout_len -= len))
+                break;
+        }
+
+        if (zs_deflate_done(fsd->deflate)) {
+            tcp_output(pcb);
+            break;
+        }
+
+        used = sfifo_used(&fsd->fifo);
+        if ((in = fsd->fifo.size - fsd->fifo.readpos) > used)
+            in = used;
+
+        fsd->zout_pos = 0;
+        fsd->zout_len = zs_deflate(fsd->deflate, (uint8_t *)fsd->fifo.buffer + fsd->fifo.readpos, &in, fsd->zout, FTPD_ZOUT_SIZE, fsd->eof && in == used);
+        fsd->fifo.readpos = (fsd->fifo.readpos + in) & SFIFO_SIZEMASK(&fsd->fifo);
+
+        if (in == 0 && fsd->zout_len == 0)
+            break;
+    }
 }
 
 static void send_data (struct tcp_pcb *pcb, ftpd_datastate_t *fsd)
 {
     u16_t len;
 
+    if (fsd->deflate) {
+        send_data_z(pcb, fsd);
+        return;
+    }
+
     if ((len = sfifo_used(&fsd->fifo)) > 0) {
 
         int i = fsd->fifo.readpos;
@@ -352,120 +597,294 @@ static void send_data (struct tcp_pcb *pcb, ftpd_datastate_t *fsd)
     }
 }
 
+static bool retr_alloc (ftpd_datastate_t *fsd)
+{
+    uint8_t *data;
+
+    // In MODE Z a third block holds the file data to be compressed.
+    if((fsd->blockmem = malloc((fsd->deflate ? 3 : 2) * FTPD_RETR_BLOCK_SIZE + FTPD_RETR_BLOCK_ALIGN - 1)) == NULL)
+        return false;
+
+    data = (uint8_t *)(((uintptr_t)fsd->blockmem + FTPD_RETR_BLOCK_ALIGN - 1) & ~(uintptr_t)(FTPD_RETR_BLOCK_ALIGN - 1));
+
+    memset(fsd->block, 0, sizeof(fsd->block));
+    fsd->block[0].data = data;
+    fsd->block[1].data = data + FTPD_RETR_BLOCK_SIZE;
+    fsd->block_head = 0;
+
+    if(fsd->deflate) {
+        fsd->zin = data + 2 * FTPD_RETR_BLOCK_SIZE;
+        fsd->zin_len = fsd->zin_pos = 0;
+    }
+
+    return true;
+}
+
+// Returns true while there is more data to send.
+static inline bool retr_more (ftpd_datastate_t *fsd)
+{
+    return fsd->vfs_file || (fsd->deflate && !zs_deflate_done(fsd->deflate));
+}
+
+// Reads from the file, the first read after a restart is shortened
+// to bring the file position to a sector boundary.
+static size_t retr_read (ftpd_datastate_t *fsd, uint8_t *data)
+{
+    size_t len = FTPD_RETR_BLOCK_SIZE - (fsd->offset & (FTPD_SECTOR_SIZE - 1));
+
+    len = vfs_read(data, 1, len, fsd->vfs_file);
+
+    if (vfs_errno) {
+        fsd->error = 1; /* FS error */
+        len = 0;
+    }
+
+    fsd->offset += len;
+
+    if (fsd->error || (fsd->eof = vfs_eof(fsd->vfs_file))) {
+        vfs_close(fsd->vfs_file);
+        fsd->vfs_file = NULL;
+    }
+
+    return len;
+}
+
+// MODE Z: compresses file data into a block, returns the number of bytes output.
+static size_t retr_deflate (ftpd_datastate_t *fsd, uint8_t *data)
+{
+    size_t len = 0, in, out;
+
+    do {
+        if (fsd->zin_pos == fsd->zin_len && fsd->vfs_file) {
+            fsd->zin_len = retr_read(fsd, fsd->zin);
+            fsd->zin_pos = 0;
+        }
+
+        in = fsd->zin_len - fsd->zin_pos;
+        out = zs_deflate(fsd->deflate, fsd->zin + fsd->zin_pos, &in, data + len, FTPD_RETR_BLOCK_SIZE - len, fsd->vfs_file == NULL);
+        fsd->zin_pos += in;
+        len += out;
+    } while ((in || out) && !zs_deflate_done(fsd->deflate));
+
+    return len;
+}
+
+// Fills the free blocks, oldest first so that the data stays in order.
+static void retr_fill (ftpd_datastate_t *fsd)
+{
+    uint_fast8_t i;
+    ftpd_block_t *block;
+
+    for(i = 0; i < 2 && retr_more(fsd); i++) {
+
+        block = &fsd->block[(fsd->block_head + i) & 1];
+
+        if(block->len == 0) {
+            block->len = (u16_t)(fsd->deflate ? retr_deflate(fsd, block->data) : retr_read(fsd, block->data));
+            block->queued = block->acked = 0;
+        }
+    }
+}
+
+// Frees blocks that has been fully acknowledged by the peer, to be called from the sent callback.
+static void retr_acked (ftpd_datastate_t *fsd, u16_t len)
+{
+    u16_t n;
+    ftpd_block_t *block;
+
+    while(len && (block = &fsd->block[fsd->block_head])->len) {
+
+        n = block->queued - block->acked;
+        if(n > len)
+            n = len;
+
+        block->acked += n;
+        len -= n;
+
+        if(block->acked < block->len)
+            break;
+
+        block->len = block->queued = block->acked = 0;
+        fsd->block_head ^= 1;
+    }
+}
+
 static void send_file (ftpd_datastate_t *fsd, struct tcp_pcb *pcb)
 {
     if (!fsd->connected)
         return;
 
-    int len = 0;
+    uint_fast8_t i;
+    u16_t len;
+    bool queued = false;
+    ftpd_block_t *block;
 
-    if (fsd->vfs_file) {
+    retr_fill(fsd);
 
-        static char buffer[512];
+    for(i = 0; i < 2; i++) {
 
-        LWIP_DEBUGF(FTPD_DEBUG, ("send_file: %d\n", sfifo_space(&fsd->fifo)));
+        block = &fsd->block[(fsd->block_head + i) & 1];
 
-        while((len = sfifo_space(&fsd->fifo)) > 256) {
+        if((len = block->len - block->queued) == 0)
+            continue;
 
-            len = vfs_read(buffer, 1, len > sizeof(buffer) ? sizeof(buffer) : len, fsd->vfs_file);
+        /* We cannot send more data than space available in the send buffer. */
+        if(len > tcp_sndbuf(pcb))
+            len = tcp_sndbuf(pcb);
 
-            if (vfs_errno) {
-                fsd->vfs_file = NULL; /* FS error */
-                break;
-            }
+        // No copy, the block is not reused until the data is acknowledged.
+        if(len == 0 || tcp_write(pcb, block->data + block->queued, len, 0) != ERR_OK)
+            break;
 
-            if (len > 0)
-                sfifo_write(&fsd->fifo, buffer, len);
+        LWIP_DEBUGF(FTPD_DEBUG, ("send_file: %d\n", len));
 
-            if ((fsd->eof = vfs_eof(fsd->vfs_file))) {
-                vfs_close(fsd->vfs_file);
-                fsd->vfs_file = NULL;
-                break;
-            }
-        }
+        block->queued += len;
+        queued = true;
 
-        if(len >= 0)
-            send_data(pcb, fsd);
+        if(block->queued < block->len)
+            break;
     }
 
-    if (!fsd->vfs_file) {
+    if(queued)
+        tcp_output(pcb);
 
-        if (len >= 0 && sfifo_used(&fsd->fifo) > 0) {
-            send_data(pcb, fsd);
-            return;
-        }
+    if (!retr_more(fsd) && fsd->block[0].len == 0 && fsd->block[1].len == 0) {
 
         ftpd_msgstate_t *fsm = fsd->msgfs;
         struct tcp_pcb *msgpcb = fsd->msgpcb;
+        int error = fsd->error;
+
         ftpd_dataclose(pcb, fsd);
-        send_msg(msgpcb, fsm, len < 0 ? msg451 : msg226);
+        fsm->datapcb = NULL;
+        send_msg(msgpcb, fsm, error ? msg451 : msg226);
     }
 }
 
-static void send_next_directory (ftpd_datastate_t *fsd, struct tcp_pcb *pcb, int shortlist)
+// Returns the next entry of the listing, from the snapshot or from the directory
+// when the snapshot is being taken.
+static ftpd_dirent_t *dir_next (ftpd_datastate_t *fsd)
+{
+    int len;
+    vfs_stat_t st;
+    vfs_dirent_t *vfs_dirent;
+    char path[FTPD_PATH_MAX];
+    ftpd_dirent_t *dirent = fsd->dirlast ? fsd->dirlast->next : fsd->dir->head;
+
+    if(dirent == NULL && fsd->vfs_dir) {
+
+        if((vfs_dirent = vfs_readdir(fsd->vfs_dir))) {
+
+            len = snprintf(path, sizeof(path), "%s/%s", strcmp(fsd->dir->path, "/") ? fsd->dir->path : "", vfs_dirent->name);
+
+            if(len < 0 || len >= (int)sizeof(path) || vfs_stat(path, &st) != 0) {
+                memset(&st, 0, sizeof(vfs_stat_t));
+                st.st_size = vfs_dirent->size;
+                st.st_mode = vfs_dirent->st_mode;
+            }
+
+            if((dirent = dircache_add(fsd->dir, vfs_dirent->name, &st)) == NULL)
+                fsd->error = 1;
+        }
+
+        if(dirent == NULL) {
+            vfs_closedir(fsd->vfs_dir);
+            fsd->vfs_dir = NULL;
+            fsd->dir->complete = !fsd->error;
+        }
+    }
+
+    return dirent;
+}
+
+static int format_mlsx_facts (char *buffer, ftpd_dirent_t *dirent)
+{
+    int len;
+    struct tm *s_time = gmtime(&dirent->mtime);
+
+    if(dirent->st_mode.directory)
+        len = sprintf(buffer, "type=dir;");
+    else
+        len = sprintf(buffer, "type=file;size=%" UINT32SFMT ";", dirent->size);
+
+    if(s_time)
+        len += sprintf(buffer + len, "modify=%04i%02i%02i%02i%02i%02i;", s_time->tm_year + 1900, s_time->tm_mon + 1, s_time->tm_mday, s_time->tm_hour, s_time->tm_min, s_time->tm_sec);
+
+    if(dirent->st_mode.directory)
+        len += sprintf(buffer + len, "perm=%s;", dirent->st_mode.read_only ? "el" : "cdeflmp");
+    else
+        len += sprintf(buffer + len, "perm=%s;", dirent->st_mode.read_only ? "r" : "adfrw");
+
+    return len;
+}
+
+static void send_next_directory (ftpd_datastate_t *fsd, struct tcp_pcb *pcb)
 {
     int len;
     char buffer[512];
 
     while (1) {
-        if (fsd->vfs_dirent == NULL)
-            fsd->vfs_dirent = vfs_readdir(fsd->vfs_dir);
-
-        if (fsd->vfs_dirent) {
-            if (shortlist) {
-                len = sprintf(buffer, "%s\r\n", fsd->vfs_dirent->name);
-                if (sfifo_space(&fsd->fifo) < len) {
-                    send_data(pcb, fsd);
-                    return;
-                }
-                sfifo_write(&fsd->fifo, buffer, len);
-                fsd->vfs_dirent = NULL;
-            } else {
-                vfs_stat_t st;
-                time_t current_time = (time_t)-1;
-                int current_year;
-                struct tm *s_time;
+        if (fsd->dirent == NULL && !fsd->error)
+            fsd->dirent = dir_next(fsd);
+
+        if (fsd->dirent) {
+            switch(fsd->msgfs->state) {
+
+                case FTPD_NLST:
+                    len = sprintf(buffer, "%s\r\n", fsd->dirent->name);
+                    break;
+
+                case FTPD_MLSD:
+                    len = format_mlsx_facts(buffer, fsd->dirent);
+                    len += sprintf(buffer + len, " %s\r\n", fsd->dirent->name);
+                    break;
+
+                default:
+                    {
+                        time_t current_time = (time_t)-1;
+                        int current_year;
+                        struct tm *s_time;
 #ifndef __IMXRT1062__
-                time(&current_time);
+                        time(&current_time);
 #endif
-                s_time = gmtime(&current_time);
-                current_year = s_time->tm_year;
+                        s_time = gmtime(&current_time);
+                        current_year = s_time->tm_year;
 
-                strcat(strcpy(buffer, "/"), fsd->vfs_dirent->name);
+                        s_time = gmtime(&fsd->dirent->mtime);
 
-//                vfs_stat(fsd->vfs_dirent->name, &st);
-                vfs_stat(fsd->vfs_dirent->name, &st);
-#ifdef ESP_PLATFORM
-                s_time = gmtime(&st.st_mtim);
-#else
-                s_time = gmtime(&st.st_mtime);
-#endif
-                if (s_time->tm_year == current_year)
-                    len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11" UINT32SFMT " %s %02i %02i:%02i %s\r\n", (uint32_t)st.st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_hour, s_time->tm_min, fsd->vfs_dirent->name);
-                else
-                    len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11" UINT32SFMT " %s %02i %5i %s\r\n", (uint32_t)st.st_size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_year + 1900, fsd->vfs_dirent->name);
-
-                if (st.st_mode.directory)
-                    buffer[0] = 'd';
-                if (sfifo_space(&fsd->fifo) < len) {
-                    send_data(pcb, fsd);
-                    return;
-                }
-                sfifo_write(&fsd->fifo, buffer, len);
-                fsd->vfs_dirent = NULL;
+                        if (s_time->tm_year == current_year)
+                            len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11" UINT32SFMT " %s %02i %02i:%02i %s\r\n", fsd->dirent->size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_hour, s_time->tm_min, fsd->dirent->name);
+                        else
+                            len = sprintf(buffer, "-rw-rw-rw-   1 user     ftp  %11" UINT32SFMT " %s %02i %5i %s\r\n", fsd->dirent->size, month_table[s_time->tm_mon], s_time->tm_mday, s_time->tm_year + 1900, fsd->dirent->name);
+
+                        if (fsd->dirent->st_mode.directory)
+                            buffer[0] = 'd';
+                    }
+                    break;
+            }
+
+            if (sfifo_space(&fsd->fifo) < len) {
+                send_data(pcb, fsd);
+                return;
             }
+            sfifo_write(&fsd->fifo, buffer, len);
+            fsd->dirlast = fsd->dirent;
+            fsd->dirent = NULL;
         } else {
 
-            if (sfifo_used(&fsd->fifo) > 0) {
+            fsd->eof = 1;
+
+            if (sfifo_used(&fsd->fifo) > 0 || fsd->zout_len || (fsd->deflate && !zs_deflate_done(fsd->deflate))) {
                 send_data(pcb, fsd);
                 return;
             }
 
             ftpd_msgstate_t *fsm = fsd->msgfs;
             struct tcp_pcb *msgpcb = fsd->msgpcb;
+            int error = fsd->error;
+
             ftpd_dataclose(pcb, fsd);
             fsm->datapcb = NULL;
-            send_msg(msgpcb, fsm, msg226);
+            send_msg(msgpcb, fsm, error ? msg451 : msg226);
             return;
         }
     }
@@ -477,15 +896,14 @@ static err_t ftpd_datasent (void *arg, struct tcp_pcb *pcb, u16_t len)
 
     switch (fsd->msgfs->state) {
         case FTPD_LIST:
-            send_next_directory(fsd, pcb, 0);
-            break;
         case FTPD_NLST:
-            send_next_directory(fsd, pcb, 1);
+        case FTPD_MLSD:
+            send_next_directory(fsd, pcb);
             break;
         case FTPD_RETR:
+            retr_acked(fsd, len);
 #if FTP_TXPOLL
-            poll.fsd = fsd;
-            poll.pcb = pcb;
+            fsd->txpoll = true;
 #else
             send_file(fsd, pcb);
 #endif
@@ -497,35 +915,62 @@ static err_t ftpd_datasent (void *arg, struct tcp_pcb *pcb, u16_t len)
     return ERR_OK;
 }
 
+// Writes received (and decompressed) STOR data to the file and adds it to the digest.
+static bool ftpd_store (ftpd_datastate_t *fsd, const uint8_t *data, size_t length)
+{
+    sha1_update(&fsd->sha1, data, length);
+
+    return writebehind_write(fsd->wb, data, length);
+}
+
 static err_t ftpd_datarecv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
 {
     ftpd_datastate_t *fsd = arg;
 
     if (err == ERR_OK && p != NULL) {
 
-        u16_t tot_len = 0;
-
         struct pbuf *q = p;
         do {
-            int len;
-            len = vfs_write(q->payload, 1, q->len, fsd->vfs_file);
-            tot_len += len;
-            if (len != q->len)
+            if (fsd->error)
                 break;
+            if (fsd->inflate) {
+                zstream_status_t status = zs_inflate(fsd->inflate, q->payload, q->len);
+                fsd->error = status != ZStream_OK && status != ZStream_StreamEnd;
+            } else
+                fsd->error = !ftpd_store(fsd, q->payload, q->len);
         } while((q = q->next));
 
-        /* Inform TCP that we have taken the data. */
-        tcp_recved(pcb, tot_len);
+        /* Inform TCP that we have taken the data, when it has been written to the file (see ftpd_committed) unless discarded. */
+        if (fsd->error)
+            tcp_recved(pcb, p->tot_len);
+        else
+            writebehind_hold(fsd->wb, p->tot_len);
         pbuf_free(p);
     }
 
     if (err == ERR_OK && p == NULL) {
         ftpd_msgstate_t *fsm = fsd->msgfs;
         struct tcp_pcb *msgpcb = fsd->msgpcb;
+        // A truncated compressed stream is an error.
+        int error = fsd->error || (fsd->inflate && zs_inflate(fsd->inflate, NULL, 0) != ZStream_StreamEnd) || !writebehind_close(fsd->wb);
+        uint_fast8_t i;
+        uint8_t sha1[SHA1_BLOCK_SIZE];
+        char digest[SHA1_BLOCK_SIZE * 2 + 1];
+
+        fsd->wb = NULL;
+
+        // Report the digest of the data written so that the client can verify the upload without reading it back.
+        sha1_final(&fsd->sha1, sha1);
+        for (i = 0; i < SHA1_BLOCK_SIZE; i++)
+            sprintf(&digest[i * 2], "%02x", sha1[i]);
 
         ftpd_dataclose(pcb, fsd);
         fsm->datapcb = NULL;
-        send_msg(msgpcb, fsm, msg226);
+        dircache_invalidate();
+        if (error)
+            send_msg(msgpcb, fsm, msg451);
+        else
+            send_msg(msgpcb, fsm, msg226stor, digest);
     }
 
     return ERR_OK;
@@ -549,15 +994,13 @@ static err_t ftpd_dataconnected (void *arg, struct tcp_pcb *pcb, err_t err)
 
     switch (fsd->msgfs->state) {
         case FTPD_LIST:
-            send_next_directory(fsd, pcb, 0);
-            break;
         case FTPD_NLST:
-            send_next_directory(fsd, pcb, 1);
+        case FTPD_MLSD:
+            send_next_directory(fsd, pcb);
             break;
         case FTPD_RETR:
 #if FTP_TXPOLL
-            poll.fsd = fsd;
-            poll.pcb = pcb;
+            fsd->txpoll = true;
 #else
             send_file(fsd, pcb);
 #endif
@@ -571,8 +1014,13 @@ static err_t ftpd_dataconnected (void *arg, struct tcp_pcb *pcb, err_t err)
 
 static int open_dataconnection (struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
-    if (fsm->passive)
-        return 0;
+    if (fsm->passive) {
+        fsm->passive = 0; // A passive mode data connection is used for one transfer only.
+        if (fsm->datafs)
+            return 0;
+        send_msg(pcb, fsm, msg425);
+        return 1;
+    }
 
     /* Allocate memory for the structure that holds the state of the connection. */
     fsm->datafs = malloc(sizeof(ftpd_datastate_t));
@@ -613,6 +1061,92 @@ static int open_dataconnection (struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
     return 0;
 }
 
+static bool ftpd_zwrite (void *ctx, const uint8_t *data, size_t length)
+{
+    return ftpd_store((ftpd_datastate_t *)ctx, data, length);
+}
+
+// Opens the TCP window for the received data written to the file.
+static void ftpd_committed (void *ctx, size_t length, bool ok)
+{
+    ftpd_datastate_t *fsd = ctx;
+
+    if (!ok)
+        fsd->error = 1;
+
+    if (length && fsd->msgfs->datapcb)
+        tcp_recved(fsd->msgfs->datapcb, (u16_t)length);
+}
+
+// Sets up MODE Z compression or decompression for the data connection.
+static bool mode_z_init (ftpd_msgstate_t *fsm, bool compress, bool listing)
+{
+    ftpd_datastate_t *fsd = fsm->datafs;
+
+    if (!fsm->mode_z)
+        return true;
+
+    if (!compress)
+        return (fsd->inflate = zs_inflate_create(ftpd_zwrite, fsd)) != NULL;
+
+    if ((fsd->deflate = zs_deflate_create()) && listing && !(fsd->zout = malloc(FTPD_ZOUT_SIZE))) {
+        zs_deflate_free(fsd->deflate);
+        fsd->deflate = NULL;
+    }
+
+    return fsd->deflate != NULL;
+}
+
+// Resolves a path relative to the session working directory into fsm->path,
+// . and .. segments are removed. Returns NULL if the result is too long.
+static char *ftpd_path (ftpd_msgstate_t *fsm, const char *arg)
+{
+    char *path = fsm->path, *s;
+    const char *segment;
+    size_t len = 0, n;
+
+    *path = '\0';
+
+    if (*arg != '/' && *arg != '\\' && strcmp(fsm->cwd, "/")) {
+        strcpy(path, fsm->cwd);
+        len = strlen(path);
+    }
+
+    while (*arg) {
+
+        segment = arg;
+        while (*arg && *arg != '/' && *arg != '\\')
+            arg++;
+        n = arg - segment;
+        if (*arg)
+            arg++;
+
+        if (n == 0 || (n == 1 && *segment == '.'))
+            continue;
+
+        if (n == 2 && segment[0] == '.' && segment[1] == '.') {
+            if ((s = strrchr(path, '/'))) {
+                *s = '\0';
+                len = s - path;
+            }
+            continue;
+        }
+
+        if (len + n + 2 > FTPD_PATH_MAX)
+            return NULL;
+
+        path[len++] = '/';
+        memcpy(&path[len], segment, n);
+        len += n;
+        path[len] = '\0';
+    }
+
+    if (len == 0)
+        strcpy(path, "/");
+
+    return path;
+}
+
 static void cmd_user (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
     send_msg(pcb, fsm, msg331);
@@ -641,6 +1175,8 @@ static void cmd_port (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
     if (sscanf(arg, "%u,%u,%u,%u,%u,%u", &(ip[0]), &(ip[1]), &(ip[2]), &(ip[3]), &pHi, &pLo) != 6)
         send_msg(pcb, fsm, msg501);
     else {
+        if (fsm->passive && fsm->state == FTPD_IDLE)
+            pasv_close(fsm);
         IP4_ADDR(&fsm->dataip, (u8_t) ip[0], (u8_t) ip[1], (u8_t) ip[2], (u8_t) ip[3]);
         fsm->dataport = ((u16_t) pHi << 8) | (u16_t) pLo;
         send_msg(pcb, fsm, msg200);
@@ -655,62 +1191,110 @@ static void cmd_quit (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 
 static void cmd_cwd (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
-    send_msg(pcb, fsm, vfs_chdir(vfs_fixpath(arg)) ? msg550 : msg250);
+    vfs_dir_t *dir;
+
+    if (arg == NULL || *arg == '\0') {
+        send_msg(pcb, fsm, msg501);
+        return;
+    }
+
+    // The working directory is per session, vfs_chdir() is not used as it is global.
+    if ((dir = vfs_opendir(arg))) {
+        vfs_closedir(dir);
+        strcpy(fsm->cwd, arg);
+        send_msg(pcb, fsm, msg250);
+    } else
+        send_msg(pcb, fsm, msg550);
 }
 
 static void cmd_cdup (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
-    send_msg(pcb, fsm, vfs_chdir("..") ? msg550 : msg250);
+    cmd_cwd(ftpd_path(fsm, ".."), pcb, fsm);
 }
 
 static void cmd_pwd (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
-    char *path;
-
-    if ((path = vfs_getcwd(NULL, 0))) {
-        send_msg(pcb, fsm, msg257PWD, path);
-        free(path);
-    } else
-        send_msg(pcb, fsm, msg550);
+    send_msg(pcb, fsm, msg257PWD, fsm->cwd);
 }
 
-static void cmd_list_common (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm, int shortlist)
+static void cmd_list_common (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm, enum ftpd_state_e format)
 {
-    vfs_dir_t *vfs_dir;
-    char *cwd;
+    vfs_dir_t *vfs_dir = NULL;
+    ftpd_dircache_t *dir;
+    char *path = fsm->cwd;
 
-    if (!(cwd = vfs_getcwd(NULL, 0))) {
-        send_msg(pcb, fsm, msg451);
+    // Arguments starting with - are ls options, ignored.
+    if (arg && *arg && *arg != '-' && !(path = ftpd_path(fsm, arg))) {
+        send_msg(pcb, fsm, msg553);
         return;
     }
 
-    vfs_dir = vfs_opendir(cwd);
-    free(cwd);
-    if (!vfs_dir) {
+    dir = dircache_get(path);
+    if (dir && !dir->complete)
+        vfs_dir = vfs_opendir(path);
+
+    if (!dir || (!dir->complete && !vfs_dir)) {
+        if (dir)
+            dircache_release(dir);
         send_msg(pcb, fsm, msg451);
         return;
     }
 
     if (open_dataconnection(pcb, fsm) != 0) {
-        vfs_closedir(vfs_dir);
+        if (vfs_dir)
+            vfs_closedir(vfs_dir);
+        dircache_release(dir);
         return;
     }
 
     fsm->datafs->vfs_dir = vfs_dir;
-    fsm->datafs->vfs_dirent = NULL;
-    fsm->state = shortlist ? FTPD_NLST : FTPD_LIST;
+    fsm->datafs->dir = dir;
+    fsm->datafs->dirent = fsm->datafs->dirlast = NULL;
+    fsm->state = format;
+
+    if (!mode_z_init(fsm, true, true)) {
+        LWIP_DEBUGF(FTPD_DEBUG, ("cmd_list: Out of memory\n"));
+        fsm->datafs->error = 1;
+    }
 
     send_msg(pcb, fsm, msg150);
 }
 
 static void cmd_nlst (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
-    cmd_list_common(arg, pcb, fsm, 1);
+    cmd_list_common(arg, pcb, fsm, FTPD_NLST);
 }
 
 static void cmd_list (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
-    cmd_list_common(arg, pcb, fsm, 0);
+    cmd_list_common(arg, pcb, fsm, FTPD_LIST);
+}
+
+static void cmd_mlsd (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    cmd_list_common(arg, pcb, fsm, FTPD_MLSD);
+}
+
+static void cmd_mlst (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    vfs_stat_t st;
+    char facts[80];
+    ftpd_dirent_t dirent;
+
+    if (arg == NULL || *arg == '\0')
+        arg = fsm->cwd;
+
+    if (vfs_stat(arg, &st) != 0) {
+        send_msg(pcb, fsm, msg550);
+        return;
+    }
+
+    dirent.size = (uint32_t)st.st_size;
+    dirent.mtime = ST_MTIME(st);
+    dirent.st_mode = st.st_mode;
+    format_mlsx_facts(facts, &dirent);
+
+    send_msg(pcb, fsm, msg250MLST, arg, facts, arg);
 }
 
 static void cmd_retr (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
@@ -718,18 +1302,28 @@ static void cmd_retr (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
     vfs_file_t *vfs_file;
     vfs_stat_t st;
 
-    vfs_stat(arg, &st);
-    if (st.st_mode.directory) {
+    if (vfs_stat(arg, &st) != 0 || st.st_mode.directory) {
         send_msg(pcb, fsm, msg550);
         return;
     }
 
+    if (fsm->restart > st.st_size) {
+        send_msg(pcb, fsm, msg554);
+        return;
+    }
+
     if (!(vfs_file = vfs_open(arg, "rb"))) {
         send_msg(pcb, fsm, msg550);
         return;
     }
 
-    send_msg(pcb, fsm, msg150recv, arg, st.st_size);
+    if (fsm->restart && vfs_seek(vfs_file, fsm->restart) != 0) {
+        vfs_close(vfs_file);
+        send_msg(pcb, fsm, msg451);
+        return;
+    }
+
+    send_msg(pcb, fsm, msg150recv, arg, st.st_size - fsm->restart);
 
     if (open_dataconnection(pcb, fsm) != 0) {
         vfs_close(vfs_file);
@@ -737,14 +1331,67 @@ static void cmd_retr (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
     }
 
     fsm->datafs->vfs_file = vfs_file;
+    fsm->datafs->offset = fsm->restart;
+
+    if (!mode_z_init(fsm, true, false) || !retr_alloc(fsm->datafs)) {
+        LWIP_DEBUGF(FTPD_DEBUG, ("cmd_retr: Out of memory\n"));
+        fsm->datafs->error = 1;
+        vfs_close(vfs_file);
+        fsm->datafs->vfs_file = NULL;
+    }
+
     fsm->state = FTPD_RETR;
+
+    // A passive mode data connection may already be established, start sending.
+    if (fsm->datafs->connected) {
+#if FTP_TXPOLL
+        fsm->datafs->txpoll = true;
+#else
+        send_file(fsm->datafs, fsm->datapcb);
+#endif
+    }
 }
 
-static void cmd_stor (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+static void store_common (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm, bool append)
 {
     vfs_file_t *vfs_file;
+    vfs_stat_t st;
+    size_t offset = 0;
+
+    if (arg == NULL || *arg == '\0') {
+        send_msg(pcb, fsm, msg501);
+        return;
+    }
+
+    if (append || fsm->restart) {
+
+        // Resume: write from the restart offset, appending when it is at the end of the file.
+
+        if (vfs_stat(arg, &st) != 0)
+            st.st_size = 0;
+        else if (st.st_mode.directory) {
+            send_msg(pcb, fsm, msg550);
+            return;
+        }
+
+        if (fsm->restart > st.st_size) {
+            send_msg(pcb, fsm, msg554);
+            return;
+        }
+
+        offset = append ? st.st_size : fsm->restart;
+
+        if (append || fsm->restart == st.st_size)
+            vfs_file = vfs_open(arg, "ab");
+        else if ((vfs_file = vfs_open(arg, "r+b")) && vfs_seek(vfs_file, fsm->restart) != 0) {
+            vfs_close(vfs_file);
+            send_msg(pcb, fsm, msg451);
+            return;
+        }
+    } else
+        vfs_file = vfs_open(arg, "wb");
 
-    if (!(vfs_file = vfs_open(arg, "wb"))) {
+    if (vfs_file == NULL) {
         send_msg(pcb, fsm, msg550);
         return;
     }
@@ -758,6 +1405,81 @@ static void cmd_stor (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 
     fsm->datafs->vfs_file = vfs_file;
     fsm->state = FTPD_STOR;
+    dircache_invalidate();
+    sha1_init(&fsm->datafs->sha1);
+
+    if (!(fsm->datafs->wb = writebehind_create(vfs_file, offset, TCP_WND, ftpd_committed, fsm->datafs)) || !mode_z_init(fsm, false, false)) {
+        LWIP_DEBUGF(FTPD_DEBUG, ("cmd_stor: Out of memory\n"));
+        fsm->datafs->error = 1;
+    }
+}
+
+static void cmd_stor (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    store_common(arg, pcb, fsm, false);
+}
+
+static void cmd_appe (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    store_common(arg, pcb, fsm, true);
+}
+
+static void cmd_rest (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    char *end;
+    unsigned long offset;
+
+    if (arg == NULL || !isdigit((uint8_t)*arg) || (offset = strtoul(arg, &end, 10), *end != '\0')) {
+        send_msg(pcb, fsm, msg501);
+        return;
+    }
+
+    fsm->restart = (size_t)offset;
+
+    send_msg(pcb, fsm, msg350REST, (uint32_t)fsm->restart);
+}
+
+static void cmd_size (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    vfs_stat_t st;
+
+    if (arg == NULL || *arg == '\0') {
+        send_msg(pcb, fsm, msg501);
+        return;
+    }
+
+    if (vfs_stat(arg, &st) != 0 || st.st_mode.directory)
+        send_msg(pcb, fsm, msg550);
+    else
+        send_msg(pcb, fsm, msg213SIZE, (uint32_t)st.st_size);
+}
+
+static void cmd_mdtm (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    vfs_stat_t st;
+    struct tm *s_time;
+
+    if (arg == NULL || *arg == '\0') {
+        send_msg(pcb, fsm, msg501);
+        return;
+    }
+
+    if (vfs_stat(arg, &st) != 0) {
+        send_msg(pcb, fsm, msg550);
+        return;
+    }
+
+    time_t mtime = ST_MTIME(st);
+
+    if ((s_time = gmtime(&mtime)) == NULL)
+        send_msg(pcb, fsm, msg550);
+    else
+        send_msg(pcb, fsm, msg213MDTM, s_time->tm_year + 1900, s_time->tm_mon + 1, s_time->tm_mday, s_time->tm_hour, s_time->tm_min, s_time->tm_sec);
+}
+
+static void cmd_feat (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    send_msg(pcb, fsm, msg211FEAT);
 }
 
 static void cmd_noop (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
@@ -770,68 +1492,87 @@ static void cmd_syst (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
     send_msg(pcb, fsm, msg214SYST, "UNIX");
 }
 
-static void cmd_pasv (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+// Closes a passive mode listener or data connection that has not been used for a transfer.
+static void pasv_close (ftpd_msgstate_t *fsm)
+{
+    if (fsm->datalistenpcb) {
+        tcp_arg(fsm->datalistenpcb, NULL);
+        tcp_accept(fsm->datalistenpcb, NULL);
+        tcp_close(fsm->datalistenpcb);
+        fsm->datalistenpcb = NULL;
+    }
+
+    if (fsm->datapcb) {
+        tcp_arg(fsm->datapcb, NULL);
+        tcp_sent(fsm->datapcb, NULL);
+        tcp_recv(fsm->datapcb, NULL);
+        tcp_err(fsm->datapcb, NULL);
+        tcp_close(fsm->datapcb);
+        fsm->datapcb = NULL;
+    }
+
+    if (fsm->datafs) {
+        ftpd_datafree(fsm->datafs);
+        fsm->datafs = NULL;
+    }
+
+    fsm->passive = 0;
+}
+
+// Sets up a listener for a passive mode data connection on the next free port in the
+// FTPD_PASV_PORT_MIN - FTPD_PASV_PORT_MAX range, ports are shared by all sessions.
+static bool pasv_open (struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
-    static u16_t port = 4096;
-    static u16_t start_port = 4096;
+    static u16_t port = FTPD_PASV_PORT_MAX;
+
+    err_t err;
+    u16_t start_port;
     struct tcp_pcb *temppcb;
 
+    if (fsm->datafs && fsm->state != FTPD_IDLE) {
+        send_msg(pcb, fsm, msg503);
+        return false;
+    }
+
+    pasv_close(fsm);
+
     /* Allocate memory for the structure that holds the state of the connection. */
     if (!(fsm->datafs = malloc(sizeof(ftpd_datastate_t)))) {
-        LWIP_DEBUGF(FTPD_DEBUG, ("cmd_pasv: Out of memory\n"));
+        LWIP_DEBUGF(FTPD_DEBUG, ("pasv_open: Out of memory\n"));
         send_msg(pcb, fsm, msg451);
-        return;
+        return false;
     }
 
     memset(fsm->datafs, 0, sizeof(ftpd_datastate_t));
 
     if (sfifo_init(&fsm->datafs->fifo, 3000) != 0) {
         free(fsm->datafs);
+        fsm->datafs = NULL;
         send_msg(pcb, fsm, msg451);
-        return;
+        return false;
     }
 
     if (!(fsm->datalistenpcb = tcp_new())) {
-        free(fsm->datafs);
-        sfifo_close(&fsm->datafs->fifo);
+        pasv_close(fsm);
         send_msg(pcb, fsm, msg451);
-        return;
+        return false;
     }
 
     start_port = port;
 
-    while (1) {
-        err_t err;
-
-        if(++port > 0x7fff)
-            port = 4096;
-
-        fsm->dataport = port;
-
-        if ((err = tcp_bind(fsm->datalistenpcb, (ip_addr_t*)&pcb->local_ip, fsm->dataport)) == ERR_OK)
-            break;
-
-        if (start_port == port)
-            err = ERR_CLSD;
-
-        if (err == ERR_USE)
-            continue;
-        else {
-            ftpd_dataclose(fsm->datalistenpcb, fsm->datafs);
-            fsm->datalistenpcb = NULL;
-            fsm->datafs = NULL;
-            return;
-        }
-    }
+    do {
+        if (++port > FTPD_PASV_PORT_MAX || port < FTPD_PASV_PORT_MIN)
+            port = FTPD_PASV_PORT_MIN;
+    } while ((err = tcp_bind(fsm->datalistenpcb, (ip_addr_t*)&pcb->local_ip, port)) == ERR_USE && port != start_port);
 
-    if (!(temppcb = tcp_listen(fsm->datalistenpcb))) {
-        LWIP_DEBUGF(FTPD_DEBUG, ("cmd_pasv: tcp_listen failed\n"));
-        ftpd_dataclose(fsm->datalistenpcb, fsm->datafs);
-        fsm->datalistenpcb = NULL;
-        fsm->datafs = NULL;
-        return;
+    if (err != ERR_OK || !(temppcb = tcp_listen(fsm->datalistenpcb))) {
+        LWIP_DEBUGF(FTPD_DEBUG, ("pasv_open: no port available\n"));
+        pasv_close(fsm);
+        send_msg(pcb, fsm, msg425);
+        return false;
     }
 
+    fsm->dataport = port;
     fsm->datalistenpcb = temppcb;
     fsm->passive = 1;
     fsm->datafs->connected = 0;
@@ -842,18 +1583,43 @@ static void cmd_pasv (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
     tcp_arg(fsm->datalistenpcb, fsm->datafs);
     tcp_accept(fsm->datalistenpcb, ftpd_dataconnected);
 
-    send_msg(pcb, fsm, msg227, ip4_addr1(ip_2_ip4(&pcb->local_ip)), ip4_addr2(ip_2_ip4(&pcb->local_ip)), ip4_addr3(ip_2_ip4(&pcb->local_ip)), ip4_addr4(ip_2_ip4(&pcb->local_ip)), (fsm->dataport >> 8) & 0xff, (fsm->dataport) & 0xff);
+    return true;
+}
+
+static void cmd_pasv (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    if (pasv_open(pcb, fsm))
+        send_msg(pcb, fsm, msg227, ip4_addr1(ip_2_ip4(&pcb->local_ip)), ip4_addr2(ip_2_ip4(&pcb->local_ip)), ip4_addr3(ip_2_ip4(&pcb->local_ip)), ip4_addr4(ip_2_ip4(&pcb->local_ip)), (fsm->dataport >> 8) & 0xff, (fsm->dataport) & 0xff);
+}
+
+static void cmd_epsv (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
+{
+    if (arg && !lwip_stricmp(arg, "ALL"))
+        send_msg(pcb, fsm, msg200);
+    else if (arg && *arg && strcmp(arg, "1"))
+        send_msg(pcb, fsm, msg522);
+    else if (pasv_open(pcb, fsm))
+        send_msg(pcb, fsm, msg229, fsm->dataport);
 }
 
 static void cmd_abrt (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
     if (fsm->datafs != NULL) {
-        tcp_arg(fsm->datapcb, NULL);
-        tcp_sent(fsm->datapcb, NULL);
-        tcp_recv(fsm->datapcb, NULL);
-        tcp_abort(pcb);
-        sfifo_close(&fsm->datafs->fifo);
-        free(fsm->datafs);
+        if (fsm->datalistenpcb) {
+            tcp_arg(fsm->datalistenpcb, NULL);
+            tcp_accept(fsm->datalistenpcb, NULL);
+            tcp_close(fsm->datalistenpcb);
+            fsm->datalistenpcb = NULL;
+        }
+        if (fsm->datapcb) {
+            tcp_arg(fsm->datapcb, NULL);
+            tcp_sent(fsm->datapcb, NULL);
+            tcp_recv(fsm->datapcb, NULL);
+            tcp_err(fsm->datapcb, NULL);
+            tcp_abort(fsm->datapcb); // Data in flight may reference the RETR blocks, so they must not be freed before the pcb.
+            fsm->datapcb = NULL;
+        }
+        ftpd_datafree(fsm->datafs);
         fsm->datafs = NULL;
     }
     fsm->state = FTPD_IDLE;
@@ -874,7 +1640,12 @@ static void cmd_type (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 static void cmd_mode (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
 {
     LWIP_DEBUGF(FTPD_DEBUG, ("Got MODE -%s-\n", arg));
-    send_msg(pcb, fsm, msg502);
+
+    if (arg && arg[1] == '\0' && (*arg == 'S' || *arg == 's' || *arg == 'Z' || *arg == 'z')) {
+        fsm->mode_z = *arg == 'Z' || *arg == 'z';
+        send_msg(pcb, fsm, msg200);
+    } else
+        send_msg(pcb, fsm, msg504);
 }
 
 static void cmd_rnfr (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
@@ -915,6 +1686,7 @@ static void cmd_rnto (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
         return;
     }
 
+    dircache_invalidate();
     send_msg(pcb, fsm, vfs_rename(fsm->renamefrom, arg) ? msg450 : msg250);
 }
 
@@ -925,6 +1697,7 @@ static void cmd_mkd (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
         return;
     }
 
+    dircache_invalidate();
     send_msg(pcb, fsm, vfs_mkdir(arg /*, VFS_IRWXU | VFS_IRWXG | VFS_IRWXO*/) ? msg550 : msg257, arg);
 }
 
@@ -937,7 +1710,7 @@ static void cmd_rmd (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
         return;
     }
 
-    if (vfs_stat(vfs_fixpath(arg), &st) != 0) {
+    if (vfs_stat(arg, &st) != 0) {
         send_msg(pcb, fsm, msg550);
         return;
     }
@@ -947,6 +1720,7 @@ static void cmd_rmd (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
         return;
     }
 
+    dircache_invalidate();
     send_msg(pcb, fsm, vfs_rmdir(arg) ? msg550 : msg250);
 }
 
@@ -969,6 +1743,7 @@ static void cmd_dele (char *arg, struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
         return;
     }
 
+    dircache_invalidate();
     send_msg(pcb, fsm, vfs_unlink(arg) ? msg550 : msg250);
 }
 
@@ -976,6 +1751,7 @@ typedef struct {
     char const *const cmd;
     void (*func) (char *arg, struct tcp_pcb * pcb, ftpd_msgstate_t * fsm);
     bool check_busy;
+    bool path; // Argument is a path, passed resolved against the working directory.
 } ftpd_command_t;
 
 static const ftpd_command_t ftpd_commands[] = {
@@ -983,27 +1759,35 @@ static const ftpd_command_t ftpd_commands[] = {
     {"PASS", cmd_pass, 0},
     {"PORT", cmd_port, 0},
     {"QUIT", cmd_quit, 0},
-    {"CWD",  cmd_cwd,  1},
+    {"CWD",  cmd_cwd,  1, 1},
     {"CDUP", cmd_cdup, 1},
     {"PWD",  cmd_pwd,  0},
     {"XPWD", cmd_pwd,  0},
     {"NLST", cmd_nlst, 1},
     {"LIST", cmd_list, 1},
-    {"RETR", cmd_retr, 1},
-    {"STOR", cmd_stor, 1},
+    {"MLSD", cmd_mlsd, 1},
+    {"MLST", cmd_mlst, 1, 1},
+    {"RETR", cmd_retr, 1, 1},
+    {"STOR", cmd_stor, 1, 1},
+    {"APPE", cmd_appe, 1, 1},
+    {"REST", cmd_rest, 0},
+    {"SIZE", cmd_size, 1, 1},
+    {"MDTM", cmd_mdtm, 1, 1},
+    {"FEAT", cmd_feat, 0},
     {"NOOP", cmd_noop, 0},
     {"SYST", cmd_syst, 0},
     {"ABOR", cmd_abrt, 0},
     {"TYPE", cmd_type, 0},
     {"MODE", cmd_mode, 0},
-    {"RNFR", cmd_rnfr, 1},
-    {"RNTO", cmd_rnto, 1},
-    {"MKD",  cmd_mkd,  1},
-    {"XMKD", cmd_mkd,  1},
-    {"RMD",  cmd_rmd,  1},
-    {"XRMD", cmd_rmd,  1},
-    {"DELE", cmd_dele, 1},
+    {"RNFR", cmd_rnfr, 1, 1},
+    {"RNTO", cmd_rnto, 1, 1},
+    {"MKD",  cmd_mkd,  1, 1},
+    {"XMKD", cmd_mkd,  1, 1},
+    {"RMD",  cmd_rmd,  1, 1},
+    {"XRMD", cmd_rmd,  1, 1},
+    {"DELE", cmd_dele, 1, 1},
     {"PASV", cmd_pasv, 0},
+    {"EPSV", cmd_epsv, 0},
     {NULL,   NULL,     0}
 };
 
@@ -1056,6 +1840,16 @@ static void send_msg (struct tcp_pcb *pcb, ftpd_msgstate_t *fsm, const char *msg
     }
 }
 
+static void ftpd_session_remove (ftpd_msgstate_t *fsm)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < FTPD_MAX_SESSIONS; idx++) {
+        if(sessions[idx] == fsm)
+            sessions[idx] = NULL;
+    }
+}
+
 static void ftpd_msgerr (void *arg, err_t err)
 {
     ftpd_msgstate_t *fsm = arg;
@@ -1076,6 +1870,7 @@ static void ftpd_msgerr (void *arg, err_t err)
         if (fsm->cmd.text)
             free(fsm->cmd.text);
 
+        ftpd_session_remove(fsm);
         free(fsm);
     }
 }
@@ -1098,6 +1893,7 @@ static void ftpd_msgclose (struct tcp_pcb *pcb, ftpd_msgstate_t *fsm)
     if (fsm->cmd.text)
         free(fsm->cmd.text);
 
+    ftpd_session_remove(fsm);
     free(fsm);
 
     tcp_arg(pcb, NULL);
@@ -1172,11 +1968,17 @@ static err_t ftpd_msgrecv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
                 if (ftpd_cmd->func) {
                     if(ftpd_cmd->check_busy && stream_is_file())
                         send_msg(pcb, fsm, msg452);
+                    else if(ftpd_cmd->path && *pt && !(pt = ftpd_path(fsm, pt)))
+                        send_msg(pcb, fsm, msg553);
                     else
                         ftpd_cmd->func(pt, pcb, fsm);
                 } else
                     send_msg(pcb, fsm, msg502);
 
+                // A restart offset only applies to the command immediately following REST.
+                if (ftpd_cmd->func != cmd_rest)
+                    fsm->restart = 0;
+
                 free(fsm->cmd.text);
                 fsm->cmd.text = NULL;
             }
@@ -1196,10 +1998,9 @@ static err_t ftpd_msgpoll (void *arg, struct tcp_pcb *pcb)
     if (fsm != NULL && fsm->datafs && fsm->datafs->connected) {
         switch (fsm->state) {
             case FTPD_LIST:
-                send_next_directory(fsm->datafs, fsm->datapcb, 0);
-                break;
             case FTPD_NLST:
-                send_next_directory(fsm->datafs, fsm->datapcb, 1);
+            case FTPD_MLSD:
+                send_next_directory(fsm->datafs, fsm->datapcb);
                 break;
             case FTPD_RETR:
             //  send_file(fsm->datafs, fsm->datapcb);
@@ -1215,7 +2016,20 @@ static err_t ftpd_msgpoll (void *arg, struct tcp_pcb *pcb)
 static err_t ftpd_msgaccept (void *arg, struct tcp_pcb *pcb, err_t err)
 {
     LWIP_PLATFORM_DIAG(("ftpd_msgaccept called"));
+    uint_fast8_t idx = 0;
     ftpd_msgstate_t *fsm;
+    char *cwd;
+
+    while(idx < FTPD_MAX_SESSIONS && sessions[idx])
+        idx++;
+
+    if (idx == FTPD_MAX_SESSIONS) {
+        LWIP_DEBUGF(FTPD_DEBUG, ("ftpd_msgaccept: Too many sessions\n"));
+        tcp_write(pcb, msg421, strlen(msg421), TCP_WRITE_FLAG_COPY);
+        tcp_write(pcb, "\r\n", 2, TCP_WRITE_FLAG_COPY);
+        tcp_close(pcb);
+        return ERR_OK;
+    }
 
     /* Allocate memory for the structure that holds the state of the connection. */
     fsm = malloc(sizeof(ftpd_msgstate_t));
@@ -1238,6 +2052,16 @@ static err_t ftpd_msgaccept (void *arg, struct tcp_pcb *pcb, err_t err)
         return ERR_CLSD;
     }
 
+    if ((cwd = vfs_getcwd(NULL, 0)) && strlen(cwd) < FTPD_PATH_MAX && *cwd == '/')
+        strcpy(fsm->cwd, cwd);
+    else
+        strcpy(fsm->cwd, "/");
+
+    if (cwd)
+        free(cwd);
+
+    sessions[idx] = fsm;
+
     /* Tell TCP that this is the structure we wish to be passed for our callbacks. */
     tcp_arg(pcb, fsm);
 
@@ -1259,9 +2083,14 @@ static err_t ftpd_msgaccept (void *arg, struct tcp_pcb *pcb, err_t err)
 void ftpd_poll (void)
 {
 #if FTP_TXPOLL
-    if(poll.pcb) {
-        send_file(poll.fsd, poll.pcb);
-        poll.pcb = NULL;
+    uint_fast8_t idx;
+    ftpd_msgstate_t *fsm;
+
+    for(idx = 0; idx < FTPD_MAX_SESSIONS; idx++) {
+        if((fsm = sessions[idx]) && fsm->datafs && fsm->datafs->txpoll && fsm->datapcb) {
+            fsm->datafs->txpoll = false;
+            send_file(fsm->datafs, fsm->datapcb);
+        }
     }
 #endif
 }
@@ -0,0 +1,332 @@
+//
+// gcode_meta.c - streaming g-code scanner collecting file metadata
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+//
+// Scans g-code as it is received and collects the number of lines, the extents of the X, Y and Z moves,
+// the tools selected, the range of programmed feed rates and an estimate of the run time.
+// The estimate is the sum of distance/rate for each move, acceleration is not accounted for and arcs are taken as
+// their chord. Rapids are included if the rapid rates are provided. Values are reported in mm and mm/min.
+// Expressions, parameters and work offset changes are not evaluated.
+// Like zstream.c this does not depend on the grblHAL or lwIP headers.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "gcode_meta.h"
+
+#define N_META_AXIS 3
+#define MOTION_NONE 0xFF
+#define LIMIT(v) ((v) > 99999.0f ? 99999.0f : ((v) < -99999.0f ? -99999.0f : (v))) // Keeps the formatted values within GCODE_META_JSON_LEN.
+
+struct gcode_meta {
+    uint32_t lines;
+    bool pending;                   // Data seen on the current line.
+    float min[N_META_AXIS];
+    float max[N_META_AXIS];
+    uint_fast8_t axes;              // Bitmap of axes moved.
+    float feed_min;
+    float feed_max;
+    float time;                     // Minutes.
+    float rapid_rate[N_META_AXIS];  // mm/min, 0 if not known.
+    uint_fast8_t n_tools;
+    uint32_t tool[GCODE_META_MAX_TOOLS];
+    // Modal state
+    float pos[N_META_AXIS];
+    float feed;
+    uint_fast8_t motion;
+    bool inches;
+    bool relative;
+    // Current block
+    struct {
+        uint_fast8_t axes;
+        float value[N_META_AXIS];
+        bool nomove;
+        bool feed;
+        float feed_value;
+        bool tool;
+        uint32_t tool_value;
+    } block;
+    // Lexer state
+    bool comment;                   // Inside a (...) comment,
+    bool skip;                      // or skipping to the end of the line.
+    char letter;
+    uint_fast8_t num_len;
+    char num[16];
+};
+
+static const char *const extensions[] = { "nc", "ngc", "gcode", "gc", "tap", "cnc" };
+
+// Returns true if the filename has one of the common g-code file extensions.
+bool gcode_meta_is_gcode (const char *filename)
+{
+    uint_fast8_t idx = sizeof(extensions) / sizeof(char *);
+    const char *ext = strrchr(filename, '.'), *s1, *s2;
+
+    if(ext++) do {
+        s1 = ext;
+        s2 = extensions[--idx];
+        while(*s1 && (*s1 | 0x20) == *s2) {
+            s1++;
+            s2++;
+        }
+        if(*s1 == '\0' && *s2 == '\0')
+            return true;
+    } while(idx);
+
+    return false;
+}
+
+// rapid_rate: max rates of the X, Y and Z axes in mm/min, may be NULL.
+gcode_meta_t *gcode_meta_create (const float *rapid_rate)
+{
+    gcode_meta_t *meta;
+
+    if((meta = calloc(sizeof(gcode_meta_t), 1))) {
+        meta->motion = MOTION_NONE;
+        if(rapid_rate)
+            memcpy(meta->rapid_rate, rapid_rate, sizeof(meta->rapid_rate));
+    }
+
+    return meta;
+}
+
+void gcode_meta_free (gcode_meta_t *meta)
+{
+    free(meta);
+}
+
+static void end_word (gcode_meta_t *meta)
+{
+    uint_fast16_t code;
+    float value;
+
+    if(meta->letter && meta->num_len) {
+
+        meta->num[meta->num_len] = '\0';
+        value = strtof(meta->num, NULL);
+
+        switch(meta->letter) {
+
+            case 'G':
+                switch((code = (uint_fast16_t)(value * 10.0f + 0.5f))) {
+                    case 0: case 10: case 20: case 30:
+                        meta->motion = code / 10;
+                        break;
+                    case 730: case 810: case 820: case 830: case 840: case 850: case 860: case 870: case 880: case 890:
+                        meta->motion = 0;   // Canned cycles, only the positioning is accounted for.
+                        break;
+                    case 800:
+                        meta->motion = MOTION_NONE;
+                        break;
+                    case 200:
+                    case 210:
+                        meta->inches = code == 200;
+                        break;
+                    case 900:
+                    case 910:
+                        meta->relative = code == 910;
+                        break;
+                    default:
+                        // Dwell, offsets, reference point moves, probing etc., axis words are not a move target.
+                        if(code < 170 || (code >= 280 && code < 400) || code == 530 || (code >= 920 && code < 930))
+                            meta->block.nomove = true;
+                        break;
+                }
+                break;
+
+            case 'X':
+            case 'Y':
+            case 'Z':
+                code = meta->letter - 'X';
+                meta->block.axes |= (1 << code);
+                meta->block.value[code] = value;
+                break;
+
+            case 'F':
+                meta->block.feed = true;
+                meta->block.feed_value = value;
+                break;
+
+            case 'T':
+                meta->block.tool = true;
+                meta->block.tool_value = (uint32_t)value;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    meta->letter = '\0';
+}
+
+static void end_block (gcode_meta_t *meta)
+{
+    uint_fast8_t idx;
+    float scale = meta->inches ? 25.4f : 1.0f;
+
+    if(meta->block.feed && meta->block.feed_value > 0.0f) {
+        meta->feed = meta->block.feed_value * scale;
+        if(meta->feed_min == 0.0f || meta->feed < meta->feed_min)
+            meta->feed_min = meta->feed;
+        if(meta->feed > meta->feed_max)
+            meta->feed_max = meta->feed;
+    }
+
+    if(meta->block.tool) {
+        idx = meta->n_tools;
+        while(idx && meta->tool[idx - 1] != meta->block.tool_value)
+            idx--;
+        if(idx == 0 && meta->n_tools < GCODE_META_MAX_TOOLS)
+            meta->tool[meta->n_tools++] = meta->block.tool_value;
+    }
+
+    if(meta->block.axes && !meta->block.nomove && meta->motion != MOTION_NONE) {
+
+        float target, delta, distance = 0.0f, rapid = 0.0f;
+
+        for(idx = 0; idx < N_META_AXIS; idx++) {
+
+            if(!(meta->block.axes & (1 << idx)))
+                continue;
+
+            target = meta->block.value[idx] * scale;
+            if(meta->relative)
+                target += meta->pos[idx];
+
+            delta = target - meta->pos[idx];
+            distance += delta * delta;
+            if(meta->rapid_rate[idx] > 0.0f && fabsf(delta) / meta->rapid_rate[idx] > rapid)
+                rapid = fabsf(delta) / meta->rapid_rate[idx];
+
+            if(!(meta->axes & (1 << idx)) || target < meta->min[idx])
+                meta->min[idx] = target;
+            if(!(meta->axes & (1 << idx)) || target > meta->max[idx])
+                meta->max[idx] = target;
+
+            meta->axes |= (1 << idx);
+            meta->pos[idx] = target;
+        }
+
+        if(meta->motion == 0)
+            meta->time += rapid;
+        else if(meta->feed > 0.0f)
+            meta->time += sqrtf(distance) / meta->feed;
+    }
+
+    memset(&meta->block, 0, sizeof(meta->block));
+}
+
+// Data may be split anywhere, also within words and comments.
+void gcode_meta_scan (gcode_meta_t *meta, const char *data, size_t length)
+{
+    char c;
+    const char *end = data + length;
+
+    while(data < end) {
+
+        c = *data++;
+
+        if(c == '\n') {
+            end_word(meta);
+            end_block(meta);
+            meta->lines++;
+            meta->pending = meta->comment = meta->skip = false;
+            continue;
+        }
+
+        meta->pending = true;
+
+        if(meta->skip)
+            continue;
+
+        if(meta->comment) {
+            meta->comment = c != ')';
+            continue;
+        }
+
+        if((c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+') {
+            if(meta->letter && meta->num_len < sizeof(meta->num) - 1)
+                meta->num[meta->num_len++] = c;
+        } else if(c != ' ' && c != '\t' && c != '\r') {
+            end_word(meta);
+            if((c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+                meta->letter = c & ~0x20;
+                meta->num_len = 0;
+            } else if(c == '(')
+                meta->comment = true;
+            else if(c == ';' || c == '%')
+                meta->skip = true;
+        }
+    }
+}
+
+// Formats the metadata as a JSON object, buf must be at least GCODE_META_JSON_LEN bytes.
+// A last line without a line terminator is included.
+// Returns the length of the string.
+size_t gcode_meta_format (gcode_meta_t *meta, char *buf)
+{
+    uint_fast8_t idx;
+    size_t len;
+
+    if(meta->pending) {
+        end_word(meta);
+        end_block(meta);
+        meta->lines++;
+        meta->pending = meta->comment = meta->skip = false;
+    }
+
+    len = sprintf(buf, "{\"lines\":%lu,\"tools\":[", (unsigned long)meta->lines);
+
+    for(idx = 0; idx < meta->n_tools; idx++)
+        len += sprintf(buf + len, idx ? ",%lu" : "%lu", (unsigned long)meta->tool[idx]);
+
+    len += sprintf(buf + len, "],\"feed\":{\"min\":%.1f,\"max\":%.1f},\"bbox\":{", LIMIT(meta->feed_min), LIMIT(meta->feed_max));
+
+    for(idx = 0; idx < N_META_AXIS; idx++) {
+        if(meta->axes & (1 << idx))
+            len += sprintf(buf + len, "%s\"%c\":[%.3f,%.3f]", buf[len - 1] == '{' ? "" : ",", 'x' + idx, LIMIT(meta->min[idx]), LIMIT(meta->max[idx]));
+    }
+
+    len += sprintf(buf + len, "},\"time\":%lu}", (unsigned long)(meta->time < 7.0e7f ? meta->time * 60.0f + 0.5f : 4.2e9f));
+
+    return len;
+}
@@ -0,0 +1,67 @@
+//
+// gcode_meta.h - streaming g-code scanner collecting file metadata
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef __GCODE_META_H__
+#define __GCODE_META_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Suffix of the sidecar file holding the metadata of a g-code file.
+#ifndef GCODE_META_EXT
+#define GCODE_META_EXT ".meta"
+#endif
+
+// Max number of distinct tools recorded, further tools are not listed.
+#ifndef GCODE_META_MAX_TOOLS
+#define GCODE_META_MAX_TOOLS 16
+#endif
+
+// Max length of the metadata JSON string returned by gcode_meta_format(), including the terminating NUL.
+#define GCODE_META_JSON_LEN (260 + GCODE_META_MAX_TOOLS * 11)
+
+typedef struct gcode_meta gcode_meta_t;
+
+bool gcode_meta_is_gcode (const char *filename);
+gcode_meta_t *gcode_meta_create (const float *rapid_rate);
+void gcode_meta_scan (gcode_meta_t *meta, const char *data, size_t length);
+size_t gcode_meta_format (gcode_meta_t *meta, char *buf);
+void gcode_meta_free (gcode_meta_t *meta);
+
+#endif
@@ -45,25 +45,135 @@
 
 #include "sdcard/sdcard.h"
 
-static struct multipartparser parser;
+// Upload contexts are allocated on first use and kept for reuse by later requests.
+static struct {
+    bool busy;
+    file_upload_t *upload;
+} pool[HTTP_UPLOAD_MAX_CONCURRENT] = {0};
+
 static struct multipartparser_callbacks *sd_callbacks = NULL;
 
+#define SIDECAR_PATH_LEN (HTTP_UPLOAD_MAX_PATHLENGTH + sizeof(GCODE_META_EXT) + sizeof(LINE_INDEX_EXT))
+
+static char *sidecar_path (file_upload_t *upload, char *path, const char *ext)
+{
+    return strcat(strcpy(path, upload->filename), ext);
+}
+
+#ifdef GRBL_VFS
+
+static bool write_index (void *ctx, const void *data, size_t length)
+{
+    return vfs_write(data, 1, length, (vfs_file_t *)ctx) == length;
+}
+
+static void open_index (file_upload_t *upload)
+{
+    char path[SIDECAR_PATH_LEN];
+
+    if((upload->index_file = vfs_open(sidecar_path(upload, path, LINE_INDEX_EXT), "w"))) {
+        if((upload->index = line_index_create(write_index, upload->index_file)) == NULL) {
+            vfs_close(upload->index_file);
+            vfs_unlink(path);
+        }
+    }
+}
+
+// Completes the line index, it is deleted if keep is false or it could not be written.
+static void close_index (file_upload_t *upload, bool keep)
+{
+    char path[SIDECAR_PATH_LEN];
+
+    if(upload->index) {
+        keep = line_index_finish(upload->index, NULL) && keep;
+        line_index_free(upload->index);
+        vfs_close(upload->index_file);
+        if(!keep)
+            vfs_unlink(sidecar_path(upload, path, LINE_INDEX_EXT));
+        upload->index = NULL;
+    }
+}
+
+#endif
+
+// Writes the g-code metadata to a sidecar file next to the uploaded file.
+static void save_meta (file_upload_t *upload)
+{
+    size_t len;
+    char path[SIDECAR_PATH_LEN], *json;
+
+    if((json = malloc(GCODE_META_JSON_LEN))) {
+
+        len = gcode_meta_format(upload->meta, json);
+        sidecar_path(upload, path, GCODE_META_EXT);
+
+        if(upload->to_fatfs) {
+#ifdef GRBL_VFS
+            vfs_file_t *file;
+            if((file = vfs_open(path, "w"))) {
+                if(vfs_write(json, 1, len, file) != len)
+                    vfs_unlink(path);
+                vfs_close(file);
+            }
+#else
+            FIL file;
+            UINT count;
+            if(f_open(&file, path, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK) {
+                f_write(&file, json, len, &count);
+                f_close(&file);
+                if(count != len)
+                    f_unlink(path);
+            }
+#endif
+        }
+#ifdef STDIO_FS
+          else {
+            FILE *file;
+            if((file = fopen(path, "w"))) {
+                fwrite(json, sizeof(char), len, file);
+                fclose(file);
+            }
+        }
+#endif
+        free(json);
+    }
+
+    gcode_meta_free(upload->meta);
+    upload->meta = NULL;
+}
+
 static void do_cleanup (file_upload_t *upload)
 {
-    // close and unlink open file
+    char path[SIDECAR_PATH_LEN];
+
+    if(upload->meta) {
+        gcode_meta_free(upload->meta);
+        upload->meta = NULL;
+    }
+
+    // close and unlink open file, and its metadata and line index if left from an earlier upload
     if(upload->file.handle) {
 #ifdef GRBL_VFS
+        if(upload->wb) {
+            writebehind_close(upload->wb);
+            upload->wb = NULL;
+        }
+        close_index(upload, false);
         vfs_close(upload->file.vfs_handle);
         vfs_unlink(upload->filename);
+        vfs_unlink(sidecar_path(upload, path, GCODE_META_EXT));
+        vfs_unlink(sidecar_path(upload, path, LINE_INDEX_EXT));
 #else
         if(upload->to_fatfs) {
             f_close(upload->file.fatfs_handle);
             f_unlink(upload->filename);
+            f_unlink(sidecar_path(upload, path, GCODE_META_EXT));
         }
   #ifdef STDIO_FS
         else {
             fclose(upload->file.handle);
             unlink(upload->filename);
+            unlink(sidecar_path(upload, path, GCODE_META_EXT));
         }
   #endif
 #endif
@@ -73,9 +183,16 @@ static void do_cleanup (file_upload_t *upload)
 
 static void cleanup (void *upload)
 {
+    uint_fast8_t idx = HTTP_UPLOAD_MAX_CONCURRENT;
+
     if(upload) {
+
         do_cleanup((file_upload_t *)upload);
-        free(upload);
+
+        do {
+            if(pool[--idx].upload == upload)
+                pool[idx].busy = false;
+        } while(idx);
     }
 }
 
@@ -107,6 +224,11 @@ static void on_header_done (struct multipartparser *parser)
                 upload->filename[strlen(upload->filename) - 1] = '\0';
                 if(*upload->size_str)
                     upload->size = atoi(upload->size_str);
+                if(upload->quota && upload->size > upload->quota) {
+                    upload->state = Upload_Failed;
+                    upload->failed = true;
+                    *upload->filename = '\0';
+                }
             } else if(strstr(upload->header_value, "name=\"")) {
                 upload->state = Upload_GetSize;
                 *upload->size_str = '\0';
@@ -120,8 +242,11 @@ static void on_header_done (struct multipartparser *parser)
 
             if(upload->to_fatfs) {
 #ifdef GRBL_VFS
-                if((upload->file.vfs_handle = vfs_open(upload->filename, "w")) != NULL)
+                // The window is managed by the caller, the write-behind buffer only aggregates the writes into sector aligned blocks.
+                if((upload->file.vfs_handle = vfs_open(upload->filename, "w")) != NULL) {
+                    upload->wb = writebehind_create(upload->file.vfs_handle, 0, 0, NULL, NULL);
                     upload->state = Upload_Write;
+                }
 #else
                 upload->file.fatfs_handle = &upload->fatfs_fd;
                 if(f_open(upload->file.fatfs_handle, upload->filename, FA_WRITE|FA_CREATE_ALWAYS) == FR_OK)
@@ -135,6 +260,16 @@ static void on_header_done (struct multipartparser *parser)
                 upload->state = Upload_Write;
 #endif
             upload->uploaded = 0;
+            sha1_init(&upload->sha1);
+
+            if(upload->state == Upload_Write && gcode_meta_is_gcode(upload->filename)) {
+                float rapid_rate[3] = { settings.axis[X_AXIS].max_rate, settings.axis[Y_AXIS].max_rate, settings.axis[Z_AXIS].max_rate };
+                upload->meta = gcode_meta_create(rapid_rate);
+#ifdef GRBL_VFS
+                if(upload->to_fatfs)
+                    open_index(upload);
+#endif
+            }
         }
     }
 
@@ -175,9 +310,14 @@ static int on_data (struct multipartparser *parser, const char* data, size_t siz
         case Upload_Write:
             {
                 size_t count;
-                if(upload->to_fatfs) {
+                if(upload->quota && upload->uploaded + size > upload->quota)
+                    count = 0;
+                else if(upload->to_fatfs) {
 #ifdef GRBL_VFS
-                    count = vfs_write(data, 1, size, upload->file.vfs_handle);
+                    if(upload->wb)
+                        count = writebehind_write(upload->wb, data, size) ? size : 0;
+                    else
+                        count = vfs_write(data, 1, size, upload->file.vfs_handle);
 #else
                     f_write(upload->file.fatfs_handle, data, size, &count);
 #endif
@@ -185,6 +325,15 @@ static int on_data (struct multipartparser *parser, const char* data, size_t siz
                     count = fwrite(data, sizeof(char), size, upload->file.handle);
                 if(count != size)
                     upload->state = Upload_Failed;
+                else {
+                    sha1_update(&upload->sha1, (const BYTE *)data, size);
+                    if(upload->meta)
+                        gcode_meta_scan(upload->meta, data, size);
+#ifdef GRBL_VFS
+                    if(upload->index && !line_index_scan(upload->index, data, size))
+                        close_index(upload, false);
+#endif
+                }
                 upload->uploaded += count;
             }
             break;
@@ -211,10 +360,33 @@ static int on_part_end (struct multipartparser *parser)
     switch(upload->state) {
 
         case Upload_Write:
+            {
+                uint8_t sha1[SHA1_BLOCK_SIZE];
+
+                sha1_final(&upload->sha1, sha1);
+                http_set_response_digest(upload->req, sha1, upload->digest);
+
+                // Delete the file if it does not match the digest provided by the client.
+                if(*upload->expected_digest && strcmp(upload->expected_digest, upload->digest)) {
+                    upload->failed = true;
+                    do_cleanup(upload);
+                    break;
+                }
+            }
             if(upload->to_fatfs) {
 #ifdef GRBL_VFS
+                if(upload->wb) {
+                    bool ok = writebehind_close(upload->wb);
+                    upload->wb = NULL;
+                    if(!ok) {
+                        upload->failed = true;
+                        do_cleanup(upload);
+                        break;
+                    }
+                }
                 vfs_close(upload->file.vfs_handle);
                 upload->file.vfs_handle = NULL;
+                close_index(upload, true);
 #else
                 f_close(upload->file.fatfs_handle);
                 upload->file.fatfs_handle = NULL;
@@ -225,9 +397,12 @@ static int on_part_end (struct multipartparser *parser)
 #endif
                 upload->file.handle = NULL;
             }
+            if(upload->meta)
+                save_meta(upload);
             break;
 
         case Upload_Failed:
+            upload->failed = true;
             do_cleanup(upload);
             break;
 
@@ -253,12 +428,19 @@ void http_upload_on_filename_parsed (file_upload_t *upload, http_upload_filename
     upload->on_filename_parsed_arg = data;
 }
 
+// Sets the max size of the uploaded file, the upload fails and the file is deleted when exceeded. 0 for no limit.
+void http_upload_set_quota (file_upload_t *upload, size_t max_size)
+{
+    upload->quota = max_size;
+}
+
 file_upload_t *http_upload_start (http_request_t *request, const char* boundary, bool to_fatfs)
 {
+    file_upload_t *upload = NULL;
 
 #ifndef STDIO_FS
     if(!to_fatfs)
-        return false;
+        return NULL;
 #endif
 
     if(sd_callbacks == NULL && (sd_callbacks = malloc(sizeof(struct multipartparser_callbacks)))) {
@@ -277,21 +459,40 @@ file_upload_t *http_upload_start (http_request_t *request, const char* boundary,
 
     if(sd_callbacks) {
 
-        multipartparser_init(&parser, boundary);
-        if((parser.data = malloc(sizeof(file_upload_t)))) {
-            request->private_data = parser.data;
+        uint_fast8_t idx = 0;
+
+        while(idx < HTTP_UPLOAD_MAX_CONCURRENT && pool[idx].busy)
+            idx++;
+
+        // Rejected if all contexts are in use.
+        if(idx < HTTP_UPLOAD_MAX_CONCURRENT && (pool[idx].upload || (pool[idx].upload = malloc(sizeof(file_upload_t))))) {
+
+            upload = pool[idx].upload;
+            pool[idx].busy = true;
+
+            memset(upload, 0, sizeof(file_upload_t));
+            upload->req = request;
+            upload->to_fatfs = to_fatfs;
+            upload->quota = HTTP_UPLOAD_QUOTA;
+
+            multipartparser_init(&upload->parser, boundary);
+            upload->parser.data = upload;
+
+            http_get_request_digest(request, upload->expected_digest);
+
+            request->private_data = upload;
             request->on_request_completed = cleanup;
-            memset(parser.data, 0, sizeof(file_upload_t));
-            ((file_upload_t *)parser.data)->to_fatfs = to_fatfs;
         }
     }
 
-    return parser.data;
+    return upload;
 }
 
 size_t http_upload_chunk (http_request_t *req, const char* data, size_t size)
 {
-    return multipartparser_execute(&parser, sd_callbacks, data, size);
+    file_upload_t *upload = (file_upload_t *)req->private_data;
+
+    return upload ? multipartparser_execute(&upload->parser, sd_callbacks, data, size) : 0;
 }
 
 #endif
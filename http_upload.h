@@ -29,9 +29,26 @@
 
 #include "grbl/vfs.h"
 #include "networking/httpd.h"
+#include "networking/multipartparser.h"
+#include "networking/gcode_meta.h"
+#include "networking/line_index.h"
+#include "networking/sha1.h"
+#ifdef GRBL_VFS
+#include "networking/writebehind.h"
+#endif
 
 #define HTTP_UPLOAD_MAX_PATHLENGTH 100
 
+// Max number of uploads in progress, further uploads are rejected until one completes.
+#ifndef HTTP_UPLOAD_MAX_CONCURRENT
+#define HTTP_UPLOAD_MAX_CONCURRENT 2
+#endif
+
+// Default max size of an uploaded file in bytes, 0 for no limit. See http_upload_set_quota().
+#ifndef HTTP_UPLOAD_QUOTA
+#define HTTP_UPLOAD_QUOTA 0
+#endif
+
 typedef enum
 {
     Upload_Parsing = 0,
@@ -61,19 +78,34 @@ typedef struct {
     char path[HTTP_UPLOAD_MAX_PATHLENGTH + 1];
     char size_str[15];
     file_handle_t file;
+#ifdef GRBL_VFS
+    writebehind_t *wb;
+#endif
     http_request_t *req;
 #ifndef GRBL_VFS
     FIL fatfs_fd;
 #endif
     size_t size;
     size_t uploaded;
+    size_t quota;
+    bool failed;                            // Set if the file could not be written, exceeded the quota or did not match the expected digest.
+    SHA1_CTX sha1;
+    char digest[HTTP_DIGEST_LEN];           // Base64 encoded SHA-1 digest of the uploaded file, also returned in the Digest response header.
+    char expected_digest[HTTP_DIGEST_LEN];  // From the Digest request header, empty if not provided.
+    gcode_meta_t *meta;                     // G-code metadata collected while uploading, saved to a sidecar file. NULL if not a g-code file.
+#ifdef GRBL_VFS
+    line_index_t *index;                    // Line index of g-code files, written to a sidecar file while uploading.
+    vfs_file_t *index_file;
+#endif
     http_upload_filename_parsed_ptr on_filename_parsed;
     void *on_filename_parsed_arg;
+    struct multipartparser parser;
 } file_upload_t;
 
 file_upload_t *http_upload_start (http_request_t *req, const char* boundary, bool to_fatfs);
 size_t http_upload_chunk (http_request_t *req, const char* data, size_t size);
 void http_upload_on_filename_parsed (file_upload_t *upload, http_upload_filename_parsed_ptr fn, void *data);
+void http_upload_set_quota (file_upload_t *upload, size_t max_size);
 
 #endif
 
@@ -85,6 +85,7 @@
 #include "lwip/debug.h"
 #include "lwip/stats.h"
 #include "lwip/def.h"
+#include "lwip/timeouts.h"
 
 #ifdef LWIP_HOOK_FILENAME
 #include LWIP_HOOK_FILENAME
@@ -95,13 +96,47 @@
 
 #include "strutils.h"
 #include "urldecode.h"
+#include "base64.h"
+#include "sha1.h"
+#include "line_index.h"
+
+/* Size of the send buffer allocated for responses produced by a generator, see http_set_response_generator() */
+#ifndef HTTPD_GENERATOR_BUF_LEN
+#define HTTPD_GENERATOR_BUF_LEN TCP_MSS
+#endif
+
+/* Max number of lines returned for a GET request with a lines=<first>-<last> parameter, see http_lines_init() */
+#ifndef HTTPD_MAX_LINES
+#define HTTPD_MAX_LINES 1000
+#endif
+
+/* Max number of HTTPD_GENERATOR_BUF_LEN sized blocks of a file scanned per step when a line index is built in the background */
+#ifndef HTTPD_LINE_INDEX_BLOCKS
+#define HTTPD_LINE_INDEX_BLOCKS 4
+#endif
+
+/* Delay between line index build steps in milliseconds */
+#ifndef HTTPD_LINE_INDEX_STEP
+#define HTTPD_LINE_INDEX_STEP 1
+#endif
+
+/* Retry-After value (seconds) of the 503 response returned while a line index is being built */
+#ifndef HTTPD_LINE_INDEX_RETRY
+#define HTTPD_LINE_INDEX_RETRY "1"
+#endif
+
+#ifdef ESP_PLATFORM
+#define ST_MTIME(st) ((st)->st_mtim)
+#else
+#define ST_MTIME(st) ((st)->st_mtime)
+#endif
 
 /**/
 
 #if LWIP_HTTPD_DYNAMIC_HEADERS
 
 /* The number of individual strings that comprise the headers sent before each requested file. */
-#define NUM_FILE_HDR_STRINGS            8
+#define NUM_FILE_HDR_STRINGS            10
 #define HDR_STRINGS_IDX_HTTP_STATUS     0 /* e.g. "HTTP/1.0 200 OK\r\n" */
 #define HDR_STRINGS_IDX_SERVER_NAME     1 /* e.g. "Server: "HTTPD_SERVER_AGENT"\r\n" */
 #define HDR_STRINGS_IDX_CONTENT_NEXT    2 /* the content type (or default answer content type including default document) */
@@ -238,6 +273,8 @@ struct http_state {
 #if LWIP_HTTPD_DYNAMIC_FILE_READ
     char *buf;        /* File read buffer. */
     int buf_len;      /* Size of file read buffer, buf. */
+    u32_t lines_skip; /* Number of lines to skip before the first line to send, see http_lines_generate() */
+    u32_t lines_left; /* Number of lines left to send */
 #endif /* LWIP_HTTPD_DYNAMIC_FILE_READ */
 #if LWIP_HTTPD_SUPPORT_11_KEEPALIVE
     u8_t keepalive;
@@ -249,6 +286,11 @@ struct http_state {
     u32_t time_started;
 #endif /* LWIP_HTTPD_TIMING */
     u32_t post_content_len_left;
+    bool upgraded;          /* Connection has been handed over to another protocol handler */
+    bool manual_wnd;        /* Receive window for the request body is opened by the application via http_recved() */
+    u32_t wnd_held;         /* Number of body bytes received but not yet released to the receive window */
+    http_generator_ptr generator; /* Response body producer, used instead of a file */
+    bool deferred;          /* Response is sent by the application via http_send_deferred_response() */
     http_request_t request;
 #if LWIP_HTTPD_POST_MANUAL_WND
     u32_t unrecved_bytes;
@@ -505,6 +547,15 @@ static http_state_t *http_state_alloc (void)
  */
 static void http_state_eof (http_state_t *hs)
 {
+    /* also called between requests on persistent connections */
+    if(hs->request.on_request_completed) {
+        hs->request.on_request_completed(hs->request.private_data);
+        hs->request.on_request_completed = NULL;
+    }
+
+    hs->generator = NULL;
+    hs->deferred = false;
+
     if (hs->handle) {
 #if LWIP_HTTPD_TIMING
         u32_t ms_needed = sys_now() - hs->time_started;
@@ -549,8 +600,6 @@ void http_set_allowed_methods (const char *methods)
 static void http_state_free (http_state_t *hs)
 {
     if (hs != NULL) {
-        if(hs->request.on_request_completed)
-            hs->request.on_request_completed(hs->request.private_data);
         http_state_eof(hs);
         http_remove_connection(hs);
         HTTP_FREE_HTTP_STATE(hs);
@@ -585,29 +634,44 @@ char *http_get_param_value (http_request_t *request, const char *name, char *val
 
     *value = '\0';
 
+    // Values longer than size are not returned, the decoded value is never longer than the raw value.
     if(idx) do {
-        if((found = strcmp(name, hs->params[--idx]) == 0))
+        if((found = strcmp(name, hs->params[--idx]) == 0 && strlen(hs->param_vals[idx]) <= size))
             urldecode(value, hs->param_vals[idx]);
     } while(idx && !found);
 
     return found ? value : NULL;
 }
 
+// Returns a pointer to the value of the named header, NULL if not present.
+// Only matches at the start of a header line so that e.g. "Upgrade" is not found in "Connection: Upgrade".
+static char *http_find_header (http_state_t *hs, const char *name)
+{
+    char *hdr = (char *)hs->hdr, *end = (char *)hs->hdr + hs->hdr_len;
+    size_t len = strlen(name);
+
+    while(hdr < end && (hdr = strnistr(hdr, name, end - hdr))) {
+        if((hdr == hs->hdr || *(hdr - 1) == '\n') && hdr[len] == ':') {
+            hdr += len + 1;
+            if(*hdr == ' ')
+                hdr++;
+            return hdr;
+        }
+        hdr += len;
+    }
+
+    return NULL;
+}
+
 int http_get_header_value_len (http_request_t *request, const char *name)
 {
     int len = -1;
     char *hdr, *end;
     http_state_t *hs = request->handle;
 
-    if ((hdr = strnistr(hs->hdr, name, hs->hdr_len))) {
-        hdr += strlen(name);
-        if(*hdr == ':') {
-            hdr++;
-            if(*hdr == ' ')
-                hdr++;
-            if ((end = lwip_strnstr(hdr, CRLF, hs->hdr_len)))
-                len = end - hdr;
-        }
+    if ((hdr = http_find_header(hs, name))) {
+        if ((end = lwip_strnstr(hdr, CRLF, hs->hdr_len)))
+            len = end - hdr;
     }
 
     return len;
@@ -617,20 +681,14 @@ char *http_get_header_value (http_request_t *request, const char *name, char *va
 {
     char *hdr, *end = NULL;
     http_state_t *hs = request->handle;
-    size_t len = strlen(name);
+    size_t len;
 
     *value = '\0';
-    if ((hdr = strnistr(hs->hdr, name, hs->hdr_len))) {
-        hdr += len;
-        if(*hdr == ':') {
-            hdr++;
-            if(*hdr == ' ')
-                hdr++;
-            if ((end = lwip_strnstr(hdr, CRLF, size + 2)) && end - hdr <= size) {
-                len = end - hdr;
-                memcpy(value, hdr, len);
-                value[len] = '\0';
-            }
+    if ((hdr = http_find_header(hs, name))) {
+        if ((end = lwip_strnstr(hdr, CRLF, size + 2)) && end - hdr <= size) {
+            len = end - hdr;
+            memcpy(value, hdr, len);
+            value[len] = '\0';
         }
     }
 
@@ -881,6 +939,448 @@ void http_set_response_status (http_request_t *request, const char *status)
     }
 }
 
+static char *get_header_value (http_request_t *request, const char *name)
+{
+    char *value = NULL;
+    int len = http_get_header_value_len(request, name);
+
+    if(len > 0 && (value = malloc(len + 1)))
+        http_get_header_value(request, name, value, len);
+
+    return value;
+}
+
+/** Create a strong validator for a file from its size and modification time.
+ *
+ * @param st file status
+ * @param etag buffer of at least HTTP_ETAG_LEN characters
+ * @return false if the file system does not provide modification times
+ */
+bool http_get_etag (vfs_stat_t *st, char *etag)
+{
+    if(ST_MTIME(st) == 0)
+        *etag = '\0';
+    else
+        snprintf(etag, HTTP_ETAG_LEN, "\"%lx-%lx\"", (unsigned long)st->st_size, (unsigned long)ST_MTIME(st));
+
+    return *etag != '\0';
+}
+
+/* Returns true if etag is in the comma separated list of entity tags, a weak comparison ignores the W/ prefix. */
+static bool etag_match (const char *list, const char *etag, bool weak)
+{
+    bool is_weak;
+    size_t len = strlen(etag);
+
+    while(*list) {
+
+        while(*list == ' ' || *list == ',')
+            list++;
+
+        if(*list == '*')
+            return true;
+
+        if((is_weak = !strncmp(list, "W/", 2)))
+            list += 2;
+
+        if(len && (weak || !is_weak) && !strncmp(list, etag, len) && (list[len] == '\0' || list[len] == ',' || list[len] == ' '))
+            return true;
+
+        while(*list && *list != ',')
+            list++;
+    }
+
+    return false;
+}
+
+/* Returns false if the date cannot be parsed or the file system does not provide modification times,
+   modified is set if the file has been modified after the date. */
+static bool is_modified_since (vfs_stat_t *st, char *date, bool *modified)
+{
+    struct tm since = {0}, *mtime;
+    time_t t = ST_MTIME(st);
+
+    if(t == 0 || !strtotime(date, &since) || since.tm_mon < 0 || (mtime = gmtime(&t)) == NULL)
+        return false;
+
+    if(mtime->tm_year != since.tm_year)
+        *modified = mtime->tm_year > since.tm_year;
+    else if(mtime->tm_mon != since.tm_mon)
+        *modified = mtime->tm_mon > since.tm_mon;
+    else if(mtime->tm_mday != since.tm_mday)
+        *modified = mtime->tm_mday > since.tm_mday;
+    else if(mtime->tm_hour != since.tm_hour)
+        *modified = mtime->tm_hour > since.tm_hour;
+    else if(mtime->tm_min != since.tm_min)
+        *modified = mtime->tm_min > since.tm_min;
+    else
+        *modified = mtime->tm_sec > since.tm_sec;
+
+    return true;
+}
+
+/** Evaluate the If-Match, If-Unmodified-Since, If-None-Match and If-Modified-Since
+ * request headers against the current state of a resource, see RFC 7232 section 6.
+ *
+ * @param request request to check
+ * @param st status of the resource, NULL if it does not exist
+ * @return 0 if the request is to be performed, else the status code to respond with: 304 or 412
+ */
+uint_fast16_t http_check_preconditions (http_request_t *request, vfs_stat_t *st)
+{
+    bool modified, read = request->handle->method == HTTP_Get || request->handle->method == HTTP_Head;
+    char *value, etag[HTTP_ETAG_LEN];
+    uint_fast16_t status = 0;
+
+    if(st == NULL || !http_get_etag(st, etag))
+        *etag = '\0';
+
+    if((value = get_header_value(request, "If-Match"))) {
+        if(st == NULL || !etag_match(value, etag, false))
+            status = 412;
+        free(value);
+    } else if(st && (value = get_header_value(request, "If-Unmodified-Since"))) {
+        if(is_modified_since(st, value, &modified) && modified)
+            status = 412;
+        free(value);
+    }
+
+    if(status == 0) {
+        if((value = get_header_value(request, "If-None-Match"))) {
+            if(st && etag_match(value, etag, true))
+                status = read ? 304 : 412;
+            free(value);
+        } else if(read && st && (value = get_header_value(request, "If-Modified-Since"))) {
+            if(is_modified_since(st, value, &modified) && !modified)
+                status = 304;
+            free(value);
+        }
+    }
+
+    return status;
+}
+
+/** Add the ETag and Last-Modified response headers for a file.
+ *
+ * @param request request to respond to
+ * @param st file status
+ */
+void http_set_response_validators (http_request_t *request, vfs_stat_t *st)
+{
+    char etag[HTTP_ETAG_LEN];
+    time_t mtime = ST_MTIME(st);
+
+    if(http_get_etag(st, etag)) {
+        http_set_response_header(request, "ETag", etag);
+        http_set_response_header(request, "Last-Modified", strtointernetdt(gmtime(&mtime)));
+    }
+}
+
+/** Get the expected SHA-1 digest of the request body from a Digest: SHA=<base64> header, see RFC 3230.
+ *
+ * @param request request to check
+ * @param digest buffer of at least HTTP_DIGEST_LEN characters for the base64 encoded digest
+ * @return false if no SHA-1 digest is provided
+ */
+bool http_get_request_digest (http_request_t *request, char *digest)
+{
+    char *value, *sha;
+    size_t len = 0;
+
+    *digest = '\0';
+
+    if((value = get_header_value(request, "Digest"))) {
+
+        if((sha = strnistr(value, "SHA=", strlen(value))) && (sha == value || sha[-1] == ',' || sha[-1] == ' ')) {
+            sha += 4;
+            while(sha[len] && sha[len] != ',' && sha[len] != ' ')
+                len++;
+            if(len == HTTP_DIGEST_LEN - 1) {
+                memcpy(digest, sha, len);
+                digest[len] = '\0';
+            }
+        }
+
+        free(value);
+    }
+
+    return *digest != '\0';
+}
+
+/** Add a Digest: SHA=<base64> response header, see RFC 3230.
+ *
+ * @param request request to respond to
+ * @param sha1 SHA-1 digest of the body received
+ * @param digest buffer of at least HTTP_DIGEST_LEN characters for the base64 encoded digest, may be NULL
+ */
+void http_set_response_digest (http_request_t *request, const uint8_t *sha1, char *digest)
+{
+    char value[HTTP_DIGEST_LEN + 4] = "SHA=";
+
+    value[4 + base64_encode(sha1, (uint8_t *)&value[4], SHA1_BLOCK_SIZE, 0)] = '\0';
+
+    http_set_response_header(request, "Digest", value);
+
+    if(digest)
+        strcpy(digest, &value[4]);
+}
+
+/* Sub-function of http_find_file(): add validators to a GET or HEAD response and evaluate
+   the preconditions, returns false if the file is not to be sent. */
+static bool http_file_preconditions (http_state_t *hs, const char *uri)
+{
+    vfs_stat_t st;
+    uint_fast16_t status;
+
+    if(vfs_stat(uri, &st) != 0 || st.st_mode.directory)
+        return true;
+
+    http_set_response_validators(&hs->request, &st);
+
+    if((status = http_check_preconditions(&hs->request, &st)))
+        http_set_response_status(&hs->request, status == 304 ? "304 Not Modified" : "412 Precondition Failed");
+
+    return status == 0;
+}
+
+#if LWIP_HTTPD_DYNAMIC_FILE_READ
+
+/* State of the line index being built in the background, only one index is built at a time */
+typedef struct {
+    vfs_file_t *file;       /* File being indexed, opened separately from any request */
+    vfs_file_t *idx;
+    line_index_t *index;
+    size_t size;            /* Size of the file when the build was started */
+    char *buf;
+    char path[];            /* Index file */
+} http_line_indexer_t;
+
+static http_line_indexer_t *indexer = NULL;
+
+static bool http_line_index_write (void *ctx, const void *data, size_t length)
+{
+    return vfs_write(data, 1, length, (vfs_file_t *)ctx) == length;
+}
+
+static void http_line_indexer_free (bool ok)
+{
+    if(indexer->index)
+        line_index_free(indexer->index);
+
+    if(indexer->idx)
+        vfs_close(indexer->idx);
+
+    if(indexer->file)
+        vfs_close(indexer->file);
+
+    if(!ok)
+        vfs_unlink(indexer->path);
+
+    free(indexer->buf);
+    free(indexer);
+    indexer = NULL;
+}
+
+/* Scans up to HTTPD_LINE_INDEX_BLOCKS blocks of the file being indexed, called from a lwIP timeout */
+static void http_line_indexer_step (void *arg)
+{
+    bool ok = true;
+    size_t len = 1;
+    uint_fast8_t blocks = HTTPD_LINE_INDEX_BLOCKS;
+    line_index_trailer_t trailer;
+
+    LWIP_UNUSED_ARG(arg);
+
+    while(ok && len && blocks--)
+        ok = (len = vfs_read(indexer->buf, 1, HTTPD_GENERATOR_BUF_LEN, indexer->file)) == 0 || line_index_scan(indexer->index, indexer->buf, len);
+
+    if(ok && len)
+        sys_timeout(HTTPD_LINE_INDEX_STEP, http_line_indexer_step, NULL);
+    else
+        http_line_indexer_free(ok && line_index_finish(indexer->index, &trailer) && trailer.size == indexer->size);
+}
+
+/* Starts building the line index of a file in the background, returns false on failure */
+static bool http_line_indexer_start (const char *uri, const char *path, vfs_stat_t *st)
+{
+    if((indexer = calloc(1, sizeof(http_line_indexer_t) + strlen(path) + 1)) == NULL)
+        return false;
+
+    indexer->size = st->st_size;
+    strcpy(indexer->path, path);
+
+    if(!((indexer->buf = malloc(HTTPD_GENERATOR_BUF_LEN)) &&
+          (indexer->file = vfs_open(uri, "r")) &&
+           (indexer->idx = vfs_open(path, "w")) &&
+            (indexer->index = line_index_create(http_line_index_write, indexer->idx)))) {
+        http_line_indexer_free(false);
+        return false;
+    }
+
+    sys_timeout(HTTPD_LINE_INDEX_STEP, http_line_indexer_step, NULL);
+
+    return true;
+}
+
+/* Sub-function of http_lines_init(): open the line index of a file. If missing or older than the file
+   the index is built in the background, HTTPD_LINE_INDEX_BLOCKS blocks per step so that the network
+   stack is not blocked, and building is set. G-code files uploaded via the WebUI are indexed during the upload.
+   Returns the index file, NULL on failure or when the index is not ready. */
+static vfs_file_t *http_line_index_open (const char *uri, vfs_stat_t *st, line_index_trailer_t *trailer, bool *building)
+{
+    char *path;
+    vfs_stat_t ist;
+    vfs_file_t *idx = NULL;
+
+    *building = false;
+
+    if((path = malloc(strlen(uri) + sizeof(LINE_INDEX_EXT))) == NULL)
+        return NULL;
+
+    strcat(strcpy(path, uri), LINE_INDEX_EXT);
+
+    if(indexer && !strcmp(indexer->path, path))
+        *building = true;
+
+    else if(vfs_stat(path, &ist) == 0 && ist.st_size >= sizeof(line_index_trailer_t) && ST_MTIME(&ist) >= ST_MTIME(st) &&
+        (idx = vfs_open(path, "r"))) {
+
+        if(!(vfs_seek(idx, ist.st_size - sizeof(line_index_trailer_t)) == 0 &&
+              vfs_read(trailer, 1, sizeof(line_index_trailer_t), idx) == sizeof(line_index_trailer_t) &&
+               trailer->magic == LINE_INDEX_MAGIC && trailer->interval == LINE_INDEX_INTERVAL && trailer->size == st->st_size)) {
+            vfs_close(idx);
+            idx = NULL;
+        }
+    }
+
+    /* An index of another file being built delays this one */
+    if(idx == NULL && !*building)
+        *building = indexer != NULL || http_line_indexer_start(uri, path, st);
+
+    free(path);
+
+    return idx;
+}
+
+/* Response generator for http_lines_init(), sends lines_left lines after skipping lines_skip lines
+   from the current position of the file. */
+static int http_lines_generate (http_request_t *request, char *buf, size_t size)
+{
+    http_state_t *hs = request->handle;
+    char *s, *start, *end;
+    size_t len;
+
+    while(hs->lines_left && (len = vfs_read(buf, 1, size, hs->handle))) {
+
+        s = buf;
+        end = buf + len;
+
+        while(hs->lines_skip && s < end) {
+            if((s = memchr(s, '\n', end - s)) == NULL)
+                s = end;
+            else {
+                s++;
+                hs->lines_skip--;
+            }
+        }
+
+        start = s;
+
+        while(hs->lines_left && s < end) {
+            if((s = memchr(s, '\n', end - s)) == NULL)
+                s = end; /* Partial line, continued in the next block */
+            else {
+                s++;
+                hs->lines_left--;
+            }
+        }
+
+        if((len = s - start)) {
+            if(start != buf)
+                memmove(buf, start, len);
+            return (int)len;
+        }
+    }
+
+    return 0;
+}
+
+/* Sub-function of http_process_request(): set up a response with the lines first to last (one based) of a file
+   when requested with a lines=<first>[-<last>] parameter. The number of lines returned is limited to HTTPD_MAX_LINES,
+   the total number of lines in the file is returned in a X-Line-Count header.
+   The sparse line index is used to seek close to the first line, at most LINE_INDEX_INTERVAL - 1 lines are
+   read and skipped before the response data.
+   Returns false if the parameter is not present, the file is then sent as is.
+   Otherwise the file is either closed or handed over to the response generator. */
+static bool http_lines_init (http_state_t *hs, const char *uri, vfs_file_t *file)
+{
+    char value[24], *s;
+    u32_t first, last, offset = 0;
+    bool building = false;
+    vfs_stat_t st;
+    vfs_file_t *idx;
+    line_index_trailer_t trailer;
+
+    if(hs->method != HTTP_Get || http_get_param_value(&hs->request, "lines", value, sizeof(value) - 1) == NULL)
+        return false;
+
+    first = strtoul(value, &s, 10);
+    last = *s == '-' && s[1] ? strtoul(s + 1, &s, 10) : first + HTTPD_MAX_LINES - 1;
+
+    if(first == 0 || last < first || *s) {
+        http_set_response_status(&hs->request, "400 Bad Request");
+        vfs_close(file);
+        return true;
+    }
+
+    if(vfs_stat(uri, &st) != 0 || (idx = http_line_index_open(uri, &st, &trailer, &building)) == NULL) {
+        if(building) {
+            http_set_response_status(&hs->request, "503 Service Unavailable");
+            http_set_response_header(&hs->request, "Retry-After", HTTPD_LINE_INDEX_RETRY);
+        } else
+            http_set_response_status(&hs->request, "500 Internal Server Error");
+        vfs_close(file);
+        return true;
+    }
+
+    first--;
+    if(last > trailer.lines)
+        last = trailer.lines;
+    if(last - first > HTTPD_MAX_LINES)
+        last = first + HTTPD_MAX_LINES;
+
+    /* Look up the offset of the closest indexed line before the first line */
+    if(first < trailer.lines && first >= LINE_INDEX_INTERVAL &&
+        !(vfs_seek(idx, (first / LINE_INDEX_INTERVAL - 1) * sizeof(uint32_t)) == 0 &&
+           vfs_read(&offset, 1, sizeof(uint32_t), idx) == sizeof(uint32_t)))
+        first = trailer.lines; /* Failed, respond as out of range */
+
+    vfs_close(idx);
+
+    sprintf(value, "%lu", (unsigned long)trailer.lines);
+    http_set_response_header(&hs->request, "X-Line-Count", value);
+
+    if(first >= trailer.lines || vfs_seek(file, offset) != 0) {
+        http_set_response_status(&hs->request, "416 Range Not Satisfiable");
+        vfs_close(file);
+        return true;
+    }
+
+    hs->lines_skip = first % LINE_INDEX_INTERVAL;
+    hs->lines_left = last - first;
+
+    http_set_response_status(&hs->request, "200 OK");
+    http_set_response_header(&hs->request, "Content-Type", "text/plain");
+    http_set_response_generator(&hs->request, http_lines_generate);
+
+    /* The file is read by the generator and closed when the response is complete */
+    http_init_file(hs, NULL, uri, NULL);
+    hs->handle = file;
+
+    return true;
+}
+
+#endif /* LWIP_HTTPD_DYNAMIC_FILE_READ */
 
 /* We are dealing with a particular filename. Look for one other
 special case.  We assume that any filename with "404" in it must be
@@ -1021,8 +1521,9 @@ static http_send_state_t http_send_headers (struct altcp_pcb *pcb, http_state_t
     u16_t len, hdrlen, sendlen;
     http_send_state_t data_to_send = HTTPSend_NoData;
 
+    /* A generator may read from hs->handle, the body length is not known and the connection is closed when done */
     if (!is_response_header_set(hs, "Content-Length")) {
-        get_http_content_length(hs, hs->handle != NULL ? hs->handle->size : -1);
+        get_http_content_length(hs, hs->handle != NULL && hs->generator == NULL ? hs->handle->size : -1);
 //        get_http_content_length(hs, (hs->handle != NULL) && (hs->handle->flags & FS_FILE_FLAGS_HEADER_PERSISTENT) ? hs->handle->len : -1);
     }
 
@@ -1106,6 +1607,40 @@ static http_send_state_t http_send_headers (struct altcp_pcb *pcb, http_state_t
 }
 #endif /* LWIP_HTTPD_DYNAMIC_HEADERS */
 
+#if LWIP_HTTPD_DYNAMIC_FILE_READ
+/** Sub-function of http_check_eof(): fill the send buffer from the response generator.
+ *
+ * @returns: false if the response is finished or failed
+ *           true if data has been generated
+ */
+static bool http_generate (struct altcp_pcb *pcb, http_state_t *hs)
+{
+    int count;
+
+    if (hs->buf == NULL) {
+        if ((hs->buf = (char *)mem_malloc((mem_size_t)HTTPD_GENERATOR_BUF_LEN)) == NULL) {
+            LWIP_DEBUGF(HTTPD_DEBUG, ("No buff\n"));
+            return false;
+        }
+        hs->buf_len = HTTPD_GENERATOR_BUF_LEN;
+    }
+
+    if ((count = hs->generator(&hs->request, hs->buf, hs->buf_len)) <= 0) {
+        /* Response complete, or failed and the connection is closed as the body length is not known to the client. */
+        if (count < 0)
+            http_close_conn(pcb, hs);
+        else
+            http_eof(pcb, hs);
+        return false;
+    }
+
+    hs->left = count;
+    hs->file = hs->buf;
+
+    return true;
+}
+#endif /* LWIP_HTTPD_DYNAMIC_FILE_READ */
+
 /** Sub-function of http_send(): end-of-file (or block) is reached,
  * either close the file or read the next block (if supported).
  *
@@ -1122,6 +1657,11 @@ static bool http_check_eof (struct altcp_pcb *pcb, http_state_t *hs)
   #endif /* HTTPD_MAX_WRITE_LEN */
 #endif /* LWIP_HTTPD_DYNAMIC_FILE_READ */
 
+#if LWIP_HTTPD_DYNAMIC_FILE_READ
+    if (hs->generator)
+        return http_generate(pcb, hs);
+#endif
+
     /* Do we have a valid file handle? */
     if (hs->handle == NULL) {
         /* No - close the connection. */
@@ -1265,7 +1805,7 @@ static http_send_state_t http_send (struct altcp_pcb *pcb, http_state_t *hs)
 #endif /* LWIP_HTTPD_SUPPORT_POST && LWIP_HTTPD_POST_MANUAL_WND */
 
     /* If we were passed a NULL state structure pointer, ignore the call. */
-    if (hs == NULL)
+    if (hs == NULL || hs->deferred)
         return HTTPSend_NoData;
 
 #if LWIP_HTTPD_FS_ASYNC_READ
@@ -1292,7 +1832,7 @@ static http_send_state_t http_send (struct altcp_pcb *pcb, http_state_t *hs)
 
     data_to_send = http_send_data_nonssi(pcb, hs);
 
-    if(hs->left == 0 && vfs_eof(hs->handle)) {
+    if(hs->left == 0 && hs->handle && vfs_eof(hs->handle)) {
         /* We reached the end of the file so this request is done.
         * This adds the FIN flag right into the last data segment. */
         LWIP_DEBUGF(HTTPD_DEBUG, ("End of file.\n"));
@@ -1391,6 +1931,10 @@ static err_t http_handle_post_finished (http_state_t *hs)
     hs->post_finished = 1;
 #endif /* LWIP_HTTPD_POST_MANUAL_WND */
 
+    /* release any window still held back by the application */
+    http_recved(&hs->request, hs->wnd_held);
+    hs->manual_wnd = false;
+
     /* application error or POST finished */
     /* NULL-terminate the buffer */
     *http_uri_buf = '\0';
@@ -1459,10 +2003,84 @@ static err_t http_post_rxpbuf (http_state_t *hs, struct pbuf *p)
 
 void httpd_free_pbuf (http_request_t *request, struct pbuf *p)
 {
-    altcp_recved(request->handle->pcb, p->tot_len);
+    http_recved(request, p->tot_len);
     pbuf_free(p);
 }
 
+/**
+ * Request that the receive window is not opened for the request body until
+ * the application calls http_recved(), to be called before http_get_payload().
+ * Use to throttle the sender to the speed of the storage the body is written to.
+ */
+void http_set_manual_window (http_request_t *request)
+{
+    request->handle->manual_wnd = true;
+}
+
+/**
+ * Set a function that produces the response body on demand as the send buffer drains,
+ * to be used instead of a response file. The body length is not known in advance so
+ * the connection is closed when the generator returns 0 (done) or a negative value (error).
+ */
+void http_set_response_generator (http_request_t *request, http_generator_ptr generator)
+{
+    request->handle->generator = generator;
+}
+
+/**
+ * Request that the response is not sent when the request handler returns,
+ * for requests that take too long to be completed from the receive callback.
+ * The application completes the request later by calling http_send_deferred_response().
+ */
+void http_defer_response (http_request_t *request)
+{
+    request->handle->deferred = true;
+}
+
+/**
+ * Send the response to a request deferred with http_defer_response(), the status
+ * and headers are set as usual before the call. uri is the file to send or NULL for none.
+ * Must not be called from the request handler that deferred the response.
+ */
+void http_send_deferred_response (http_request_t *request, const char *uri)
+{
+    http_state_t *hs = request->handle;
+    struct altcp_pcb *pcb = hs->pcb;
+    vfs_file_t *file = NULL;
+
+    if (!hs->deferred)
+        return;
+
+    hs->deferred = false;
+
+    if (uri && *uri && (file = vfs_open(uri, "r")) == NULL)
+        file = http_get_404_file(hs, &uri);
+
+    /* hs may be freed by http_send() */
+    if (http_init_file(hs, file, uri, NULL) == ERR_OK && http_send(pcb, hs))
+        altcp_output(pcb);
+}
+
+/**
+ * Open the receive window for body data that has been consumed by the application.
+ * Has no effect unless http_set_manual_window() has been called for the request.
+ */
+void http_recved (http_request_t *request, u32_t len)
+{
+    http_state_t *hs = request->handle;
+
+    if (len > hs->wnd_held)
+        len = hs->wnd_held;
+
+    hs->wnd_held -= len;
+
+    while (len && hs->pcb) {
+        u16_t chunk = len > 0xFFFF ? 0xFFFF : (u16_t)len;
+        altcp_recved(hs->pcb, chunk);
+        len -= chunk;
+    }
+}
+
 #if LWIP_HTTPD_POST_MANUAL_WND
 /**
  * @ingroup httpd
@@ -1683,6 +2301,20 @@ static err_t http_parse_request (struct pbuf *inp, http_state_t *hs, struct altc
                 hs->response_hdr.next = HDR_STRINGS_IDX_CONTENT_NEXT;
 #endif /* LWIP_HTTPD_DYNAMIC_HEADERS */
 
+#if !LWIP_ALTCP
+                if (hs->method == HTTP_Get && httpd.on_websocket_upgrade) {
+
+                    char value[12];
+
+                    if(http_get_header_value(&hs->request, "Upgrade", value, sizeof(value) - 1) && stristr(value, "websocket") == value) {
+                        /* the handler takes over the pcb on success, the connection state is then freed by http_recv() */
+                        if((hs->upgraded = httpd.on_websocket_upgrade(&hs->request, pcb, uri)))
+                            return ERR_OK;
+                        goto badrequest;
+                    }
+                }
+#endif /* !LWIP_ALTCP */
+
                 if (hs->method == HTTP_Post) {
 
                     int content_len = -1;
@@ -1897,6 +2529,8 @@ static err_t http_process_request (http_state_t *hs, const char *uri)
                     *http_uri_buf = '\0';
 
                 if(httpd.on_unknown_method_process(&hs->request, hs->method, http_uri_buf, LWIP_HTTPD_URI_BUF_LEN) == ERR_OK) {
+                    if(hs->deferred)
+                        return ERR_OK;
                     if(*http_uri_buf != '\0') {
                         uri = http_uri_buf;
                         if((file = vfs_open(uri, "r")) == NULL)
@@ -1918,7 +2552,14 @@ static err_t http_process_request (http_state_t *hs, const char *uri)
                 if((file = vfs_open(uri, "r")) == NULL) {
                     if(httpd.on_open_file_failed)
                         uri = httpd.on_open_file_failed(&hs->request, uri, &file, "r");
+                } else if(!http_file_preconditions(hs, uri)) {
+                    vfs_close(file);
+                    return http_init_file(hs, NULL, uri, params);
                 }
+#if LWIP_HTTPD_DYNAMIC_FILE_READ
+                  else if(params && http_lines_init(hs, uri, file))
+                    return hs->handle ? ERR_OK : http_init_file(hs, NULL, uri, params);
+#endif
             }
             if(file == NULL)
                 file = http_get_404_file(hs, &uri);
@@ -2079,7 +2720,11 @@ static err_t http_poll (void *arg, struct altcp_pcb *pcb)
         return ERR_OK;
 
     } else {
-        hs->retries++;
+        /* the application is still working on a deferred response, keep the connection open */
+        if (hs->deferred)
+            hs->retries = 0;
+        else
+            hs->retries++;
         if (hs->retries == HTTPD_MAX_RETRIES) {
             LWIP_DEBUGF(HTTPD_DEBUG, ("http_poll: too many retries, close\n"));
             http_close_conn(pcb, hs);
@@ -2132,6 +2777,9 @@ static err_t http_recv (void *arg, struct altcp_pcb *pcb, struct pbuf *p, err_t
         hs->unrecved_bytes += p->tot_len;
     else
 #endif /* LWIP_HTTPD_SUPPORT_POST && LWIP_HTTPD_POST_MANUAL_WND */
+    if (hs->manual_wnd && hs->post_content_len_left > 0)
+        hs->wnd_held += p->tot_len; /* opened by the application calling http_recved() */
+    else
     {
         /* Inform TCP that we have taken the data. */
         altcp_recved(pcb, p->tot_len);
@@ -2155,7 +2803,7 @@ static err_t http_recv (void *arg, struct altcp_pcb *pcb, struct pbuf *p, err_t
     }
 #endif /* LWIP_HTTPD_SUPPORT_POST */
 
-    if (hs->handle == NULL) {
+    if (hs->handle == NULL && !hs->deferred) {
 
         err_t parsed = http_parse_request(p, hs, pcb);
         LWIP_ASSERT("http_parse_request: unexpected return value", parsed == ERR_OK || parsed == ERR_INPROGRESS || parsed == ERR_ARG || parsed == ERR_USE);
@@ -2168,7 +2816,10 @@ static err_t http_recv (void *arg, struct altcp_pcb *pcb, struct pbuf *p, err_t
         }
         pbuf_free(p);
 
-        if (parsed == ERR_OK) {
+        if (parsed == ERR_OK && hs->upgraded) {
+            /* pcb is now owned by the upgrade handler, release the http state only */
+            http_state_free(hs);
+        } else if (parsed == ERR_OK) {
 #if LWIP_HTTPD_SUPPORT_POST
             if (hs->post_content_len_left == 0)
 #endif /* LWIP_HTTPD_SUPPORT_POST */
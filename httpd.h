@@ -113,10 +113,17 @@ typedef struct
     const char *(*on_unknown_content_type)(const char *uri);
     err_t (*on_unknown_method_process)(http_request_t *request, http_method_t method, char *uri, u16_t uri_len);
     void (*on_options_report)(http_request_t *request);
+    bool (*on_websocket_upgrade)(http_request_t *request, struct altcp_pcb *pcb, const char *uri); // Not called when LWIP_ALTCP is enabled
 } http_event_t;
 
 typedef const char *(*uri_handler_fn)(http_request_t *request);
 
+#define HTTP_ETAG_LEN 20 // Max length of an entity tag created by http_get_etag(), including the terminating NUL.
+#define HTTP_DIGEST_LEN 29 // Length of a base64 encoded SHA-1 digest, including the terminating NUL.
+
+// Writes up to size bytes of the response body to buf, returns the number of bytes written, 0 when done or -1 on error.
+typedef int (*http_generator_ptr)(http_request_t *request, char *buf, size_t size);
+
 typedef struct {
     const char *uri;
     http_method_t method;
@@ -137,8 +144,18 @@ bool http_set_response_header (http_request_t *request, const char *name, const
 void http_set_response_status (http_request_t *request, const char *status);
 void httpd_register_uri_handlers (const httpd_uri_handler_t *httpd_uri_handlers, uint_fast8_t httpd_num_uri_handlers);
 void httpd_free_pbuf (http_request_t *request, struct pbuf *p);
+void http_set_manual_window (http_request_t *request);
+void http_recved (http_request_t *request, u32_t len);
+void http_set_response_generator (http_request_t *request, http_generator_ptr generator);
+void http_defer_response (http_request_t *request);
+void http_send_deferred_response (http_request_t *request, const char *uri);
 err_t http_get_payload (http_request_t *request, uint32_t len);
 void http_set_allowed_methods (const char *methods);
+bool http_get_etag (vfs_stat_t *st, char *etag);
+uint_fast16_t http_check_preconditions (http_request_t *request, vfs_stat_t *st);
+void http_set_response_validators (http_request_t *request, vfs_stat_t *st);
+bool http_get_request_digest (http_request_t *request, char *digest);
+void http_set_response_digest (http_request_t *request, const uint8_t *sha1, char *digest);
 
 #if LWIP_HTTPD_POST_MANUAL_WND
 void httpd_post_data_recved(void *connection, u16_t recved_len);
@@ -0,0 +1,132 @@
+//
+// line_index.c - sparse line number to file offset index built from streamed data
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+//
+// The index is built from the data as it is received or read and written out via a callback,
+// a few entries at a time so that memory use does not depend on the file size.
+// To find line n read entry n / interval - 1 (offset 0 if n < interval), seek the file to that offset
+// and skip n % interval lines.
+// Like zstream.c this does not depend on the grblHAL or lwIP headers.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "line_index.h"
+
+#define N_ENTRIES 32
+
+struct line_index {
+    line_index_write_ptr write;
+    void *ctx;
+    bool ok;
+    bool pending;                   // Data seen after the last line terminator.
+    uint32_t size;
+    uint32_t lines;
+    uint_fast8_t n_entries;
+    uint32_t entry[N_ENTRIES];
+};
+
+line_index_t *line_index_create (line_index_write_ptr write, void *ctx)
+{
+    line_index_t *index;
+
+    if((index = calloc(sizeof(line_index_t), 1))) {
+        index->write = write;
+        index->ctx = ctx;
+        index->ok = true;
+    }
+
+    return index;
+}
+
+void line_index_free (line_index_t *index)
+{
+    free(index);
+}
+
+static void flush_entries (line_index_t *index)
+{
+    if(index->n_entries && index->ok)
+        index->ok = index->write(index->ctx, index->entry, index->n_entries * sizeof(uint32_t));
+
+    index->n_entries = 0;
+}
+
+// Returns false if the index could not be written.
+bool line_index_scan (line_index_t *index, const char *data, size_t length)
+{
+    const char *s = data, *end = data + length;
+
+    while(s < end && (s = memchr(s, '\n', end - s))) {
+        if(++index->lines % LINE_INDEX_INTERVAL == 0) {
+            index->entry[index->n_entries++] = index->size + (++s - data);
+            if(index->n_entries == N_ENTRIES)
+                flush_entries(index);
+        } else
+            s++;
+    }
+
+    if(length)
+        index->pending = data[length - 1] != '\n';
+    index->size += length;
+
+    return index->ok;
+}
+
+// Writes the remaining entries and the trailer, trailer may be NULL.
+// Returns false if the index could not be written.
+bool line_index_finish (line_index_t *index, line_index_trailer_t *trailer)
+{
+    line_index_trailer_t t = {
+        .magic = LINE_INDEX_MAGIC,
+        .interval = LINE_INDEX_INTERVAL,
+        .lines = index->lines + (index->pending ? 1 : 0),
+        .size = index->size
+    };
+
+    flush_entries(index);
+
+    if(index->ok)
+        index->ok = index->write(index->ctx, &t, sizeof(line_index_trailer_t));
+
+    if(trailer)
+        memcpy(trailer, &t, sizeof(line_index_trailer_t));
+
+    return index->ok;
+}
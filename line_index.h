@@ -0,0 +1,76 @@
+//
+// line_index.h - sparse line number to file offset index built from streamed data
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef __LINE_INDEX_H__
+#define __LINE_INDEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Suffix of the sidecar file holding the index of a file.
+#ifndef LINE_INDEX_EXT
+#define LINE_INDEX_EXT ".idx"
+#endif
+
+// Number of lines between index entries, a lookup has to skip at most this many lines less one.
+#ifndef LINE_INDEX_INTERVAL
+#define LINE_INDEX_INTERVAL 256
+#endif
+
+#define LINE_INDEX_MAGIC 0x5844494C // "LIDX"
+
+// The index file is an array of uint32_t entries in host byte order followed by this trailer.
+// Entry k is the offset of line (k + 1) * interval, the line numbers are zero based.
+typedef struct {
+    uint32_t magic;
+    uint32_t interval;
+    uint32_t lines;     // Number of lines in the file, a last line without a line terminator included.
+    uint32_t size;      // Size of the file indexed.
+} line_index_trailer_t;
+
+typedef bool (*line_index_write_ptr)(void *ctx, const void *data, size_t length);
+
+typedef struct line_index line_index_t;
+
+line_index_t *line_index_create (line_index_write_ptr write, void *ctx);
+bool line_index_scan (line_index_t *index, const char *data, size_t length);
+bool line_index_finish (line_index_t *index, line_index_trailer_t *trailer);
+void line_index_free (line_index_t *index);
+
+#endif
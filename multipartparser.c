@@ -34,6 +34,9 @@ SOFTWARE.
 #define HT '\t'
 #define HYPHEN '-'
 
+#define BOUNDARY(parser) ((parser)->delimiter + 4)
+#define DELIMITER_LENGTH(parser) ((parser)->boundary_length + 4)
+
 #define CALLBACK_NOTIFY(NAME)                           \
     if (callbacks->on_##NAME != NULL) {                 \
         if (callbacks->on_##NAME(parser) != 0)          \
@@ -117,14 +120,60 @@ static const char header_field_chars[256] = {
 
 void multipartparser_init(multipartparser* parser, const char* boundary)
 {
+    int i, length;
+
     memset(parser, 0, sizeof(*parser));
 
-    strncpy(parser->boundary, boundary, sizeof(parser->boundary));
-    parser->boundary_length = strlen(parser->boundary);
+    for (length = 0; length < (int)sizeof(parser->delimiter) - 4 && boundary[length]; length++);
+
+    memcpy(parser->delimiter, "\r\n--", 4);
+    memcpy(BOUNDARY(parser), boundary, length);
+    parser->boundary_length = length;
+
+    // Shift table for the body data search, by the last byte of the window.
+    length = DELIMITER_LENGTH(parser);
+    memset(parser->skip, length, sizeof(parser->skip));
+    for (i = 0; i < length - 1; i++)
+        parser->skip[(unsigned char)parser->delimiter[i]] = length - 1 - i;
 
     parser->state = s_preamble;
 }
 
+/* Searches the body data for the next delimiter (CRLF "--" boundary) by Boyer-Moore-Horspool.
+ * Returns a pointer to the delimiter if found, otherwise to the start of a partial delimiter
+ * at the end of the data, or to the end of the data. matched is set to the number of bytes of
+ * the delimiter found.
+ */
+static const char* find_delimiter(multipartparser* parser,
+                                  const char* p,
+                                  const char* end,
+                                  size_t* matched)
+{
+    size_t length = DELIMITER_LENGTH(parser);
+    unsigned char last = parser->delimiter[length - 1];
+
+    while ((size_t)(end - p) >= length) {
+        unsigned char c = p[length - 1];
+        if (c == last && memcmp(p, parser->delimiter, length - 1) == 0) {
+            *matched = length;
+            return p;
+        }
+        p += parser->skip[c];
+    }
+
+    // The tail is shorter than the delimiter, check if it starts one.
+    while ((p = memchr(p, CR, end - p)) != NULL) {
+        if (memcmp(p, parser->delimiter, end - p) == 0) {
+            *matched = end - p;
+            return p;
+        }
+        p++;
+    }
+
+    *matched = 0;
+    return end;
+}
+
 void multipartparser_callbacks_init(multipartparser_callbacks* callbacks)
 {
     memset(callbacks, 0, sizeof(*callbacks));
@@ -174,7 +223,7 @@ reexecute:
                     parser->state = s_header_field_start;
                     break;
                 }
-                if (c == parser->boundary[parser->index]) {
+                if (c == BOUNDARY(parser)[parser->index]) {
                     parser->index++;
                     break;
                 }
@@ -246,17 +295,24 @@ reexecute:
                 goto error;
 
             case s_data:
-                mark = p;
-                while (p != data + size) {
-                    c = *p;
-                    if (c == CR) {
-                        parser->state = s_data_cr;
-                        break;
+                {
+                    // Skip ahead to the next (partial) delimiter and pass the data up to it in one go.
+                    size_t matched;
+
+                    mark = p;
+                    p = find_delimiter(parser, p, data + size, &matched);
+                    if (p > mark) {
+                        CALLBACK_DATA(data, mark, p - mark);
                     }
-                    ++p;
-                }
-                if (p > mark) {
-                    CALLBACK_DATA(data, mark, p - mark);
+                    if (matched == (size_t)DELIMITER_LENGTH(parser)) {
+                        parser->index = 0;
+                        parser->state = s_data_boundary_done;
+                    } else if (matched >= 4) {
+                        parser->index = matched - 4;
+                        parser->state = s_data_boundary;
+                    } else if (matched)
+                        parser->state = matched == 1 ? s_data_cr : (matched == 2 ? s_data_cr_lf : s_data_cr_lf_hy);
+                    p += matched - 1;   // Continue after the (partial) delimiter, p is incremented by the loop.
                 }
                 break;
 
@@ -298,11 +354,12 @@ reexecute:
                     parser->state = s_data_boundary_done;
                     goto reexecute;
                 }
-                if (c == parser->boundary[parser->index]) {
+                if (c == BOUNDARY(parser)[parser->index]) {
                     parser->index++;
                     break;
                 }
-                CALLBACK_DATA(data, parser->boundary, parser->index);
+                // Not a delimiter, the CRLF "--" and the matched part of the boundary is data.
+                CALLBACK_DATA(data, parser->delimiter, parser->index + 4);
                 parser->state = s_data;
                 goto reexecute;
 
@@ -42,10 +42,11 @@ typedef int (*multipart_data_cb) (multipartparser*, const char* data, size_t siz
 
 struct multipartparser {
     /** PRIVATE **/
-    char        boundary[70];
+    char        delimiter[4 + 70];  // CRLF "--" boundary, not terminated
     int         boundary_length;
     int         index;
     uint16_t    state;
+    uint8_t     skip[256];          // Boyer-Moore-Horspool shifts for the delimiter
 
     /** PUBLIC **/
     void* data;
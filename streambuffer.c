@@ -0,0 +1,327 @@
+//
+// streambuffer.c - span based ring buffer helpers for network streams
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifdef ARDUINO
+#include "../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#if TELNET_ENABLE || WEBSOCKET_ENABLE
+
+#include <string.h>
+
+#include "streambuffer.h"
+
+#define TXBUF_SIZE(txbuf) (sizeof(txbuf->data))
+#define TXBUF_MASK(txbuf) (sizeof(txbuf->data) - 1)
+#define RXBUF_SIZE(rxbuf) (sizeof(rxbuf->data))
+#define RXBUF_MASK(rxbuf) (sizeof(rxbuf->data) - 1)
+
+#define IS_RT_CANDIDATE(c) (rt_candidates[(c) >> 5] & (1UL << ((c) & 0x1F)))
+
+// 256-bit map of characters that has to be passed to the realtime command handler:
+// control characters, top-bit set characters and the printable characters
+// that are either realtime commands or used by the handler to track context (settings and comments).
+static const uint32_t rt_candidates[8] = {
+    0xFFFFFFFF, // 0x00 - 0x1F: control characters
+    0x88000312, // 0x20 - 0x3F: ! $ ( ) ; ?
+    0x00000000, // 0x40 - 0x5F
+    0xC0000000, // 0x60 - 0x7F: ~ DEL
+    0xFFFFFFFF, // 0x80 - 0xFF: extended realtime commands
+    0xFFFFFFFF,
+    0xFFFFFFFF,
+    0xFFFFFFFF
+};
+
+uint_fast16_t stream_tx_count (stream_tx_buffer_t *txbuf)
+{
+    uint_fast16_t head = txbuf->head, tail = txbuf->tail;
+
+    return BUFCOUNT(head, tail, TXBUF_SIZE(txbuf));
+}
+
+//
+// Returns the number of bytes that can be read contiguously from the tail,
+// the data is not consumed until stream_tx_commit() is called.
+// Call again after commit to get the second span when the data wraps around.
+//
+uint_fast16_t stream_tx_peek (stream_tx_buffer_t *txbuf, const char **data)
+{
+    return stream_tx_peek_at(txbuf, txbuf->tail, data);
+}
+
+//
+// As stream_tx_peek() but from a reader owned cursor that lies between the tail and the head,
+// used when the data is read by more than one consumer.
+//
+uint_fast16_t stream_tx_peek_at (stream_tx_buffer_t *txbuf, uint_fast16_t tail, const char **data)
+{
+    uint_fast16_t head = txbuf->head;
+
+    *data = &txbuf->data[tail];
+
+    return head >= tail ? head - tail : TXBUF_SIZE(txbuf) - tail;
+}
+
+void stream_tx_commit (stream_tx_buffer_t *txbuf, uint_fast16_t length)
+{
+    txbuf->tail = (txbuf->tail + length) & TXBUF_MASK(txbuf);
+}
+
+//
+// Copies data into the buffer in up to two chunks per pass,
+// blocks via hal.stream_blocking_callback() while the buffer is full.
+//
+bool stream_tx_write (stream_tx_buffer_t *txbuf, const char *data, uint_fast16_t length)
+{
+    uint_fast16_t head, free, chunk;
+
+    while(length) {
+
+        while((free = (TXBUF_SIZE(txbuf) - 1) - stream_tx_count(txbuf)) == 0) {  // Buffer full, block until space is available...
+            if(!hal.stream_blocking_callback())
+                return false;
+        }
+
+        if(free > length)
+            free = length;
+
+        head = txbuf->head;
+        chunk = TXBUF_SIZE(txbuf) - head;
+
+        if(chunk >= free)
+            memcpy(&txbuf->data[head], data, free);
+        else {
+            memcpy(&txbuf->data[head], data, chunk);
+            memcpy(txbuf->data, data + chunk, free - chunk);
+        }
+
+        txbuf->head = (head + free) & TXBUF_MASK(txbuf);    // Update head pointer after data is in place
+
+        data += free;
+        length -= free;
+    }
+
+    return true;
+}
+
+//
+// Drops all but the newest complete realtime status report (a line starting with '<')
+// from the data pending in the TX buffer so that a client that cannot keep up gets
+// the latest state instead of a backlog of stale reports.
+// The remaining data is compacted towards the head, order is preserved.
+// Returns the number of bytes dropped.
+// NOTE: must not be called while a part of the pending data is referenced by lwIP.
+//
+uint_fast16_t stream_tx_coalesce_status (stream_tx_buffer_t *txbuf)
+{
+    bool seen = false;
+    uint_fast16_t head = txbuf->head, tail = txbuf->tail, mask = TXBUF_MASK(txbuf);
+    uint_fast16_t i = head, j, k, dst = head, dropped = 0;
+
+    // Walk the lines backwards from the head, line is [j, i)
+    while(i != tail) {
+
+        j = i;
+        do {
+            j = (j - 1) & mask;
+        } while(j != tail && txbuf->data[(j - 1) & mask] != '\n');
+
+        if(txbuf->data[j] == '<' && txbuf->data[(i - 1) & mask] == '\n' && seen)
+            dropped += (i - j) & mask;
+        else {
+            seen = seen || (txbuf->data[j] == '<' && txbuf->data[(i - 1) & mask] == '\n');
+            if(dropped) {
+                k = i;
+                do {
+                    k = (k - 1) & mask;
+                    dst = (dst - 1) & mask;
+                    txbuf->data[dst] = txbuf->data[k];
+                } while(k != j);
+            } else
+                dst = j;
+        }
+
+        i = j;
+    }
+
+    if(dropped)
+        txbuf->tail = dst;
+
+    return dropped;
+}
+
+static inline uint32_t get_micros (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+}
+
+void stream_flush_init (stream_flush_t *flush, const stream_flush_policy_t *policy)
+{
+    memset(flush, 0, sizeof(stream_flush_t));
+    memcpy(&flush->policy, policy, sizeof(stream_flush_policy_t));
+}
+
+//
+// To be called from the stream write functions after data has been added to the TX buffer,
+// notes when the first byte was written and if a line terminator is pending.
+//
+void stream_flush_mark (stream_flush_t *flush, const char *data, uint_fast16_t length)
+{
+    if(length == 0)
+        return;
+
+    if(!flush->pending) {
+        flush->pending_since = get_micros();
+        flush->pending = true;
+    }
+
+    if(flush->policy.flush_on_eol && !flush->eol)
+        flush->eol = data[length - 1] == '\n' || memchr(data, '\n', length) != NULL;
+}
+
+//
+// Returns true if pending data should be handed over to lwIP now.
+//
+bool stream_flush_due (stream_flush_t *flush, uint_fast16_t pending)
+{
+    if(pending == 0)
+        return false;
+
+    if(flush->eol || (flush->policy.coalesce_bytes == 0 && flush->policy.coalesce_us == 0))
+        return true;
+
+    if(flush->policy.coalesce_bytes && pending >= flush->policy.coalesce_bytes)
+        return true;
+
+    return flush->policy.coalesce_us && (get_micros() - flush->pending_since) >= flush->policy.coalesce_us;
+}
+
+//
+// To be called after tcp_output(), updates statistics with the delay since the first pending byte was written.
+// empty should be true if the TX buffer was drained.
+//
+void stream_flush_done (stream_flush_t *flush, bool empty)
+{
+    if(flush->pending) {
+
+        uint32_t delay = get_micros() - flush->pending_since;
+
+        flush->stats.count++;
+        flush->stats.last_us = delay;
+        if(delay > flush->stats.max_us)
+            flush->stats.max_us = delay;
+        flush->stats.avg_us = flush->stats.count == 1 ? delay : flush->stats.avg_us - (flush->stats.avg_us >> 4) + (delay >> 4);
+
+        if(empty)
+            flush->eol = flush->pending = false;
+        else
+            flush->pending_since = get_micros();
+    }
+}
+
+//
+// Ingests a block of received data into the RX ring buffer.
+// Only realtime command candidates and the first character of each line is passed to
+// the realtime command handler, the runs of characters in between are copied in bulk.
+// eol is the caller owned line state, initialize to true.
+// Returns the number of characters consumed, less than length on buffer overflow.
+// NOTE: to be called from within a critical section.
+//
+uint_fast16_t stream_rx_ingest (stream_rx_buffer_t *rxbuf, const char *data, uint_fast16_t length, enqueue_realtime_command_ptr enqueue_realtime_command, bool *eol)
+{
+    const uint8_t *s = (const uint8_t *)data, *end = s + length, *run, *limit;
+    uint_fast16_t head = rxbuf->head, tail = rxbuf->tail, free, chunk, len;
+
+    free = (RXBUF_SIZE(rxbuf) - 1) - BUFCOUNT(head, tail, RXBUF_SIZE(rxbuf));
+
+    while(s < end) {
+
+        if(*eol || IS_RT_CANDIDATE(*s)) {
+
+            *eol = *s == '\n' || *s == '\r';
+
+            if(!enqueue_realtime_command((char)*s)) {   // If not a real time command attempt to buffer it
+                if(free == 0) {
+                    rxbuf->overflow = true;             // flag overflow
+                    break;
+                }
+                rxbuf->data[head] = (char)*s;
+                head = (head + 1) & RXBUF_MASK(rxbuf);
+                rxbuf->head = head;
+                free--;
+            }
+            s++;
+            continue;
+        }
+
+        // Scan for the end of the run of ordinary characters, a word at a time where possible...
+
+        run = s;
+        limit = (uint_fast16_t)(end - s) > free ? s + free : end;
+
+        while(limit - s >= 4 && !(IS_RT_CANDIDATE(s[0]) | IS_RT_CANDIDATE(s[1]) | IS_RT_CANDIDATE(s[2]) | IS_RT_CANDIDATE(s[3])))
+            s += 4;
+
+        while(s < limit && !IS_RT_CANDIDATE(*s))
+            s++;
+
+        if((len = s - run) == 0) {
+            rxbuf->overflow = true;                     // flag overflow
+            break;
+        }
+
+        // ...and copy it to the buffer in one go.
+
+        if((chunk = RXBUF_SIZE(rxbuf) - head) >= len)
+            memcpy(&rxbuf->data[head], run, len);
+        else {
+            memcpy(&rxbuf->data[head], run, chunk);
+            memcpy(rxbuf->data, run + chunk, len - chunk);
+        }
+
+        head = (head + len) & RXBUF_MASK(rxbuf);
+        rxbuf->head = head;                             // Update head pointer after data is in place
+        free -= len;
+    }
+
+    return s - (const uint8_t *)data;
+}
+
+#endif
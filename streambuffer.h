@@ -0,0 +1,82 @@
+//
+// streambuffer.h - span based ring buffer helpers for network streams
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef __STREAMBUFFER_H__
+#define __STREAMBUFFER_H__
+
+#if defined(ARDUINO)
+#include "../grbl/hal.h"
+#else
+#include "grbl/hal.h"
+#endif
+
+typedef struct {
+    bool nodelay;               // Disable the Nagle algorithm (TCP_NODELAY) for the session(s).
+    bool flush_on_eol;          // Flush immediately when a line terminated response has been written.
+    uint16_t coalesce_bytes;    // Otherwise flush when this many bytes are pending, 0 to disable,
+    uint32_t coalesce_us;       // or when the oldest pending byte is this many microseconds old, 0 to disable.
+} stream_flush_policy_t;
+
+typedef struct {
+    uint32_t count;             // Number of flushes measured.
+    uint32_t last_us;           // Delay from first write to tcp_output() for the last flush.
+    uint32_t avg_us;            // Running average (1/16 weight) of the delay.
+    uint32_t max_us;            // Max delay seen since last reset.
+} stream_flush_stats_t;
+
+typedef struct {
+    stream_flush_policy_t policy;
+    stream_flush_stats_t stats;
+    volatile bool eol;
+    volatile bool pending;
+    volatile uint32_t pending_since;
+} stream_flush_t;
+
+uint_fast16_t stream_tx_count (stream_tx_buffer_t *txbuf);
+uint_fast16_t stream_tx_peek (stream_tx_buffer_t *txbuf, const char **data);
+uint_fast16_t stream_tx_peek_at (stream_tx_buffer_t *txbuf, uint_fast16_t tail, const char **data);
+void stream_tx_commit (stream_tx_buffer_t *txbuf, uint_fast16_t length);
+bool stream_tx_write (stream_tx_buffer_t *txbuf, const char *data, uint_fast16_t length);
+uint_fast16_t stream_tx_coalesce_status (stream_tx_buffer_t *txbuf);
+void stream_flush_init (stream_flush_t *flush, const stream_flush_policy_t *policy);
+void stream_flush_mark (stream_flush_t *flush, const char *data, uint_fast16_t length);
+bool stream_flush_due (stream_flush_t *flush, uint_fast16_t pending);
+void stream_flush_done (stream_flush_t *flush, bool empty);
+uint_fast16_t stream_rx_ingest (stream_rx_buffer_t *rxbuf, const char *data, uint_fast16_t length, enqueue_realtime_command_ptr enqueue_realtime_command, bool *eol);
+
+#endif
@@ -49,6 +49,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "telnetd.h"
 #include "networking.h"
+#include "streambuffer.h"
 #include "grbl/protocol.h"
 
 #ifndef TELNETD_TCP_PRIO
@@ -59,6 +60,48 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define TELNETD_POLL_INTERVAL 2
 #endif
 
+// Default output flush policy, may be changed at run time by telnetd_set_flush_policy()
+
+#ifndef TELNETD_NODELAY
+#define TELNETD_NODELAY 1
+#endif
+
+#ifndef TELNETD_FLUSH_ON_EOL
+#define TELNETD_FLUSH_ON_EOL 1
+#endif
+
+#ifndef TELNETD_COALESCE_BYTES
+#define TELNETD_COALESCE_BYTES TCP_MSS
+#endif
+
+#ifndef TELNETD_COALESCE_US
+#define TELNETD_COALESCE_US 2000
+#endif
+
+#ifndef TELNETD_MAX_SESSIONS
+#define TELNETD_MAX_SESSIONS 3  // One read/write owner of the stream, the rest are read-only observers
+#endif
+
+#ifndef TELNETD_IAC_ENABLE
+#define TELNETD_IAC_ENABLE 1    // Handle telnet commands and option negotiation, only active when the client sends IAC
+#endif
+
+#ifndef TELNETD_TX_EXTRA
+#define TELNETD_TX_EXTRA 8      // Max number of pending non stream output blocks for the stream owner, must be a power of 2
+#endif
+
+#define TELNET_IAC      255
+#define TELNET_DONT     254
+#define TELNET_DO       253
+#define TELNET_WONT     252
+#define TELNET_WILL     251
+#define TELNET_SB       250
+#define TELNET_SE       240
+
+#define TELOPT_BINARY   0
+#define TELOPT_SGA      3
+#define TELOPT_NAWS     31
+
 typedef struct {
     struct pbuf *p;
     struct pbuf *q;
@@ -66,40 +109,103 @@ typedef struct {
     void *payload;
 } packet_chain_t;
 
+typedef enum {
+    IAC_Data = 0,
+    IAC_Command,
+    IAC_Option,
+    IAC_SubNegotiation,
+    IAC_SubNegotiationIAC
+} iac_state_t;
+
+typedef struct {
+    iac_state_t state;
+    uint8_t command;        // Pending WILL, WONT, DO or DONT
+    uint8_t sb_len;
+    uint8_t sb[5];          // Option and payload of subnegotiation
+    bool active;            // Client speaks telnet, escape IAC in output
+    bool binary_rx;
+    bool binary_tx;
+    bool sga_rx;
+    bool sga_tx;
+    bool naws;
+    uint16_t width;
+    uint16_t height;
+} telnet_options_t;
+
+// Output not taken from the TX buffer, needed to tell acknowledged stream data apart.
+typedef struct {
+    uint32_t pos;
+    uint16_t len;
+} tx_extra_t;
+
 typedef struct
 {
-    const io_stream_t *stream;
     uint32_t timeout;
     uint32_t timeoutMax;
     struct tcp_pcb *pcb;
     packet_chain_t packet;
-    stream_rx_buffer_t rxbuf;
-    stream_tx_buffer_t txbuf;
+    uint_fast16_t tx_tail;  // Read cursor into the shared TX buffer
+    uint_fast16_t tx_acked; // Start of data referenced by lwIP and not yet acknowledged, stream owner only
+    uint32_t tx_dropped;    // Number of bytes skipped due to the session not keeping up
+    uint32_t tx_queued;     // Number of bytes handed over to lwIP, free running
+    uint32_t tx_ackpos;     // Number of bytes acknowledged, free running
+    uint_fast8_t tx_extra_head;
+    uint_fast8_t tx_extra_tail;
+    tx_extra_t tx_extra[TELNETD_TX_EXTRA];
+#if TELNETD_IAC_ENABLE
+    telnet_options_t options;
+#endif
     TickType_t lastSendTime;
     err_t lastErr;
     uint8_t errorCount;
 } sessiondata_t;
 
+typedef struct
+{
+    const io_stream_t *stream;
+    sessiondata_t *session; // Stream owner, NULL if none
+    stream_rx_buffer_t rxbuf;
+    stream_tx_buffer_t txbuf;
+    bool rx_eol;
+} telnet_streambuffers_t;
+
 static const sessiondata_t defaultSettings =
 {
     .timeout = 0,
     .timeoutMax = SOCKET_TIMEOUT,
     .pcb = NULL,
     .packet = {0},
-    .rxbuf = {0},
-    .txbuf = {0},
+    .tx_tail = 0,
+    .tx_acked = 0,
+    .tx_dropped = 0,
+    .tx_queued = 0,
+    .tx_ackpos = 0,
+    .tx_extra_head = 0,
+    .tx_extra_tail = 0,
+#if TELNETD_IAC_ENABLE
+    .options = {0},
+#endif
     .lastSendTime = 0,
     .errorCount = 0,
     .lastErr = ERR_OK
 };
 
 static tcp_server_t telnet_server;
-static sessiondata_t streamSession;
+static sessiondata_t sessions[TELNETD_MAX_SESSIONS];
+static telnet_streambuffers_t streambuffers = {0};
+static stream_flush_t telnet_flush = {
+    .policy.nodelay = TELNETD_NODELAY,
+    .policy.flush_on_eol = TELNETD_FLUSH_ON_EOL,
+    .policy.coalesce_bytes = TELNETD_COALESCE_BYTES,
+    .policy.coalesce_us = TELNETD_COALESCE_US
+};
 static enqueue_realtime_command_ptr enqueue_realtime_command = protocol_enqueue_realtime_command;
 #if ESP_PLATFORM
 static portMUX_TYPE rx_mux = portMUX_INITIALIZER_UNLOCKED;
 #endif
 
+#define TXBUF_SIZE (sizeof(streambuffers.txbuf.data))
+
 static void telnet_stream_handler (sessiondata_t *session);
 
 //
@@ -109,18 +215,18 @@ static int16_t streamGetC (void)
 {
     int16_t data;
 
-    if(streamSession.rxbuf.tail == streamSession.rxbuf.head)
+    if(streambuffers.rxbuf.tail == streambuffers.rxbuf.head)
         return SERIAL_NO_DATA; // no data available else EOF
 
-    data = streamSession.rxbuf.data[streamSession.rxbuf.tail];                          // Get next character
-    streamSession.rxbuf.tail = BUFNEXT(streamSession.rxbuf.tail, streamSession.rxbuf);  // and update pointer
+    data = streambuffers.rxbuf.data[streambuffers.rxbuf.tail];                          // Get next character
+    streambuffers.rxbuf.tail = BUFNEXT(streambuffers.rxbuf.tail, streambuffers.rxbuf);  // and update pointer
 
     return data;
 }
 
 static inline uint16_t streamRxCount (void)
 {
-    uint_fast16_t head = streamSession.rxbuf.head, tail = streamSession.rxbuf.tail;
+    uint_fast16_t head = streambuffers.rxbuf.head, tail = streambuffers.rxbuf.tail;
 
     return BUFCOUNT(head, tail, RX_BUFFER_SIZE);
 }
@@ -132,41 +238,33 @@ static uint16_t streamRxFree (void)
 
 static void streamRxFlush (void)
 {
-    streamSession.rxbuf.tail = streamSession.rxbuf.head;
+    streambuffers.rxbuf.tail = streambuffers.rxbuf.head;
 }
 
 static void streamRxCancel (void)
 {
-    streamSession.rxbuf.data[streamSession.rxbuf.head] = ASCII_CAN;
-    streamSession.rxbuf.tail = streamSession.rxbuf.head;
-    streamSession.rxbuf.head = BUFNEXT(streamSession.rxbuf.head, streamSession.rxbuf);
+    streambuffers.rxbuf.data[streambuffers.rxbuf.head] = ASCII_CAN;
+    streambuffers.rxbuf.tail = streambuffers.rxbuf.head;
+    streambuffers.rxbuf.head = BUFNEXT(streambuffers.rxbuf.head, streambuffers.rxbuf);
 }
 
 static bool streamSuspendInput (bool suspend)
 {
-    return stream_rx_suspend(&streamSession.rxbuf, suspend);
+    return stream_rx_suspend(&streambuffers.rxbuf, suspend);
 }
 
-static bool streamRxPutC (char c)
+static uint_fast16_t streamRxPut (const uint8_t *data, uint_fast16_t length)
 {
-    bool mpg, overflow = false;
+    uint_fast16_t taken = length;
 
     // discard input if MPG has taken over...
-    if(!(mpg = hal.stream.type == StreamType_MPG)) {
+    if(hal.stream.type != StreamType_MPG) {
 #if ESP_PLATFORM
         taskENTER_CRITICAL(&rx_mux);
 #else
         taskENTER_CRITICAL();
 #endif
-        if(!enqueue_realtime_command(c)) {                              // If not a real time command attempt to buffer it
-            uint_fast16_t next_head = BUFNEXT(streamSession.rxbuf.head, streamSession.rxbuf);
-            if((overflow = next_head == streamSession.rxbuf.tail))      // If buffer full
-                streamSession.rxbuf.overflow = true;                    // flag overflow
-            else {
-                streamSession.rxbuf.data[streamSession.rxbuf.head] = c; // Add data to buffer and
-                streamSession.rxbuf.head = next_head;                   // update pointer
-            }
-        }
+        taken = stream_rx_ingest(&streambuffers.rxbuf, (const char *)data, length, enqueue_realtime_command, &streambuffers.rx_eol);
 #if ESP_PLATFORM
         taskEXIT_CRITICAL(&rx_mux);
 #else
@@ -174,64 +272,44 @@ static bool streamRxPutC (char c)
 #endif
     }
 
-    return mpg || !overflow;
+    return taken;
 }
 
 static bool streamPutC (const char c)
 {
-    uint_fast16_t next_head = BUFNEXT(streamSession.txbuf.head, streamSession.txbuf);
+    uint_fast16_t next_head = BUFNEXT(streambuffers.txbuf.head, streambuffers.txbuf);
 
-    while(streamSession.txbuf.tail == next_head) {  // Buffer full, block until space is available...
+    while(streambuffers.txbuf.tail == next_head) {  // Buffer full, block until space is available...
         if(!hal.stream_blocking_callback())
             return false;
     }
 
-    streamSession.txbuf.data[streamSession.txbuf.head] = c; // Add data to buffer
-    streamSession.txbuf.head = next_head;                   // and update head pointer
+    streambuffers.txbuf.data[streambuffers.txbuf.head] = c; // Add data to buffer
+    streambuffers.txbuf.head = next_head;                   // and update head pointer
+
+    stream_flush_mark(&telnet_flush, &c, 1);
 
     return true;
 }
 
 static void streamWriteS (const char *data)
 {
-    char c, *ptr = (char *)data;
+    uint_fast16_t length = strlen(data);
 
-    while((c = *ptr++) != '\0')
-        streamPutC(c);
+    if(stream_tx_write(&streambuffers.txbuf, data, length))
+        stream_flush_mark(&telnet_flush, data, length);
 }
 
 static void streamWrite (const char *data, uint16_t length)
 {
-    char *ptr = (char *)data;
-
-    while(length--)
-        streamPutC(*ptr++);
-}
-
-static uint16_t streamTxCount (void) {
-
-    uint_fast16_t head = streamSession.txbuf.head, tail = streamSession.txbuf.tail;
-
-    return BUFCOUNT(head, tail, TX_BUFFER_SIZE);
-}
-
-static int16_t streamTxGetC (void)
-{
-    int16_t data;
-
-    if(streamSession.txbuf.tail == streamSession.txbuf.head)
-        return SERIAL_NO_DATA; // no data available else EOF
-
-    data = streamSession.txbuf.data[streamSession.txbuf.tail];                          // Get next character
-    streamSession.txbuf.tail = BUFNEXT(streamSession.txbuf.tail, streamSession.txbuf);  // and update pointer
-
-    return data;
+    if(stream_tx_write(&streambuffers.txbuf, data, length))
+        stream_flush_mark(&telnet_flush, data, length);
 }
 
 /*
 static void streamTxFlush (void)
 {
-    streamSession.txbuf.tail = streamSession.txbuf.head;
+    streambuffers.txbuf.tail = streambuffers.txbuf.head;
 }
 */
 
@@ -250,13 +328,91 @@ static enqueue_realtime_command_ptr streamSetRtHandler (enqueue_realtime_command
     return prev;
 }
 
+static bool is_connected (void)
+{
+    return true;
+}
+
+static const io_stream_t telnet_stream = {
+    .type = StreamType_Telnet,
+    .is_connected = is_connected,
+    .read = streamGetC,
+    .write = streamWriteS,
+    .write_n = streamWrite,
+    .write_char = streamPutC,
+    .enqueue_rt_command = streamEnqueueRtCommand,
+    .get_rx_buffer_free = streamRxFree,
+    .reset_read_buffer = streamRxFlush,
+    .cancel_read_buffer = streamRxCancel,
+    .suspend_read = streamSuspendInput,
+    .set_enqueue_rt_handler = streamSetRtHandler
+};
+
+// Make the session the owner of the telnet stream, input from other sessions is discarded.
+static void streamOpen (sessiondata_t *session)
+{
+    uint32_t inflight;
+
+    streambuffers.session = session;
+    streambuffers.rx_eol = true;
+    streambuffers.rxbuf.tail = streambuffers.rxbuf.head;
+    session->tx_tail = session->tx_acked = streambuffers.txbuf.tail;
+
+    // Anything still unacknowledged was sent as a copy
+    session->tx_extra_head = session->tx_extra_tail = 0;
+    session->tx_ackpos = session->tx_queued;
+    if(session->pcb && (inflight = TCP_SND_BUF - tcp_sndbuf(session->pcb))) {
+        session->tx_extra[session->tx_extra_head++] = (tx_extra_t){ .pos = session->tx_queued, .len = inflight };
+        session->tx_queued += inflight;
+    }
+
+    // Switch I/O stream to Telnet connection
+    if(stream_connect(&telnet_stream))
+        streambuffers.stream = &telnet_stream;
+    // else abort connection?
+}
+
 static void streamClose (sessiondata_t *session)
 {
+    if(session != streambuffers.session)
+        return;
+
     // Switch I/O stream back to default
-    if(session->stream) {
-        stream_disconnect(session->stream);
-        session->stream = NULL;
+    if(streambuffers.stream) {
+        stream_disconnect(streambuffers.stream);
+        streambuffers.stream = NULL;
     }
+
+    streambuffers.session = NULL;
+}
+
+//
+// Session handling
+//
+
+static sessiondata_t *telnet_session_alloc (void)
+{
+    uint_fast8_t idx = TELNETD_MAX_SESSIONS;
+
+    do {
+        if(sessions[--idx].pcb == NULL)
+            return &sessions[idx];
+    } while(idx);
+
+    return NULL;
+}
+
+// Hand the stream over to a connected observer when the owner leaves.
+static void telnet_session_promote (void)
+{
+    uint_fast8_t idx = TELNETD_MAX_SESSIONS;
+
+    if(streambuffers.session == NULL) do {
+        if(sessions[--idx].pcb) {
+            streamOpen(&sessions[idx]);
+            break;
+        }
+    } while(idx);
 }
 
 //
@@ -291,6 +447,7 @@ static void telnet_err (void *arg, err_t err)
     session->lastSendTime = 0;
 
     streamClose(session);
+    telnet_session_promote();
 }
 
 static err_t telnet_poll (void *arg, struct tcp_pcb *pcb)
@@ -308,8 +465,13 @@ static err_t telnet_poll (void *arg, struct tcp_pcb *pcb)
     return ERR_OK;
 }
 
-static void telnet_close_conn (sessiondata_t *session, struct tcp_pcb *pcb)
+// Returns true if the connection was aborted, the caller must then return ERR_ABRT to lwIP.
+static bool telnet_close_conn (sessiondata_t *session, struct tcp_pcb *pcb)
 {
+    // Unacknowledged stream owner output references the shared TX buffer, abort rather than close
+    // since the buffer tail is no longer held back by the session once it is released.
+    bool inflight = session && session == streambuffers.session && session->tx_acked != session->tx_tail;
+
     telnet_state_free(session);
 
     tcp_arg(pcb, NULL);
@@ -318,13 +480,259 @@ static void telnet_close_conn (sessiondata_t *session, struct tcp_pcb *pcb)
     tcp_err(pcb, NULL);
     tcp_poll(pcb, NULL, 1);
 
-    if (tcp_close(pcb) != ERR_OK)
+    if(inflight)
+        tcp_abort(pcb);
+    else if (tcp_close(pcb) != ERR_OK)
         tcp_poll(pcb, telnet_poll, TELNETD_POLL_INTERVAL);
 
     session->pcb = NULL;
 
     // Switch I/O stream back to default
     streamClose(session);
+    telnet_session_promote();
+
+    return inflight;
+}
+
+//
+// Output accounting for the stream owner
+//
+
+// Call tcp_write() in a loop trying smaller and smaller length,
+// length is updated to the number of bytes accepted.
+static err_t telnet_write (struct tcp_pcb *pcb, const void *ptr, uint_fast16_t *length, u8_t apiflags)
+{
+    err_t err;
+    uint_fast16_t len = *length;
+
+    do {
+        if((err = tcp_write(pcb, ptr, (u16_t)len, apiflags)) == ERR_MEM)
+            len = tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN ? 0 : len / 2;
+    } while(err == ERR_MEM && len);
+
+    *length = len;
+
+    return err;
+}
+
+#if TELNETD_IAC_ENABLE
+
+// Write data not taken from the TX buffer, all or nothing.
+// extra is the number of bytes that does not replace stream data.
+static bool telnet_write_extra (sessiondata_t *session, const void *data, uint_fast16_t len, uint_fast16_t extra, u8_t apiflags)
+{
+    tx_extra_t *prev = session->tx_extra_head == session->tx_extra_tail ? NULL : &session->tx_extra[(session->tx_extra_head - 1) & (TELNETD_TX_EXTRA - 1)];
+    bool merge = prev && prev->pos + prev->len == session->tx_queued;
+
+    if(session == streambuffers.session && !merge && ((session->tx_extra_head + 1) & (TELNETD_TX_EXTRA - 1)) == session->tx_extra_tail)
+        return false;
+
+    if(len > tcp_sndbuf(session->pcb) || tcp_write(session->pcb, data, (u16_t)len, apiflags) != ERR_OK)
+        return false;
+
+    if(session == streambuffers.session) {
+        if(merge)
+            prev->len += extra;
+        else {
+            session->tx_extra[session->tx_extra_head] = (tx_extra_t){ .pos = session->tx_queued, .len = extra };
+            session->tx_extra_head = (session->tx_extra_head + 1) & (TELNETD_TX_EXTRA - 1);
+        }
+    }
+
+    session->tx_queued += len;
+
+    return true;
+}
+
+#endif // TELNETD_IAC_ENABLE
+
+// Returns the number of stream bytes among the acknowledged bytes.
+static uint_fast16_t telnet_tx_acked (sessiondata_t *session, uint_fast16_t len)
+{
+    uint32_t start = session->tx_ackpos, end = start + len, s, e;
+    tx_extra_t *extra;
+
+    while(session->tx_extra_tail != session->tx_extra_head) {
+
+        extra = &session->tx_extra[session->tx_extra_tail];
+
+        if((int32_t)(extra->pos - end) >= 0)
+            break;
+
+        s = (int32_t)(extra->pos - start) > 0 ? extra->pos : start;
+        e = (int32_t)(extra->pos + extra->len - end) < 0 ? extra->pos + extra->len : end;
+        len -= e - s;
+
+        if(e != extra->pos + extra->len)
+            break;
+
+        session->tx_extra_tail = (session->tx_extra_tail + 1) & (TELNETD_TX_EXTRA - 1);
+    }
+
+    session->tx_ackpos = end;
+
+    return len;
+}
+
+#if TELNETD_IAC_ENABLE
+
+//
+// Telnet protocol handling. Negotiation is passive, options are never offered
+// so that plain TCP clients are not sent anything but the stream output.
+//
+
+static void telnet_send_option (sessiondata_t *session, uint8_t command, uint8_t option)
+{
+    uint8_t reply[3] = { TELNET_IAC, command, option };
+
+    if(telnet_write_extra(session, reply, sizeof(reply), sizeof(reply), TCP_WRITE_FLAG_COPY))
+        tcp_output(session->pcb);
+}
+
+static void telnet_negotiate (sessiondata_t *session, uint8_t command, uint8_t option)
+{
+    bool *state = NULL, enable = command == TELNET_WILL || command == TELNET_DO, remote = command == TELNET_WILL || command == TELNET_WONT;
+
+    switch(option) {
+
+        case TELOPT_BINARY:
+            state = remote ? &session->options.binary_rx : &session->options.binary_tx;
+            break;
+
+        case TELOPT_SGA:
+            state = remote ? &session->options.sga_rx : &session->options.sga_tx;
+            break;
+
+        case TELOPT_NAWS:
+            if(remote)
+                state = &session->options.naws;
+            break;
+    }
+
+    // Only reply on state changes to avoid negotiation loops
+    if(state) {
+        if(*state != enable) {
+            *state = enable;
+            telnet_send_option(session, remote ? (enable ? TELNET_DO : TELNET_DONT) : (enable ? TELNET_WILL : TELNET_WONT), option);
+        }
+    } else if(enable)
+        telnet_send_option(session, remote ? TELNET_DONT : TELNET_WONT, option);
+}
+
+static void telnet_process_iac (sessiondata_t *session, uint8_t c)
+{
+    telnet_options_t *options = &session->options;
+
+    switch(options->state) {
+
+        case IAC_Command:
+            switch(c) {
+
+                case TELNET_WILL:
+                case TELNET_WONT:
+                case TELNET_DO:
+                case TELNET_DONT:
+                    options->command = c;
+                    options->state = IAC_Option;
+                    break;
+
+                case TELNET_SB:
+                    options->sb_len = 0;
+                    options->state = IAC_SubNegotiation;
+                    break;
+
+                default: // NOP, GA, AYT etc. are ignored
+                    options->state = IAC_Data;
+                    break;
+            }
+            break;
+
+        case IAC_Option:
+            telnet_negotiate(session, options->command, c);
+            options->state = IAC_Data;
+            break;
+
+        case IAC_SubNegotiation:
+            if(c == TELNET_IAC)
+                options->state = IAC_SubNegotiationIAC;
+            else if(options->sb_len < sizeof(options->sb))
+                options->sb[options->sb_len++] = c;
+            break;
+
+        case IAC_SubNegotiationIAC:
+            if(c == TELNET_IAC) {
+                if(options->sb_len < sizeof(options->sb))
+                    options->sb[options->sb_len++] = c;
+                options->state = IAC_SubNegotiation;
+            } else {
+                if(c == TELNET_SE && options->sb_len == 5 && options->sb[0] == TELOPT_NAWS) {
+                    options->width = (options->sb[1] << 8) | options->sb[2];
+                    options->height = (options->sb[3] << 8) | options->sb[4];
+                }
+                options->state = IAC_Data;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+#endif // TELNETD_IAC_ENABLE
+
+//
+// Pass received data to the input stream, telnet commands are stripped.
+// Only 0xFF (IAC) is special so runs of data are located with memchr() and bulk copied.
+// Returns the number of bytes consumed, input from observers is consumed and discarded.
+//
+static uint_fast16_t telnet_rx_put (sessiondata_t *session, const uint8_t *data, uint_fast16_t length)
+{
+    bool owner = session == streambuffers.session;
+
+#if TELNETD_IAC_ENABLE
+
+    const uint8_t *s = data, *end = data + length, *iac;
+    uint_fast16_t len, taken;
+
+    while(s < end) {
+
+        if(session->options.state == IAC_Data) {
+
+            if((iac = memchr(s, TELNET_IAC, end - s)) == NULL)
+                iac = end;
+
+            if((len = iac - s)) {
+                taken = owner ? streamRxPut(s, len) : len;
+                s += taken;
+                if(taken < len)
+                    break; // RX buffer full
+            }
+
+            if(s < end) {
+                session->options.active = true;
+                session->options.state = IAC_Command;
+                s++;
+            }
+
+        } else if(session->options.state == IAC_Command && *s == TELNET_IAC) {
+
+            // Escaped 0xFF data byte
+            if(owner && streamRxPut(s, 1) == 0)
+                break;
+            session->options.state = IAC_Data;
+            s++;
+
+        } else
+            telnet_process_iac(session, *s++);
+    }
+
+    return s - data;
+
+#else
+
+    return owner ? streamRxPut(data, length) : length;
+
+#endif
 }
 
 //
@@ -341,42 +749,29 @@ static err_t telnet_recv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
             pbuf_free(p);
         }
 
-        telnet_close_conn(session, pcb);
+        if(telnet_close_conn(session, pcb))
+            return ERR_ABRT;
 
-    } else if(session->packet.p == NULL) {
+    } else if(session != streambuffers.session) {
 
+        // Observers are read-only, input is only parsed for telnet commands
         struct pbuf *q = p;
-        uint8_t *payload = q->payload;
-        uint_fast16_t len = q->len, taken = 0;
 
         while(q) {
+            telnet_rx_put(session, q->payload, q->len);
+            q = q->next;
+        }
 
-            if(!streamRxPutC(*payload++)) {
-                payload--;
-                break;
-            }
+        tcp_recved(pcb, p->tot_len);
+        pbuf_free(p);
 
-            len--;
-            taken++;
-            if(len == 0 && (q = q->next)) {
-                len = q->len;
-                payload = q->payload;
-            }
-        }
+    } else if(session->packet.p == NULL) {
 
-        if(taken)
-            tcp_recved(session->pcb, taken);
+        session->packet.p = session->packet.q = p;
+        session->packet.len = p->len;
+        session->packet.payload = p->payload;
 
-        if(q == NULL) {
-            pbuf_free(p);
-            session->packet.p = NULL;
-            telnet_stream_handler(session);
-        } else {
-            session->packet.p = p;
-            session->packet.q = q;
-            session->packet.len = q->len - (payload - (uint8_t *)q->payload);
-            session->packet.payload = payload;
-        }
+        telnet_stream_handler(session);
     }
 
     return ERR_OK;
@@ -388,39 +783,26 @@ static err_t telnet_sent (void *arg, struct tcp_pcb *pcb, u16_t ui16len)
 
     session->timeout = 0;
 
+    // Stream owner output is sent without copying, acknowledged data can now be released from the TX buffer
+    if(session == streambuffers.session) {
+        uint_fast16_t inflight = BUFCOUNT(session->tx_tail, session->tx_acked, TXBUF_SIZE);
+        ui16len = telnet_tx_acked(session, ui16len);
+        session->tx_acked = (session->tx_acked + (ui16len > inflight ? inflight : ui16len)) & (TXBUF_SIZE - 1);
+    }
+
     telnet_stream_handler(session);
 
     return ERR_OK;
 }
 
-static bool is_connected (void)
-{
-    return true;
-}
-
 static err_t telnet_accept (void *arg, struct tcp_pcb *pcb, err_t err)
 {
-    static const io_stream_t telnet_stream = {
-        .type = StreamType_Telnet,
-        .is_connected = is_connected,
-        .read = streamGetC,
-        .write = streamWriteS,
-        .write_n = streamWrite,
-        .write_char = streamPutC,
-        .enqueue_rt_command = streamEnqueueRtCommand,
-        .get_rx_buffer_free = streamRxFree,
-        .reset_read_buffer = streamRxFlush,
-        .cancel_read_buffer = streamRxCancel,
-        .suspend_read = streamSuspendInput,
-        .set_enqueue_rt_handler = streamSetRtHandler
-    };
-
     if ((err != ERR_OK) || (pcb == NULL))
         return ERR_VAL;
 
-    sessiondata_t *session = arg;
+    sessiondata_t *session;
 
-    if(session->pcb)
+    if((session = telnet_session_alloc()) == NULL)
         return ERR_CONN; // Busy, refuse connection
 
     if(telnet_server.link_lost) {
@@ -435,58 +817,142 @@ static err_t telnet_accept (void *arg, struct tcp_pcb *pcb, err_t err)
         return ERR_ABRT;
     }
 
-    streamClose(session);
-
     memcpy(session, &defaultSettings, sizeof(sessiondata_t));
 
     session->pcb = pcb;
+    session->tx_tail = session->tx_acked = streambuffers.txbuf.head; // Observers get output from now on
 
     tcp_accepted(pcb);
     tcp_setprio(pcb, TELNETD_TCP_PRIO);
+    if(telnet_flush.policy.nodelay)
+        tcp_nagle_disable(pcb);
     tcp_recv(pcb, telnet_recv);
     tcp_err(pcb, telnet_err);
     tcp_poll(pcb, telnet_poll, TELNETD_POLL_INTERVAL);
     tcp_sent(pcb, telnet_sent);
-    tcp_arg(pcb, &streamSession);
+    tcp_arg(pcb, session);
 
-    // Switch I/O stream to Telnet connection
-    if(stream_connect(&telnet_stream))
-        session->stream = &telnet_stream;
-    // else abort connection?
+    // First connection owns the stream
+    if(streambuffers.session == NULL)
+        streamOpen(session);
 
     return ERR_OK;
 }
 
-void telnet_stream_handler (sessiondata_t *session)
+// Hand the output pending for the session to lwIP from its read cursor in the shared TX buffer.
+// Data for the stream owner is referenced in place, the TX buffer tail is held back until it is
+// acknowledged. Observers gets a copy since their data may be released before it is acknowledged.
+static bool telnet_session_send (sessiondata_t *session)
 {
-    static uint_fast16_t tx_len = 0;
-    static uint8_t txbuf[TX_BUFFER_SIZE];
+    const char *data;
+    uint_fast16_t len;
+    bool sent = false, owner = session == streambuffers.session;
+#if TELNETD_IAC_ENABLE
+    static const uint8_t iac_escaped[2] = { TELNET_IAC, TELNET_IAC };
+    const char *iac;
+#endif
+
+    while((len = stream_tx_peek_at(&streambuffers.txbuf, session->tx_tail, &data))) {
+
+#if TELNETD_IAC_ENABLE
+        // Escape IAC when talking to a telnet client: send the data up to it, then a static IAC IAC pair in its place.
+        if(session->options.active && (iac = memchr(data, TELNET_IAC, len))) {
+            if(iac == data) {
+                if(!telnet_write_extra(session, iac_escaped, sizeof(iac_escaped), 1, 0))
+                    break;
+                session->tx_tail = (session->tx_tail + 1) & (TXBUF_SIZE - 1);
+                sent = true;
+                continue;
+            }
+            len = iac - data;
+        }
+#endif
+
+        if(len > tcp_sndbuf(session->pcb) && (len = tcp_sndbuf(session->pcb)) == 0)
+            break;
 
+        if(telnet_write(session->pcb, data, &len, owner ? 0 : TCP_WRITE_FLAG_COPY) != ERR_OK || len == 0)
+            break;
+
+        session->tx_tail = (session->tx_tail + len) & (TXBUF_SIZE - 1);
+        session->tx_queued += len;
+        sent = true;
+    }
+
+    if(sent) {
+        tcp_output(session->pcb);
+        session->lastSendTime = xTaskGetTickCount();
+    }
+
+    return sent;
+}
+
+//
+// Release the part of the TX buffer that has been sent to all sessions and acknowledged by the owner.
+// Observers that lags behind the owner are resynced to the owner when the buffer
+// is running out of space so that a slow observer never stalls the stream.
+//
+static void telnet_tx_release (void)
+{
+    sessiondata_t *session, *owner = streambuffers.session;
+    uint_fast16_t head = streambuffers.txbuf.head, tail = head, count, max = 0, cursor;
+    uint_fast8_t idx = TELNETD_MAX_SESSIONS;
+
+    do {
+        session = &sessions[--idx];
+        cursor = session == owner ? session->tx_acked : session->tx_tail;
+        if(session->pcb && (count = BUFCOUNT(head, cursor, TXBUF_SIZE)) > max) {
+            max = count;
+            tail = cursor;
+        }
+    } while(idx);
+
+    if(owner && max > (TXBUF_SIZE - 1) - TXBUF_SIZE / 4) {
+
+        uint_fast16_t owner_count = BUFCOUNT(head, owner->tx_tail, TXBUF_SIZE);
+
+        idx = TELNETD_MAX_SESSIONS;
+        do {
+            session = &sessions[--idx];
+            if(session->pcb && (count = BUFCOUNT(head, session->tx_tail, TXBUF_SIZE)) > owner_count) {
+                session->tx_dropped += count - owner_count;
+                session->tx_tail = owner->tx_tail;
+            }
+        } while(idx);
+
+        tail = owner->tx_acked;
+    }
+
+    streambuffers.txbuf.tail = tail;
+}
+
+static void telnet_stream_handler (sessiondata_t *session)
+{
     uint_fast16_t len;
 
     if(session->pcb == NULL)
         return;
 
-    // 1. Process pending input packet
+    // 1. Process pending input packet, telnet commands are stripped by telnet_rx_put()
 
     if(session->packet.p) {
 
         struct pbuf *q = session->packet.q;
         uint8_t *payload = session->packet.payload;
-        uint_fast16_t taken = 0;
+        uint_fast16_t count, taken = 0;
 
         len = session->packet.len;
 
         while(q) {
 
-            if(!streamRxPutC(*payload++)) {
-                payload--;
-                break;
-            }
+            count = len ? telnet_rx_put(session, payload, len) : 0;
+            payload += count;
+            taken += count;
 
-            len--;
-            taken++;
-            if(len == 0 && (q = q->next)) {
+            if((len -= count))
+                break; // RX buffer full, pend buffering rest of data until next polling
+
+            if((q = q->next)) {
                 len = q->len;
                 payload = q->payload;
             }
@@ -505,44 +971,62 @@ void telnet_stream_handler (sessiondata_t *session)
         }
     }
 
-    // 2. Process output stream
+    // 2. Process output stream, the contiguous region(s) of the shared ring buffer are handed
+    //    directly to lwIP for every session from their own read cursor.
 
-    if(tx_len == 0 && (len = streamTxCount())) {
+    sessiondata_t *owner = streambuffers.session;
+    uint_fast8_t idx = TELNETD_MAX_SESSIONS;
 
-        int16_t c;
+    // Only output not yet handed to lwIP counts towards the flush policy, the buffer also holds unacknowledged owner data
+    if(stream_flush_due(&telnet_flush, owner ? BUFCOUNT(streambuffers.txbuf.head, owner->tx_tail, TXBUF_SIZE) : stream_tx_count(&streambuffers.txbuf))) {
 
-        while(len) {
-            if((c = (uint8_t)streamTxGetC()) == SERIAL_NO_DATA)
-                break;
-            txbuf[tx_len++] = (uint8_t)c;
-            len--;
-        }
+        do {
+            session = &sessions[--idx];
+            if(session->pcb && session != owner)
+                telnet_session_send(session);
+        } while(idx);
+
+        if(owner && telnet_session_send(owner))
+            stream_flush_done(&telnet_flush, BUFCOUNT(streambuffers.txbuf.head, owner->tx_tail, TXBUF_SIZE) == 0);
     }
 
-    if(tx_len) {
+    telnet_tx_release();
+}
+
+void telnetd_poll (void)
+{
+    uint_fast8_t idx = TELNETD_MAX_SESSIONS;
+
+    do {
+        if(sessions[--idx].pcb)
+            telnet_stream_handler(&sessions[idx]);
+    } while(idx);
+}
 
-        err_t err;
+void telnetd_set_flush_policy (const stream_flush_policy_t *policy)
+{
+    uint_fast8_t idx = TELNETD_MAX_SESSIONS;
 
-        len = tx_len;
+    stream_flush_init(&telnet_flush, policy);
 
-        do {
-            if((err = tcp_write(session->pcb, txbuf, (u16_t)len, TCP_WRITE_FLAG_COPY)) == ERR_MEM)
-                len = tcp_sndqueuelen(session->pcb) >= TCP_SND_QUEUELEN ? 1 : len / 2;
-        } while(err == ERR_MEM && len > 1);
-
-        if(err == ERR_OK) {
-            if(tx_len != len)
-                memmove(txbuf, &txbuf[len + 1], tx_len - len);
-            tx_len -= len;
-            tcp_output(session->pcb);
-            session->lastSendTime = xTaskGetTickCount();
+    do {
+        if(sessions[--idx].pcb) {
+            if(policy->nodelay)
+                tcp_nagle_disable(sessions[idx].pcb);
+            else
+                tcp_nagle_enable(sessions[idx].pcb);
         }
-    }
+    } while(idx);
 }
 
-void telnetd_poll (void)
+stream_flush_stats_t telnetd_get_flush_stats (bool reset)
 {
-    telnet_stream_handler(&streamSession);
+    stream_flush_stats_t stats = telnet_flush.stats;
+
+    if(reset)
+        memset(&telnet_flush.stats, 0, sizeof(stream_flush_stats_t));
+
+    return stats;
 }
 
 void telnetd_notify_link_status (bool up)
@@ -554,28 +1038,39 @@ void telnetd_notify_link_status (bool up)
 
 void telnetd_close_connections (void)
 {
-    streamClose(&streamSession);
+    if(streambuffers.session)
+        streamClose(streambuffers.session);
 }
 
 void telnetd_stop (void)
 {
     if(telnet_server.pcb != NULL) {
 
-        if(streamSession.pcb != NULL) {
+        sessiondata_t *session;
+        uint_fast8_t idx = TELNETD_MAX_SESSIONS;
+
+        do {
+            session = &sessions[--idx];
 
-            tcp_arg(streamSession.pcb, NULL);
-            tcp_recv(streamSession.pcb, NULL);
-            tcp_sent(streamSession.pcb, NULL);
-            tcp_err(streamSession.pcb, NULL);
-            tcp_poll(streamSession.pcb, NULL, 1);
+            if(session->pcb != NULL) {
 
-            tcp_abort(streamSession.pcb);
+                tcp_arg(session->pcb, NULL);
+                tcp_recv(session->pcb, NULL);
+                tcp_sent(session->pcb, NULL);
+                tcp_err(session->pcb, NULL);
+                tcp_poll(session->pcb, NULL, 1);
 
-            // Switch grbl I/O stream back to default
-            streamClose(&streamSession);
-        }
+                tcp_abort(session->pcb);
+
+                session->pcb = NULL;
+
+                // Switch grbl I/O stream back to default
+                streamClose(session);
+            }
+
+            telnet_state_free(session);
 
-        telnet_state_free(&streamSession);
+        } while(idx);
 
         tcp_close(telnet_server.pcb);
 
@@ -595,7 +1090,6 @@ bool telnetd_init (uint16_t port)
 
         telnet_server.pcb = tcp_listen(pcb);
 
-        tcp_arg(telnet_server.pcb, &streamSession);
         tcp_accept(telnet_server.pcb, telnet_accept);
     }
 
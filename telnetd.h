@@ -39,10 +39,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __TCPSTREAM_H__
 #define __TCPSTREAM_H__
 
+#include "streambuffer.h"
+
 bool telnetd_init (uint16_t port);
 void telnetd_poll (void);
 void telnetd_notify_link_status (bool link_up);
 void telnetd_stop (void);
 void telnetd_close_connections (void);
+void telnetd_set_flush_policy (const stream_flush_policy_t *policy);
+stream_flush_stats_t telnetd_get_flush_stats (bool reset);
 
 #endif
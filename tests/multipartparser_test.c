@@ -0,0 +1,212 @@
+//
+// tests/multipartparser_test.c - host differential check and benchmark of the multipart/form-data parser
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+//
+// Without arguments random bodies are parsed in random sized chunks and the part data
+// delivered by the parser is compared with the data the bodies were built from.
+// The payloads contain CRs, dashes and partial delimiters to exercise the delimiter search.
+// With --bench an 8 MB upload is parsed in TCP_MSS sized chunks and the throughput reported.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "multipartparser.h"
+
+#define BODIES      2000
+#define MAX_PARTS   3
+#define MAX_PAYLOAD 3000
+#define BENCH_SIZE  8000000
+#define BENCH_PASSES 20
+#define CHUNK_MSS   1460
+
+static const char boundary[] = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+
+static char *out;
+static size_t out_len, calls;
+
+static int on_data (multipartparser *parser, const char *data, size_t size)
+{
+    memcpy(out + out_len, data, size);
+    out_len += size;
+    calls++;
+
+    return 0;
+}
+
+// Parts are separated by | in the output.
+static int on_part_end (multipartparser *parser)
+{
+    out[out_len++] = '|';
+
+    return 0;
+}
+
+static size_t build_body (char *body, char **payload, size_t *len, int parts)
+{
+    int i;
+    size_t pos = sprintf(body, "preamble\r\n");
+
+    for(i = 0; i < parts; i++) {
+        pos += sprintf(body + pos, "--%s\r\nContent-Disposition: form-data; name=\"f%d\"\r\n\r\n", boundary, i);
+        memcpy(body + pos, payload[i], len[i]);
+        pos += len[i];
+        pos += sprintf(body + pos, "\r\n");
+    }
+
+    return pos + sprintf(body + pos, "--%s--\r\n", boundary);
+}
+
+// Parses body in chunks of chunk bytes, random sizes from 1 to 100 if 0. Returns false on a parser error.
+static bool parse (const char *body, size_t length, size_t chunk)
+{
+    size_t pos = 0, len;
+    multipartparser parser;
+    multipartparser_callbacks callbacks;
+
+    multipartparser_init(&parser, boundary);
+    multipartparser_callbacks_init(&callbacks);
+    callbacks.on_data = on_data;
+    callbacks.on_part_end = on_part_end;
+
+    out_len = calls = 0;
+
+    while(pos < length) {
+        if((len = chunk ? chunk : 1 + rand() % 100) > length - pos)
+            len = length - pos;
+        if(multipartparser_execute(&parser, &callbacks, body + pos, len) != len) {
+            printf("parser error at offset %zu\n", pos);
+            return false;
+        }
+        pos += len;
+    }
+
+    return true;
+}
+
+static int differential (void)
+{
+    int i, n, parts;
+    size_t k, len[MAX_PARTS], exp_len, body_len, at;
+    char *payload[MAX_PARTS];
+    char *body = malloc(MAX_PARTS * (MAX_PAYLOAD + 200)), *exp = malloc(MAX_PARTS * (MAX_PAYLOAD + 1));
+
+    out = malloc(MAX_PARTS * (MAX_PAYLOAD + 1));
+
+    for(i = 0; i < MAX_PARTS; i++)
+        payload[i] = malloc(MAX_PAYLOAD + 1);
+
+    for(n = 0; n < BODIES; n++) {
+
+        parts = 1 + rand() % MAX_PARTS;
+        exp_len = 0;
+
+        for(i = 0; i < parts; i++) {
+
+            len[i] = rand() % (MAX_PAYLOAD + 1);
+
+            for(k = 0; k < len[i]; k++) {
+                int r = rand() % 16;
+                payload[i][k] = r < 4 ? "\r\n-"[r % 3] : (r < 8 ? boundary[rand() % (sizeof(boundary) - 1)] : (char)rand());
+            }
+
+            // Plant a delimiter that does not match in full.
+            if(len[i] > 50) {
+                int partial = rand() % (int)(sizeof(boundary) - 1);
+                at = rand() % (len[i] - 45);
+                memcpy(payload[i] + at, "\r\n--", 4);
+                memcpy(payload[i] + at + 4, boundary, partial);
+                payload[i][at + 4 + partial] = '#';
+            }
+
+            memcpy(exp + exp_len, payload[i], len[i]);
+            exp_len += len[i];
+            exp[exp_len++] = '|';
+        }
+
+        body_len = build_body(body, payload, len, parts);
+
+        if(!parse(body, body_len, 0) || out_len != exp_len || memcmp(out, exp, exp_len)) {
+            printf("body %d: part data mismatch, %zu bytes vs %zu expected\n", n, out_len, exp_len);
+            return 1;
+        }
+    }
+
+    printf("%d bodies ok\n", BODIES);
+
+    return 0;
+}
+
+static int benchmark (void)
+{
+    int i;
+    size_t k, len = BENCH_SIZE;
+    char *payload = malloc(BENCH_SIZE), *body = malloc(BENCH_SIZE + 200);
+    clock_t start;
+    double secs;
+
+    out = malloc(BENCH_SIZE + 1);
+
+    for(k = 0; k < len; k++)
+        payload[k] = (char)rand();
+
+    len = build_body(body, &payload, &len, 1);
+
+    start = clock();
+
+    for(i = 0; i < BENCH_PASSES; i++) {
+        if(!parse(body, len, CHUNK_MSS))
+            return 1;
+    }
+
+    secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%.1f MB/s, %zu on_data calls per pass\n", (double)len * BENCH_PASSES / 1e6 / secs, calls);
+
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    srand(1);
+
+    return argc > 1 && !strcmp(argv[1], "--bench") ? benchmark() : differential();
+}
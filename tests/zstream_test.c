@@ -0,0 +1,437 @@
+//
+// tests/zstream_test.c - host round trip of the streaming deflate/inflate against zlib produced vectors
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+//
+// The vectors below were produced by zlib (Python zlib.compress()) from the G-code generated
+// by gcode(): a stored block (level 0), a fixed Huffman block (Z_FIXED) and dynamic Huffman
+// blocks (level 9). Each vector is inflated in chunks of varying size, then truncated and
+// corrupted copies are checked to be rejected. Finally the generated G-code and random data
+// are deflated in small steps and inflated again.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "zstream.h"
+
+#define MAX_TEXT    16000
+#define RANDOM_SIZE 20000
+
+static const uint8_t stored_z[] = {
+    0x78, 0x01, 0x01, 0xe4, 0x00, 0x1b, 0xff, 0x4e, 0x30, 0x20, 0x47, 0x31, 0x20, 0x58, 0x30, 0x2e,
+    0x30, 0x30, 0x30, 0x20, 0x59, 0x30, 0x2e, 0x30, 0x30, 0x30, 0x20, 0x46, 0x31, 0x35, 0x30, 0x30,
+    0x0a, 0x4e, 0x31, 0x20, 0x47, 0x31, 0x20, 0x58, 0x33, 0x37, 0x2e, 0x31, 0x31, 0x33, 0x20, 0x59,
+    0x35, 0x39, 0x2e, 0x32, 0x37, 0x31, 0x20, 0x46, 0x31, 0x35, 0x30, 0x30, 0x0a, 0x4e, 0x32, 0x20,
+    0x47, 0x31, 0x20, 0x58, 0x37, 0x34, 0x2e, 0x32, 0x32, 0x36, 0x20, 0x59, 0x31, 0x31, 0x38, 0x2e,
+    0x35, 0x34, 0x32, 0x20, 0x46, 0x31, 0x35, 0x30, 0x30, 0x0a, 0x4e, 0x33, 0x20, 0x47, 0x31, 0x20,
+    0x58, 0x31, 0x31, 0x31, 0x2e, 0x33, 0x33, 0x39, 0x20, 0x59, 0x32, 0x37, 0x2e, 0x38, 0x31, 0x33,
+    0x20, 0x46, 0x31, 0x35, 0x30, 0x30, 0x0a, 0x4e, 0x34, 0x20, 0x47, 0x31, 0x20, 0x58, 0x31, 0x34,
+    0x38, 0x2e, 0x34, 0x35, 0x32, 0x20, 0x59, 0x38, 0x36, 0x2e, 0x30, 0x38, 0x34, 0x20, 0x46, 0x31,
+    0x35, 0x30, 0x30, 0x0a, 0x4e, 0x35, 0x20, 0x47, 0x31, 0x20, 0x58, 0x31, 0x38, 0x35, 0x2e, 0x35,
+    0x36, 0x35, 0x20, 0x59, 0x31, 0x34, 0x35, 0x2e, 0x33, 0x35, 0x35, 0x20, 0x46, 0x31, 0x35, 0x30,
+    0x30, 0x0a, 0x4e, 0x36, 0x20, 0x47, 0x31, 0x20, 0x58, 0x32, 0x32, 0x2e, 0x36, 0x37, 0x38, 0x20,
+    0x59, 0x35, 0x34, 0x2e, 0x36, 0x32, 0x36, 0x20, 0x46, 0x31, 0x35, 0x30, 0x30, 0x0a, 0x4e, 0x37,
+    0x20, 0x47, 0x31, 0x20, 0x58, 0x35, 0x39, 0x2e, 0x37, 0x39, 0x31, 0x20, 0x59, 0x31, 0x31, 0x33,
+    0x2e, 0x38, 0x39, 0x37, 0x20, 0x46, 0x31, 0x35, 0x30, 0x30, 0x0a, 0x91, 0xbf, 0x2d, 0xf0
+};
+
+static const uint8_t fixed_z[] = {
+    0x78, 0x01, 0xf3, 0x33, 0x50, 0x70, 0x37, 0x54, 0x88, 0x30, 0xd0, 0x33, 0x30, 0x30, 0x50, 0x88,
+    0x84, 0x50, 0x6e, 0x86, 0xa6, 0x06, 0x06, 0x5c, 0x7e, 0x86, 0x60, 0x19, 0x63, 0x73, 0x3d, 0x43,
+    0x43, 0x63, 0x85, 0x48, 0x53, 0x4b, 0x3d, 0x23, 0x73, 0x43, 0x98, 0x9c, 0x11, 0x58, 0xce, 0xdc,
+    0x44, 0xcf, 0xc8, 0xc8, 0x4c, 0x21, 0xd2, 0xd0, 0xd0, 0x42, 0xcf, 0xd4, 0xc4, 0x08, 0x26, 0x69,
+    0x0c, 0x96, 0x34, 0x34, 0x34, 0xd4, 0x33, 0x36, 0xb6, 0x54, 0x88, 0x34, 0x32, 0xd7, 0xb3, 0x00,
+    0x9a, 0x00, 0x95, 0x34, 0x81, 0x48, 0x9a, 0x58, 0xe8, 0x99, 0x98, 0x1a, 0x29, 0x44, 0x5a, 0x98,
+    0xe9, 0x19, 0x58, 0x98, 0xc0, 0x24, 0x4d, 0x21, 0x92, 0x16, 0xa6, 0x7a, 0xa6, 0x66, 0xa6, 0x40,
+    0x73, 0x4d, 0x4c, 0xf5, 0x8c, 0x4d, 0x4d, 0x61, 0xb2, 0x66, 0x60, 0x59, 0x23, 0x23, 0x3d, 0x33,
+    0x73, 0x0b, 0xa0, 0x83, 0x4c, 0xf4, 0xcc, 0x80, 0x96, 0x43, 0xe5, 0xcc, 0xc1, 0x72, 0x40, 0x47,
+    0x9a, 0x5b, 0x1a, 0x82, 0x1c, 0x64, 0xac, 0x67, 0x61, 0x69, 0x0e, 0x93, 0xb4, 0x00, 0x4b, 0x5a,
+    0x9a, 0xe9, 0x59, 0x1a, 0x98, 0x00, 0xdd, 0x63, 0xa4, 0x67, 0x68, 0x66, 0x01, 0x93, 0xb3, 0x84,
+    0x58, 0x69, 0x6c, 0xac, 0x67, 0x60, 0x68, 0x0e, 0x74, 0x8f, 0xa1, 0x9e, 0x09, 0xd0, 0xd1, 0xb0,
+    0x20, 0x80, 0x84, 0x8e, 0xa1, 0xb9, 0x81, 0x9e, 0xa1, 0xb1, 0x01, 0xc8, 0x41, 0x06, 0x7a, 0xe6,
+    0x86, 0x88, 0x10, 0x82, 0x04, 0x91, 0xb9, 0x9e, 0x91, 0x09, 0x30, 0x84, 0x4c, 0x2c, 0xf5, 0x2c,
+    0x2d, 0xe0, 0x21, 0x64, 0x08, 0x09, 0x22, 0x13, 0x13, 0xa0, 0x0f, 0x40, 0x41, 0x64, 0x60, 0xa1,
+    0x67, 0x64, 0x0a, 0x0f, 0x22, 0x43, 0x48, 0x18, 0x81, 0x6c, 0x33, 0x03, 0x06, 0x91, 0xa1, 0xb9,
+    0x9e, 0xa9, 0x11, 0x3c, 0x88, 0x0c, 0xa1, 0x61, 0x04, 0x0a, 0x55, 0x0b, 0x60, 0x18, 0x99, 0x9b,
+    0x01, 0x7d, 0x05, 0x0f, 0x23, 0x43, 0x68, 0x20, 0x99, 0x9a, 0xea, 0x99, 0x59, 0x82, 0x02, 0xc9,
+    0xd8, 0x54, 0xcf, 0xc0, 0x0c, 0x1e, 0x48, 0x86, 0x90, 0x50, 0x32, 0xb4, 0x34, 0xd2, 0xb3, 0x30,
+    0x00, 0x06, 0x13, 0xc8, 0x01, 0xc6, 0xf0, 0x60, 0x32, 0x84, 0x84, 0x93, 0x11, 0xd0, 0xa9, 0x46,
+    0xa0, 0x70, 0x32, 0x30, 0xd6, 0x33, 0x33, 0x80, 0x87, 0x93, 0x21, 0x24, 0xa0, 0xcc, 0x80, 0x71,
+    0x62, 0x0c, 0x0c, 0x28, 0x43, 0xa0, 0x11, 0xe6, 0xf0, 0x80, 0x32, 0x84, 0x86, 0x14, 0x50, 0x8b,
+    0xa1, 0x09, 0x30, 0xa4, 0xcc, 0x0d, 0x81, 0x34, 0x3c, 0xa4, 0x8c, 0xa0, 0x21, 0x05, 0x0c, 0x20,
+    0x23, 0x33, 0x50, 0x48, 0x19, 0x1b, 0xe8, 0x99, 0x18, 0xc1, 0x43, 0xca, 0xc8, 0x10, 0x1a, 0x90,
+    0xe6, 0x7a, 0xc6, 0xe6, 0xc0, 0xb0, 0x32, 0xb6, 0x04, 0x3a, 0x1e, 0x91, 0x9a, 0x8c, 0xa0, 0x9a,
+    0xf5, 0x4c, 0x2c, 0x80, 0x61, 0x65, 0x69, 0xa1, 0x67, 0x69, 0x06, 0x0f, 0x2a, 0x23, 0x48, 0x50,
+    0x99, 0x1a, 0xea, 0x99, 0x5a, 0x02, 0x83, 0x0a, 0x18, 0xd8, 0xc6, 0xf0, 0x90, 0x32, 0x82, 0x84,
+    0x94, 0x85, 0x05, 0x30, 0x56, 0x80, 0x01, 0x05, 0x74, 0xb8, 0xa9, 0x01, 0x3c, 0xa0, 0x8c, 0xa0,
+    0x01, 0x65, 0x64, 0xaa, 0x67, 0x61, 0x04, 0x0a, 0x28, 0x20, 0xc3, 0xdc, 0x1c, 0x1e, 0x50, 0x46,
+    0xd0, 0x80, 0x32, 0x33, 0xd2, 0xb3, 0x34, 0x06, 0x06, 0x94, 0xb1, 0x89, 0x9e, 0x81, 0x09, 0x3c,
+    0xa0, 0x8c, 0xcc, 0xa1, 0xc1, 0x68, 0xa9, 0x67, 0x60, 0x0a, 0x0c, 0x29, 0x4b, 0x63, 0x3d, 0x63,
+    0x43, 0x78, 0x40, 0x19, 0x41, 0x02, 0xca, 0xd8, 0x0c, 0x98, 0x92, 0x40, 0x29, 0x0a, 0x18, 0x4f,
+    0xf0, 0x70, 0x32, 0x82, 0x84, 0x93, 0xb9, 0x31, 0x30, 0xbf, 0x00, 0x83, 0xc9, 0xcc, 0x50, 0xcf,
+    0xc2, 0x14, 0x1e, 0x4c, 0xc6, 0xd0, 0x60, 0x32, 0x34, 0xd0, 0x33, 0xb6, 0x04, 0x05, 0x93, 0x11,
+    0x24, 0x65, 0xc1, 0xa4, 0xa1, 0xc1, 0x64, 0x02, 0x4c, 0x0f, 0x06, 0xc0, 0x60, 0x02, 0xc6, 0x93,
+    0x89, 0x01, 0x3c, 0x98, 0x8c, 0xa1, 0xc1, 0x64, 0x01, 0x4c, 0xf9, 0xc0, 0x68, 0x8e, 0x04, 0x7a,
+    0xdb, 0xcc, 0x1c, 0x91, 0xeb, 0x20, 0xe1, 0x64, 0x64, 0xa8, 0x67, 0x6e, 0x04, 0x4a, 0x52, 0x40,
+    0x33, 0x2c, 0x4d, 0xe0, 0x21, 0x65, 0x0c, 0x09, 0x29, 0x53, 0x0b, 0x3d, 0x0b, 0x60, 0x46, 0x8d,
+    0x34, 0x35, 0xd3, 0x33, 0x32, 0x84, 0x87, 0x94, 0x31, 0x24, 0xa4, 0x2c, 0x4d, 0xf5, 0x2c, 0x4d,
+    0x41, 0x01, 0x65, 0x68, 0x0a, 0x8c, 0x08, 0x78, 0x40, 0x19, 0x43, 0x03, 0xca, 0xd8, 0x08, 0x98,
+    0xce, 0x80, 0x01, 0x65, 0x64, 0xa2, 0x67, 0x6e, 0x0a, 0x0f, 0x28, 0x63, 0x68, 0x40, 0x99, 0x59,
+    0xea, 0x19, 0x02, 0x53, 0x7f, 0xa4, 0x05, 0x30, 0x23, 0x19, 0xc1, 0x03, 0xca, 0x18, 0x9a, 0xa2,
+    0xf4, 0x8c, 0x2c, 0x41, 0x09, 0xca, 0xc4, 0x08, 0xc8, 0x80, 0x87, 0x94, 0x31, 0x24, 0xa4, 0x4c,
+    0x8c, 0x81, 0x9e, 0x04, 0x86, 0x14, 0x28, 0x86, 0xcd, 0x60, 0x21, 0x05, 0x00, 0xa3, 0x5d, 0xed,
+    0x44
+};
+
+static const uint8_t dynamic_z[] = {
+    0x78, 0xda, 0x4d, 0x98, 0x4d, 0xb2, 0x2c, 0x29, 0x08, 0x46, 0xe7, 0xbd, 0x8a, 0x5a, 0x81, 0x21,
+    0x28, 0x8a, 0x1b, 0xe8, 0x9e, 0xbd, 0xf1, 0x73, 0xff, 0x1b, 0xe9, 0x8f, 0x84, 0x84, 0x1c, 0xdd,
+    0x1b, 0x61, 0x54, 0x95, 0x1e, 0xf9, 0x39, 0xf2, 0xa7, 0xff, 0xfe, 0xa3, 0xdf, 0xdf, 0xde, 0x7a,
+    0xef, 0xbf, 0xeb, 0x7f, 0xfe, 0x25, 0xe9, 0xfd, 0x9f, 0x3f, 0xf4, 0xac, 0x8c, 0xdd, 0x88, 0xc6,
+    0xef, 0xca, 0x69, 0xbc, 0xe9, 0x5d, 0xe3, 0x67, 0x6d, 0xcf, 0xc6, 0xbc, 0x7e, 0x97, 0x48, 0x9b,
+    0x4c, 0x7e, 0x17, 0xc7, 0xb3, 0x48, 0x44, 0x6d, 0x8c, 0xf3, 0xbb, 0xbc, 0x9b, 0xe2, 0x1b, 0x62,
+    0x71, 0xfa, 0xe2, 0xd4, 0x36, 0x85, 0x7f, 0x57, 0x57, 0xeb, 0x3a, 0xdf, 0x45, 0xf1, 0x45, 0x95,
+    0x26, 0x4b, 0xf0, 0xbd, 0x53, 0xda, 0x10, 0x79, 0x57, 0xd7, 0xb3, 0xca, 0xdc, 0xd6, 0x56, 0x6c,
+    0x68, 0xb6, 0x85, 0x1f, 0x8f, 0xb5, 0xfd, 0xac, 0x61, 0x93, 0xfb, 0x90, 0x6d, 0x68, 0x34, 0x3d,
+    0xfb, 0x5d, 0xd4, 0x67, 0xf1, 0xac, 0x76, 0xfa, 0xc4, 0x7e, 0xb8, 0xd1, 0xd2, 0x77, 0xed, 0xf8,
+    0x4f, 0x8e, 0xd1, 0x3a, 0x6d, 0xec, 0x87, 0xda, 0xc4, 0xa6, 0x5f, 0x04, 0x4e, 0x87, 0x76, 0x6f,
+    0x34, 0xba, 0x6d, 0xa8, 0xb7, 0x4d, 0x45, 0xc8, 0x11, 0xed, 0xc6, 0x13, 0x84, 0xe6, 0x69, 0x47,
+    0x93, 0x10, 0x39, 0xa2, 0x39, 0x71, 0x02, 0x43, 0xd4, 0xb5, 0xb1, 0x24, 0x22, 0x72, 0x46, 0xf6,
+    0x6b, 0x0b, 0x88, 0x68, 0x37, 0xe1, 0x44, 0x44, 0xc1, 0xc8, 0xa8, 0x2a, 0x18, 0xed, 0x85, 0x53,
+    0x25, 0x23, 0x0a, 0x48, 0x22, 0x6d, 0x1d, 0x83, 0x34, 0xa4, 0xf5, 0x95, 0x90, 0xc8, 0x29, 0xd1,
+    0xe1, 0xa6, 0x1d, 0x98, 0x6c, 0x03, 0x23, 0x31, 0x91, 0x73, 0x62, 0x6c, 0x95, 0x8d, 0x53, 0x1f,
+    0x6d, 0xf5, 0xe4, 0x44, 0x0e, 0x6a, 0xe1, 0x4e, 0x06, 0x40, 0x11, 0xbe, 0x62, 0x27, 0x28, 0x0a,
+    0x52, 0xf8, 0x08, 0x4d, 0x90, 0xda, 0x84, 0xbf, 0x49, 0x8a, 0x83, 0x14, 0x00, 0xf1, 0x32, 0x52,
+    0xa3, 0xb7, 0xc9, 0x49, 0x8a, 0x29, 0x40, 0xee, 0x36, 0x36, 0x58, 0x8d, 0x83, 0xcd, 0x57, 0x34,
+    0x71, 0x7c, 0xb8, 0x4d, 0x05, 0xab, 0xa3, 0xed, 0xac, 0x44, 0xc5, 0x8e, 0x4a, 0xa8, 0xc9, 0x01,
+    0x2a, 0xc0, 0x1e, 0x49, 0x8a, 0x9d, 0x94, 0x2a, 0x6e, 0x05, 0xa0, 0xb0, 0x71, 0xe9, 0x09, 0x8a,
+    0x03, 0x14, 0x4b, 0x53, 0x36, 0x50, 0xf8, 0x67, 0xef, 0x04, 0xc5, 0x01, 0x6a, 0x71, 0x3b, 0x03,
+    0xa0, 0xc6, 0x6c, 0x7d, 0x26, 0x28, 0xde, 0x81, 0xf1, 0xb4, 0x2e, 0x20, 0x75, 0x46, 0x1b, 0x94,
+    0xa0, 0xd8, 0x41, 0x8d, 0x85, 0x48, 0xb2, 0x88, 0xc2, 0x3d, 0x25, 0x27, 0x76, 0x4e, 0x7b, 0x20,
+    0x5f, 0x80, 0x69, 0x51, 0x53, 0x49, 0x4c, 0x23, 0x30, 0x51, 0x6f, 0xe3, 0x18, 0x26, 0xf6, 0xc8,
+    0x7a, 0x97, 0x03, 0xd3, 0x44, 0x3c, 0x74, 0x60, 0xc2, 0x3d, 0xcd, 0x9e, 0x98, 0x46, 0x60, 0x52,
+    0x44, 0x3e, 0xae, 0xf9, 0xe2, 0xd8, 0x6b, 0x57, 0xd6, 0x39, 0x27, 0xa6, 0xb6, 0xd9, 0x42, 0x0a,
+    0xdf, 0x71, 0x66, 0x92, 0x1a, 0x4e, 0x4a, 0xb4, 0x29, 0x12, 0xf5, 0xca, 0x6a, 0x4c, 0x49, 0x6a,
+    0x38, 0xa9, 0x23, 0xed, 0x88, 0x81, 0x22, 0xc1, 0x45, 0x24, 0xa8, 0x11, 0xa0, 0x06, 0x23, 0xce,
+    0x00, 0x8a, 0x67, 0xdb, 0x92, 0xa0, 0x46, 0x80, 0x5a, 0xa7, 0x11, 0xa2, 0xff, 0x2a, 0x12, 0x89,
+    0x13, 0xd4, 0x88, 0x88, 0x6a, 0x7c, 0x2c, 0xa0, 0x26, 0xe3, 0x9f, 0x24, 0x35, 0x9c, 0xd4, 0x1c,
+    0x38, 0x24, 0x48, 0xd9, 0x0d, 0xaf, 0x24, 0x35, 0x9d, 0x94, 0x76, 0x64, 0x86, 0x81, 0x02, 0x31,
+    0x9d, 0x09, 0x6a, 0x06, 0x28, 0x24, 0xce, 0xc2, 0xc1, 0x2f, 0xe1, 0xd7, 0x29, 0x41, 0xcd, 0x00,
+    0x85, 0x12, 0xb1, 0x71, 0xa5, 0x77, 0x6b, 0x1b, 0x9a, 0xa0, 0x66, 0xd4, 0xa7, 0xe3, 0x37, 0x83,
+    0x50, 0xc5, 0x97, 0x48, 0x15, 0x28, 0x27, 0xc5, 0x08, 0x42, 0xc0, 0xbd, 0x13, 0x55, 0x83, 0x93,
+    0xd4, 0x74, 0x52, 0x0b, 0x29, 0xa7, 0x46, 0xaa, 0x4b, 0xa3, 0x93, 0xa4, 0x66, 0x90, 0xea, 0xa8,
+    0x30, 0x38, 0xe6, 0xb5, 0x80, 0x5e, 0x49, 0x6a, 0x06, 0x29, 0xc4, 0xfe, 0xc0, 0x5e, 0x2f, 0x22,
+    0x64, 0x8f, 0x24, 0x35, 0x35, 0x32, 0x64, 0x21, 0x6f, 0x8c, 0x95, 0xe1, 0xee, 0xc9, 0x6a, 0xbe,
+    0x75, 0xaa, 0x09, 0x3e, 0x73, 0x27, 0x21, 0xba, 0x92, 0x95, 0x38, 0x2b, 0xe9, 0x38, 0x87, 0xb1,
+    0xea, 0x80, 0x26, 0xc9, 0x4a, 0x9c, 0x95, 0xee, 0xb6, 0x17, 0x50, 0x1d, 0x64, 0x43, 0x92, 0x92,
+    0x20, 0x85, 0x3b, 0xd5, 0x0d, 0x52, 0x4b, 0x5b, 0x3f, 0x49, 0x4a, 0x82, 0x14, 0x62, 0xf8, 0xa8,
+    0x91, 0x42, 0x29, 0x1f, 0x2b, 0x49, 0x49, 0xd4, 0x29, 0xe4, 0x2b, 0x8e, 0x8c, 0x0c, 0x5a, 0xb8,
+    0x8c, 0xaa, 0xe5, 0x8e, 0x0a, 0xd5, 0x89, 0x51, 0xb2, 0xae, 0x05, 0x57, 0x4f, 0x52, 0xe2, 0xa4,
+    0x36, 0xb7, 0xc1, 0x56, 0xa4, 0x1a, 0xce, 0x9d, 0x6b, 0xc1, 0xa9, 0x23, 0xf8, 0x71, 0xcf, 0x77,
+    0x21, 0x3e, 0x66, 0x72, 0x92, 0xe0, 0x84, 0x7b, 0x11, 0x79, 0x8a, 0x14, 0x23, 0xf9, 0x93, 0x93,
+    0x04, 0x27, 0x84, 0xe1, 0x5a, 0x00, 0x35, 0x7c, 0xeb, 0x6f, 0x07, 0x71, 0x50, 0x48, 0xba, 0xad,
+    0x00, 0x75, 0xbc, 0x58, 0xbd, 0x8b, 0xce, 0x49, 0xd0, 0xae, 0x8e, 0x85, 0x14, 0xea, 0xb9, 0x8c,
+    0x24, 0xb5, 0x9c, 0xd4, 0x41, 0x95, 0xe8, 0x00, 0x65, 0x89, 0xd4, 0x13, 0xd4, 0x0a, 0x50, 0xf8,
+    0x35, 0x22, 0x03, 0x85, 0xb8, 0xec, 0x3b, 0x41, 0xad, 0x00, 0x05, 0xba, 0x8c, 0x24, 0xbe, 0xbc,
+    0xda, 0x98, 0x09, 0x6a, 0x39, 0x28, 0xb4, 0x3a, 0x44, 0xd7, 0x45, 0xef, 0x5b, 0x54, 0x2d, 0xcf,
+    0x39, 0x21, 0x6f, 0xa6, 0x3c, 0x01, 0x85, 0x7b, 0xd2, 0x24, 0xb5, 0x9c, 0xd4, 0xc6, 0x46, 0xd1,
+    0x9a, 0xaf, 0xa0, 0x32, 0x4b, 0x82, 0x5a, 0x01, 0x8a, 0x70, 0x2b, 0x6a, 0xa0, 0x50, 0xce, 0x27,
+    0x27, 0xa8, 0x15, 0xa0, 0xf0, 0xa1, 0x8d, 0x4e, 0x79, 0x51, 0x37, 0xd6, 0x49, 0x50, 0x3b, 0xea,
+    0x14, 0x08, 0x1d, 0xf4, 0xbb, 0x8b, 0x34, 0x3c, 0x3b, 0x49, 0x6d, 0x27, 0x85, 0x68, 0xe8, 0x6c,
+    0xa4, 0x10, 0xd1, 0x3c, 0x93, 0xd4, 0x76, 0x52, 0x0b, 0x97, 0x8a, 0xd2, 0x71, 0xd1, 0xe9, 0x85,
+    0x92, 0xd4, 0x0e, 0x52, 0x1d, 0x01, 0x3c, 0x8d, 0x54, 0x47, 0x58, 0x6a, 0x92, 0xda, 0x41, 0x6a,
+    0x20, 0x63, 0x41, 0xfc, 0x62, 0xf3, 0x5d, 0x92, 0xd4, 0x8e, 0x8a, 0xbe, 0x51, 0x9f, 0xf0, 0xff,
+    0xc5, 0xdf, 0xc1, 0xc9, 0x6a, 0x47, 0xf6, 0x79, 0x35, 0xc6, 0xae, 0x26, 0x3a, 0x46, 0x09, 0x82,
+    0xb3, 0xc2, 0xa5, 0x6e, 0x54, 0xd4, 0x8b, 0xa2, 0xa3, 0x2b, 0x59, 0x6d, 0x67, 0x05, 0x19, 0x51,
+    0x32, 0x54, 0x96, 0xc0, 0x23, 0x51, 0xed, 0x40, 0xc5, 0x03, 0xa5, 0x60, 0x1b, 0x49, 0x14, 0xac,
+    0x44, 0xa5, 0x81, 0x6a, 0x41, 0x9e, 0x50, 0xa0, 0x2e, 0x5c, 0x61, 0x69, 0xa2, 0xd2, 0x28, 0x54,
+    0x07, 0x1a, 0x25, 0xc6, 0xca, 0x5a, 0xaf, 0x24, 0x2b, 0x75, 0x56, 0xd8, 0x2a, 0xe3, 0xaa, 0x2f,
+    0x8e, 0xcd, 0x9c, 0xac, 0xd4, 0x59, 0xa1, 0xd1, 0x0e, 0x6c, 0xe1, 0xe2, 0x2b, 0xe6, 0x49, 0x52,
+    0x1a, 0xa4, 0xe0, 0x15, 0xf3, 0x58, 0xef, 0x43, 0x76, 0x27, 0x28, 0x0d, 0x50, 0xf0, 0xa7, 0x85,
+    0xa4, 0xbb, 0x56, 0xaf, 0x46, 0x82, 0xd2, 0x00, 0xa5, 0x9e, 0x39, 0xd7, 0xb2, 0x7f, 0xf4, 0x24,
+    0xa5, 0x6f, 0xeb, 0x6b, 0x8a, 0xf0, 0xbf, 0x30, 0x23, 0xd9, 0xa5, 0x52, 0x4e, 0x0a, 0xfd, 0xe3,
+    0x20, 0x82, 0xaf, 0x59, 0xc6, 0x4c, 0x50, 0xea, 0xa0, 0xd0, 0x2b, 0xbb, 0x18, 0xa7, 0x27, 0x19,
+    0x5e, 0xcf, 0x0a, 0x4c, 0xf0, 0x02, 0xe8, 0x14, 0xb6, 0xe4, 0x1d, 0xf0, 0x5d, 0x0d, 0x4c, 0x0b,
+    0xed, 0x5d, 0x0d, 0x13, 0x7e, 0x7d, 0xad, 0xc4, 0x74, 0x42, 0xa6, 0xf0, 0x11, 0x50, 0xb2, 0xd2,
+    0x3c, 0x92, 0xd2, 0x71, 0x4a, 0xa8, 0x88, 0x82, 0x4b, 0xb9, 0x28, 0x73, 0xdc, 0x93, 0xd2, 0x71,
+    0x4a, 0x68, 0x00, 0x8b, 0x2d, 0x9c, 0x50, 0x35, 0xe6, 0x4e, 0x4c, 0x27, 0x30, 0xa1, 0xdf, 0x6d,
+    0xe0, 0xb9, 0x50, 0xaa, 0x3d, 0x13, 0xd3, 0x09, 0x4c, 0xe2, 0x67, 0xc4, 0x9e, 0x90, 0xfb, 0x94,
+    0x98, 0x4e, 0x60, 0x52, 0x5c, 0x28, 0x76, 0x7a, 0x11, 0x1d, 0xac, 0xc9, 0xe9, 0x38, 0x27, 0x64,
+    0x7a, 0xc7, 0xef, 0x5d, 0xa0, 0x16, 0x29, 0xe7, 0x74, 0x4e, 0x28, 0x6c, 0xa4, 0xc6, 0x09, 0x7b,
+    0x57, 0xfe, 0x48, 0x67, 0xa0, 0x42, 0x19, 0x1f, 0x66, 0xe5, 0xa8, 0xeb, 0xf4, 0xd1, 0xf2, 0x1e,
+    0xac, 0xd0, 0xb6, 0xa6, 0x99, 0xb9, 0x15, 0xca, 0x51, 0x6a, 0x6e, 0xa5, 0xd8, 0xb3, 0x04, 0xf1,
+    0xff, 0xd8, 0x39, 0x0e, 0x5f, 0x72, 0x0e, 0x7f, 0x8b, 0x43, 0xa3, 0x58, 0x9b, 0x4f, 0x41, 0x13,
+    0xca, 0xce, 0xa9, 0x3b, 0x30, 0x24, 0xed, 0x36, 0x3d, 0x27, 0x53, 0x9c, 0xf2, 0x73, 0xf4, 0x3b,
+    0x4f, 0x14, 0x28, 0x95, 0x09, 0x3a, 0xe2, 0x6b, 0x96, 0x9f, 0x53, 0x7f, 0x33, 0x10, 0x4a, 0x65,
+    0x8a, 0x8e, 0x6f, 0x83, 0x8c, 0x94, 0x7c, 0xf6, 0x40, 0x06, 0x4d, 0xef, 0x8f, 0xa6, 0x23, 0xa1,
+    0xca, 0xd2, 0x11, 0xca, 0x11, 0x78, 0xd0, 0x05, 0x13, 0x75, 0x74, 0x07, 0x2e, 0x51, 0xc7, 0x31,
+    0x3d, 0x57, 0xdc, 0xc4, 0xae, 0x15, 0x5b, 0xf9, 0xa8, 0x7a, 0xb8, 0x3a, 0xd2, 0x6f, 0x9a, 0xaa,
+    0x43, 0x44, 0xf5, 0x6b, 0xea, 0x01, 0x0d, 0xe5, 0x46, 0x4c, 0xd6, 0xcd, 0xeb, 0x3e, 0xb2, 0x4e,
+    0xaf, 0x81, 0x42, 0xad, 0x4c, 0xd7, 0x51, 0x7e, 0x3e, 0xb2, 0x1e, 0xb6, 0x0e, 0xbf, 0x41, 0x92,
+    0x81, 0x19, 0xa2, 0x74, 0x7d, 0x74, 0xfd, 0xf5, 0x75, 0xb4, 0x04, 0xd3, 0x75, 0xc2, 0xa5, 0xeb,
+    0xc7, 0xd7, 0x43, 0xd8, 0x11, 0x5c, 0xc7, 0x7c, 0x1d, 0x0d, 0x91, 0x3e, 0xba, 0x1e, 0xbe, 0x8e,
+    0x44, 0xb2, 0xf3, 0x5f, 0xf4, 0x97, 0xf9, 0xd1, 0xf5, 0xf0, 0x75, 0xab, 0x1a, 0x6c, 0xc2, 0x8e,
+    0x62, 0xfd, 0xd1, 0xf5, 0xf0, 0x75, 0x82, 0xf7, 0x0e, 0x13, 0xf6, 0xe5, 0xdc, 0x73, 0x39, 0x80,
+    0x3d, 0xed, 0x13, 0xdb, 0xf2, 0x92, 0x9b, 0xef, 0x13, 0xe7, 0x05, 0x4e, 0x62, 0xc2, 0x3e, 0x5c,
+    0xb4, 0x72, 0x35, 0x9e, 0x36, 0x38, 0xa9, 0xf9, 0xba, 0xfa, 0xc3, 0x2a, 0x57, 0x03, 0x17, 0x32,
+    0x62, 0x9b, 0xb1, 0xdb, 0x73, 0xae, 0x97, 0xb2, 0x53, 0x38, 0x3b, 0x41, 0xe9, 0xd4, 0xa4, 0x1d,
+    0x3d, 0x75, 0x94, 0xb5, 0x13, 0xbf, 0xc0, 0xf0, 0x29, 0xf3, 0xf6, 0xa7, 0x47, 0x95, 0xb8, 0x53,
+    0x98, 0x3b, 0x7c, 0xdd, 0xfe, 0xbd, 0x26, 0xf0, 0xe5, 0xed, 0x14, 0xe2, 0x8e, 0xc3, 0xb2, 0x79,
+    0x3b, 0x6c, 0x98, 0xca, 0xdb, 0x29, 0xc4, 0x1d, 0xf7, 0x3b, 0xcc, 0xdb, 0xc9, 0xec, 0xb2, 0xc4,
+    0x9d, 0xc2, 0xdc, 0x2d, 0xae, 0xa7, 0xa9, 0x3b, 0x92, 0x7b, 0x95, 0xbb, 0x53, 0xc8, 0x3b, 0x6d,
+    0x2f, 0x7a, 0xd7, 0x1e, 0xb1, 0xa7, 0xf4, 0x9d, 0x5e, 0x7f, 0x47, 0x8d, 0x37, 0x7d, 0x87, 0x48,
+    0x70, 0xd9, 0x3b, 0x85, 0xbe, 0xc3, 0xbc, 0xd5, 0xec, 0xdd, 0xfa, 0x72, 0xd9, 0x3b, 0x85, 0xbe,
+    0x63, 0xbf, 0xc7, 0xec, 0xdd, 0x7a, 0xdc, 0xde, 0x9f, 0x17, 0x61, 0x30, 0xc3, 0x35, 0x75, 0x13,
+    0x78, 0x7c, 0x4b, 0x2f, 0x7f, 0xa7, 0x10, 0x78, 0x82, 0x78, 0x90, 0x19, 0x3c, 0x92, 0x0d, 0x79,
+    0x50, 0xcc, 0xc2, 0xe1, 0x61, 0xa3, 0x78, 0x67, 0x9a, 0x9a, 0xe2, 0x0d, 0x5d, 0x0e, 0x4f, 0x21,
+    0xf1, 0x90, 0xca, 0x61, 0x0e, 0x8f, 0xda, 0xa0, 0xe5, 0xf0, 0x14, 0x12, 0x0f, 0x87, 0x9f, 0xfa,
+    0xe4, 0x25, 0x2a, 0x53, 0x49, 0x3c, 0x85, 0xc5, 0xdb, 0x4f, 0x8a, 0x79, 0x3c, 0x74, 0x64, 0x94,
+    0xc6, 0x53, 0x78, 0xbc, 0xa1, 0xb6, 0xe8, 0xbc, 0xd6, 0xdc, 0x57, 0x99, 0x3c, 0x85, 0xca, 0x13,
+    0x24, 0x42, 0x1f, 0x97, 0x87, 0x4c, 0x94, 0xca, 0xd3, 0xeb, 0xf2, 0x28, 0x44, 0xa6, 0xf2, 0xd8,
+    0x04, 0x97, 0xca, 0x53, 0xb8, 0xbc, 0xf8, 0xeb, 0x0c, 0x51, 0x8c, 0x7e, 0x57, 0x2e, 0x4f, 0x21,
+    0xf3, 0x70, 0x79, 0x32, 0x97, 0x47, 0x4d, 0xdc, 0xf2, 0x79, 0x48, 0x07, 0x34, 0x7c, 0x88, 0x4d,
+    0xe6, 0x51, 0x59, 0x7a, 0xc9, 0x3c, 0x85, 0xcd, 0x23, 0x1d, 0xf1, 0x3e, 0xb0, 0xfa, 0x8f, 0xd7,
+    0x49, 0x21, 0x0b, 0x9b, 0x87, 0x35, 0x99, 0xcb, 0x43, 0x67, 0xa4, 0x5c, 0x9e, 0x42, 0xe6, 0xed,
+    0x1d, 0x6b, 0x2e, 0x6f, 0x6e, 0xa0, 0x25, 0xf3, 0x14, 0x36, 0x6f, 0x2f, 0x77, 0x93, 0xf9, 0xe1,
+    0xd9, 0x9d, 0xab, 0x01, 0x8c, 0xfc, 0x43, 0xf7, 0x78, 0x87, 0xcf, 0x07, 0x7e, 0xf0, 0x42, 0xdd,
+    0x3f, 0xf2, 0x4c, 0x65, 0x56, 0xd9, 0x3c, 0x85, 0xce, 0xa3, 0x73, 0x20, 0xe5, 0x7c, 0x30, 0x73,
+    0x4a, 0xe8, 0x29, 0x8c, 0x9e, 0x5d, 0xa9, 0x9f, 0xd1, 0x0c, 0x95, 0xd1, 0x53, 0x28, 0x3d, 0x8c,
+    0x9e, 0xd5, 0x67, 0x33, 0xb3, 0x84, 0x9e, 0xc2, 0xe8, 0x21, 0xf4, 0xb3, 0xfb, 0x70, 0x66, 0x8f,
+    0xcf, 0xe0, 0x21, 0x70, 0xa1, 0x82, 0x09, 0xc5, 0x78, 0xa6, 0x97, 0xd3, 0x53, 0x48, 0x3d, 0xa1,
+    0x6e, 0x2f, 0xf6, 0x09, 0x0d, 0x97, 0xd6, 0x53, 0x78, 0x3d, 0x2a, 0xc9, 0x8c, 0x11, 0x8d, 0x94,
+    0xd6, 0x53, 0x78, 0x3d, 0x1a, 0xb4, 0x8a, 0x0f, 0x69, 0xb4, 0xac, 0x9e, 0x42, 0xeb, 0x61, 0xf5,
+    0x67, 0xf9, 0x94, 0xa6, 0x97, 0xd5, 0x53, 0x68, 0xbd, 0x3d, 0xa6, 0xbb, 0xc6, 0x98, 0x66, 0x94,
+    0xd8, 0x53, 0x98, 0x3d, 0x76, 0x00, 0x16, 0x3e, 0xa9, 0x59, 0x65, 0xf6, 0x14, 0x6a, 0x4f, 0xc7,
+    0x35, 0xe8, 0x99, 0xd5, 0x9c, 0x92, 0x7b, 0x0a, 0xbb, 0x47, 0xbf, 0x99, 0xe4, 0xc3, 0x1a, 0x2a,
+    0xb7, 0xa7, 0x90, 0x7b, 0xb8, 0xbd, 0x0c, 0x1f, 0xd6, 0xcc, 0x72, 0x7b, 0x0a, 0xb9, 0xb7, 0x87,
+    0xe2, 0x9a, 0x31, 0xad, 0xd9, 0xf4, 0x99, 0xd6, 0x04, 0x33, 0xa4, 0xd4, 0x16, 0x1f, 0xd7, 0x9c,
+    0x12, 0x7c, 0x0a, 0xc3, 0x27, 0x94, 0x12, 0xdd, 0x31, 0xb0, 0xe1, 0x72, 0x7c, 0x7a, 0x25, 0x1f,
+    0x3a, 0xa6, 0x3e, 0xb1, 0x91, 0x52, 0x7c, 0x0a, 0xc7, 0x87, 0xe2, 0xf7, 0xe3, 0x13, 0x9b, 0x5d,
+    0x8a, 0x4f, 0xe1, 0xf8, 0xf6, 0x08, 0xa2, 0x98, 0xd8, 0xf4, 0x72, 0x7c, 0x0a, 0xc9, 0x7f, 0xde,
+    0x7c, 0xec, 0x23, 0x9b, 0x51, 0x92, 0x4f, 0x61, 0xf9, 0x38, 0xfe, 0xd3, 0xb0, 0x6c, 0x68, 0xb3,
+    0x4a, 0xf3, 0xe9, 0xf5, 0x7c, 0xdc, 0xf1, 0x33, 0xb4, 0xd1, 0x72, 0x7c, 0x0a, 0xc9, 0x47, 0xfd,
+    0x5b, 0xcb, 0xa7, 0x36, 0x54, 0x8e, 0x4f, 0x21, 0xf9, 0xdb, 0x87, 0x35, 0xcf, 0xd4, 0x66, 0x96,
+    0xe4, 0xd3, 0x6b, 0xf9, 0x36, 0x9c, 0x52, 0x1f, 0xdb, 0xac, 0xf3, 0x99, 0x6f, 0x05, 0x30, 0x5c,
+    0x71, 0xef, 0x3e, 0xb7, 0x39, 0xe5, 0xf9, 0x14, 0xa2, 0x4f, 0x88, 0x6c, 0x6b, 0xdb, 0xd7, 0x7b,
+    0x48, 0xae, 0x3a, 0x2f, 0x33, 0x39, 0xf6, 0xd1, 0x8d, 0x94, 0xe7, 0x53, 0x88, 0xbe, 0x89, 0xeb,
+    0x8c, 0xd1, 0xcd, 0x2e, 0xd1, 0xa7, 0x30, 0x7d, 0xb3, 0x74, 0xf1, 0xd1, 0x4d, 0x2f, 0xcf, 0xa7,
+    0x10, 0xfd, 0xe7, 0x51, 0xb2, 0x7c, 0x76, 0x33, 0xca, 0xf4, 0x29, 0x54, 0x1f, 0xd0, 0xd1, 0x6f,
+    0x63, 0x7a, 0x23, 0x25, 0xfb, 0x14, 0xb6, 0x8f, 0x8e, 0x71, 0x7c, 0x7a, 0xa3, 0x25, 0xfb, 0x14,
+    0xb6, 0x3f, 0xfd, 0x85, 0xfd, 0x8c, 0x6f, 0xa8, 0x6c, 0x9f, 0x42, 0xf7, 0xa1, 0xa0, 0x9d, 0x7c,
+    0x7c, 0x33, 0x4b, 0xf6, 0xe9, 0xb5, 0x7d, 0x9b, 0xa0, 0x0c, 0x9f, 0xdf, 0xac, 0xfd, 0x99, 0x08,
+    0x06, 0x30, 0x1b, 0x18, 0xcd, 0x18, 0xe1, 0x9c, 0x32, 0x7e, 0x0a, 0xe5, 0x27, 0x9b, 0x8f, 0x89,
+    0x0f, 0x71, 0xb8, 0xa4, 0x9f, 0xc2, 0xfa, 0x6d, 0x18, 0xb8, 0x63, 0x8a, 0x33, 0xcb, 0xfa, 0x29,
+    0xb4, 0x1f, 0x3e, 0x25, 0xea, 0x53, 0x9c, 0x5d, 0xd2, 0x4f, 0x61, 0xfd, 0x66, 0x91, 0x76, 0xc5,
+    0x36, 0xc6, 0xe9, 0xe5, 0xfd, 0x14, 0xe2, 0xff, 0xd8, 0x73, 0x8f, 0x39, 0xce, 0x28, 0xf5, 0xa7,
+    0x70, 0x7f, 0xdc, 0x39, 0x0a, 0xa4, 0x4f, 0x72, 0xa4, 0xdc, 0x9f, 0x5e, 0xf9, 0xf7, 0xa7, 0xd1,
+    0x33, 0xca, 0xd1, 0x92, 0x7f, 0x0a, 0xfb, 0x87, 0x1f, 0xd0, 0xf4, 0x51, 0x0e, 0x95, 0xfb, 0x53,
+    0xc8, 0x3f, 0xb4, 0x88, 0x97, 0x8f, 0x72, 0x46, 0xb9, 0x3f, 0x85, 0xfc, 0x9b, 0x08, 0x8e, 0x1d,
+    0xb3, 0x9c, 0x25, 0x9f, 0x49, 0x6a, 0x40, 0xb3, 0xc9, 0x86, 0xfa, 0x34, 0xe7, 0xa4, 0xff, 0xff,
+    0x0f, 0x76, 0x30, 0xc2, 0xa0
+};
+
+static const struct {
+    const char *name;
+    const uint8_t *data;
+    size_t length;
+    int lines;
+} vectors[] = {
+    { "stored", stored_z, sizeof(stored_z), 8 },
+    { "fixed", fixed_z, sizeof(fixed_z), 40 },
+    { "dynamic", dynamic_z, sizeof(dynamic_z), 200 }
+};
+
+static uint8_t out[MAX_TEXT + RANDOM_SIZE];
+static size_t out_len;
+
+static bool on_write (void *ctx, const uint8_t *data, size_t length)
+{
+    if(out_len + length > sizeof(out))
+        return false;
+
+    memcpy(out + out_len, data, length);
+    out_len += length;
+
+    return true;
+}
+
+static size_t gcode (char *text, int lines)
+{
+    int i;
+    size_t len = 0;
+
+    for(i = 0; i < lines; i++)
+        len += sprintf(text + len, "N%u G1 X%u.%03u Y%u.%03u F1500\n", i, (i * 37) % 200, (i * 113) % 1000, (i * 59) % 150, (i * 271) % 1000);
+
+    return len;
+}
+
+// Inflates the stream in chunks of 1 to max_chunk bytes, returns the final status.
+static zstream_status_t inflate_stream (const uint8_t *data, size_t length, size_t max_chunk)
+{
+    size_t pos = 0, chunk;
+    zstream_status_t status = ZStream_OK;
+    zs_inflate_t *z = zs_inflate_create(on_write, NULL);
+
+    out_len = 0;
+
+    if(z == NULL)
+        return ZStream_MemError;
+
+    while(pos < length && status == ZStream_OK) {
+        chunk = 1 + rand() % max_chunk;
+        if(chunk > length - pos)
+            chunk = length - pos;
+        status = zs_inflate(z, data + pos, chunk);
+        pos += chunk;
+    }
+
+    if(status == ZStream_OK)
+        status = zs_inflate(z, NULL, 0);
+
+    zs_inflate_free(z);
+
+    return status;
+}
+
+static int check_vectors (void)
+{
+    int i;
+    size_t chunk, len;
+    uint8_t *copy;
+    zstream_status_t status;
+    static char text[MAX_TEXT];
+
+    for(i = 0; i < (int)(sizeof(vectors) / sizeof(vectors[0])); i++) {
+
+        len = gcode(text, vectors[i].lines);
+
+        for(chunk = 1; chunk <= 1024; chunk *= 4) {
+            if((status = inflate_stream(vectors[i].data, vectors[i].length, chunk)) != ZStream_StreamEnd || out_len != len || memcmp(out, text, len)) {
+                printf("%s: status %d, %zu bytes vs %zu expected\n", vectors[i].name, status, out_len, len);
+                return 1;
+            }
+        }
+
+        // Truncated streams must not complete, the checksum alone missing included.
+        if((status = inflate_stream(vectors[i].data, vectors[i].length - 4, 64)) != ZStream_OK ||
+            (status = inflate_stream(vectors[i].data, vectors[i].length / 2, 64)) != ZStream_OK) {
+            printf("%s truncated: status %d\n", vectors[i].name, status);
+            return 1;
+        }
+
+        copy = malloc(vectors[i].length);
+        memcpy(copy, vectors[i].data, vectors[i].length);
+
+        // Bad Adler-32 checksum.
+        copy[vectors[i].length - 1] ^= 0x01;
+        if((status = inflate_stream(copy, vectors[i].length, 64)) != ZStream_DataError) {
+            printf("%s bad checksum: status %d\n", vectors[i].name, status);
+            return 1;
+        }
+
+        // Reserved block type 3.
+        copy[vectors[i].length - 1] ^= 0x01;
+        copy[2] |= 0x06;
+        if((status = inflate_stream(copy, vectors[i].length, 64)) != ZStream_DataError) {
+            printf("%s bad block type: status %d\n", vectors[i].name, status);
+            return 1;
+        }
+
+        free(copy);
+
+        printf("%s: ok\n", vectors[i].name);
+    }
+
+    return 0;
+}
+
+// Deflates the data with small input and output steps and inflates the result.
+static bool round_trip (const uint8_t *data, size_t length)
+{
+    bool ok;
+    size_t pos = 0, chunk, in_len, zlen = 0, zsize = length + length / 8 + 64;
+    uint8_t *zdata = malloc(zsize);
+    zs_deflate_t *z = zs_deflate_create();
+
+    if(z == NULL || zdata == NULL)
+        return false;
+
+    do {
+        chunk = 1 + rand() % 1500;
+        in_len = length - pos < chunk ? length - pos : chunk;
+        chunk = 1 + rand() % 600;
+        if(chunk > zsize - zlen)
+            chunk = zsize - zlen;
+        zlen += zs_deflate(z, data + pos, &in_len, zdata + zlen, chunk, pos + in_len == length);
+        pos += in_len;
+    } while(!zs_deflate_done(z) && zlen < zsize);
+
+    ok = zs_deflate_done(z) && inflate_stream(zdata, zlen, 1500) == ZStream_StreamEnd && out_len == length && !memcmp(out, data, length);
+
+    printf("round trip %zu -> %zu bytes: %s\n", length, zlen, ok ? "ok" : "failed");
+
+    zs_deflate_free(z);
+    free(zdata);
+
+    return ok;
+}
+
+static int check_round_trip (void)
+{
+    size_t k, len;
+    static uint8_t data[RANDOM_SIZE];
+
+    len = gcode((char *)data, 400);
+    if(!round_trip(data, len) || !round_trip(data, 0))
+        return 1;
+
+    for(k = 0; k < RANDOM_SIZE; k++)
+        data[k] = (uint8_t)rand();
+
+    return round_trip(data, RANDOM_SIZE) ? 0 : 1;
+}
+
+int main (void)
+{
+    srand(1);
+
+    return check_vectors() || check_round_trip();
+}
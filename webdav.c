@@ -45,6 +45,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #if WEBDAV_ENABLE && HTTP_ENABLE
 
 #include <stdio.h>
+#include <ctype.h>
+#include <stddef.h>
 
 #ifdef ARDUINO
 #include "../grbl/hal.h"
@@ -59,6 +61,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "urlencode.h"
 #include "urldecode.h"
 #include "fs_ram.h"
+#include "writebehind.h"
+#include "sha1.h"
+
+#include "lwip/timeouts.h"
 
 typedef enum {
     Resource_NotExist = 0,
@@ -66,19 +72,213 @@ typedef enum {
     Resource_File
 } http_resource_t;
 
+#ifndef WEBDAV_MAX_DEPTH
+#define WEBDAV_MAX_DEPTH 8          // Max number of directory levels walked for Depth: infinity.
+#endif
+#ifndef WEBDAV_PATH_MAX
+#define WEBDAV_PATH_MAX 256
+#endif
+#ifndef WEBDAV_RESPONSE_MAX
+#define WEBDAV_RESPONSE_MAX 1024    // Max size of a single PROPFIND <D:response> element.
+#endif
+#ifndef WEBDAV_PROPFIND_MAX_ENTRIES
+#define WEBDAV_PROPFIND_MAX_ENTRIES 500 // Max number of resources reported by a single PROPFIND.
+#endif
+#ifndef WEBDAV_PROPFIND_UNKNOWN_MAX
+#define WEBDAV_PROPFIND_UNKNOWN_MAX 256 // Max size of the unknown property names reported as not found by a single PROPFIND.
+#endif
+#ifndef WEBDAV_UPLOAD_PART_EXT
+#define WEBDAV_UPLOAD_PART_EXT ".part"  // Suffix of the file holding the data of a resumable upload until complete.
+#endif
+#ifndef WEBDAV_UPLOAD_STATE_EXT
+#define WEBDAV_UPLOAD_STATE_EXT ".upl"  // Suffix of the sidecar file recording the progress of a resumable upload.
+#endif
+#ifndef WEBDAV_COPY_BLOCK_SIZE
+#define WEBDAV_COPY_BLOCK_SIZE 4096 // Size of VFS reads and writes for COPY and cross mount MOVE, should be a multiple of the sector size.
+#endif
+#ifndef WEBDAV_COPY_BLOCKS
+#define WEBDAV_COPY_BLOCKS 4        // Max number of blocks copied or directory entries processed per step.
+#endif
+#ifndef WEBDAV_COPY_INTERVAL
+#define WEBDAV_COPY_INTERVAL 1      // Delay between copy steps in milliseconds.
+#endif
+
+#define DAVProp_DisplayName         (1 << 0)
+#define DAVProp_CreationDate        (1 << 1)
+#define DAVProp_GetLastModified     (1 << 2)
+#define DAVProp_GetContentLength    (1 << 3)
+#define DAVProp_GetContentType      (1 << 4)
+#define DAVProp_ResourceType        (1 << 5)
+#define DAVProp_SupportedLock       (1 << 6)
+#define DAVProp_GetETag             (1 << 7)
+#define DAVProp_All                 0xFF
+
+// Property names, in DAVProp_ bit order.
+static const char *const dav_props[] = {
+    "displayname",
+    "creationdate",
+    "getlastmodified",
+    "getcontentlength",
+    "getcontenttype",
+    "resourcetype",
+    "supportedlock",
+    "getetag"
+};
+
+typedef enum {
+    PropFind_Header = 0,
+    PropFind_Resource,
+    PropFind_Walk,
+    PropFind_Footer,
+    PropFind_Done
+} propfind_state_t;
+
+// Streaming PROPFIND response state, the directory tree is walked one entry at a time
+// with an explicit stack of open directories.
+typedef struct {
+    propfind_state_t state;
+    int depth;
+    uint32_t props;                             // Requested properties, DAVProp_ bitmask.
+    uint32_t found;                             // Requested properties output for the current resource.
+    bool named;                                 // Properties requested by name, those not output are reported as not found.
+    bool names;                                 // Output property names only (propname).
+    bool exists;
+    bool overflow;
+    bool truncated;                             // Entry budget exhausted or max depth reached.
+    uint_fast16_t entries;                      // Number of resources reported.
+    size_t root_len;                            // Length of the requested path.
+    vfs_stat_t st;                              // Requested resource.
+    uint_fast8_t level;                         // Number of open directories.
+    vfs_dir_t *dir[WEBDAV_MAX_DEPTH];
+    size_t path_len[WEBDAV_MAX_DEPTH];          // Length of the path of each open directory.
+    char path[WEBDAV_PATH_MAX];
+    char unknown[WEBDAV_PROPFIND_UNKNOWN_MAX];  // Requested properties not known, as empty XML elements.
+    size_t out_len;
+    size_t out_pos;
+    char out[WEBDAV_RESPONSE_MAX];
+} propfind_t;
+
+// Server side COPY/MOVE state, the copy is performed in steps from a lwIP timeout and
+// the response is deferred until done. Collections are copied with an explicit stack of open source directories.
+typedef struct {
+    http_request_t *request;
+    bool move;                                  // Delete the source when done.
+    bool exists;                                // The destination was overwritten.
+    uint_fast8_t level;                         // Number of open directories.
+    vfs_file_t *src_file;                       // File being copied.
+    vfs_file_t *dst_file;
+    vfs_dir_t *dir[WEBDAV_MAX_DEPTH];
+    size_t src_len[WEBDAV_MAX_DEPTH];
+    size_t dst_len[WEBDAV_MAX_DEPTH];
+    char src[WEBDAV_PATH_MAX];
+    char dst[WEBDAV_PATH_MAX];
+    uint8_t buf[WEBDAV_COPY_BLOCK_SIZE];
+} dav_copy_t;
+
 typedef struct {
     u32_t content_len;
     int depth;
     char uri[100];
     http_resource_t type;
+    vfs_stat_t st;
     vfs_file_t *vfsh;
+    writebehind_t *wb;
+    bool resumable;                             // PUT with Content-Range, data is written to the partial file.
+    size_t offset;                              // Resumable PUT start offset,
+    size_t total;                               // and the total length of the upload.
+    size_t received;                            // Number of PUT body bytes written.
+    SHA1_CTX sha1;                              // PUT body digest.
+    char digest[HTTP_DIGEST_LEN];               // Expected PUT body digest, empty if none.
+    propfind_t *propfind;
+    dav_copy_t *copy;                           // COPY/MOVE in progress.
     char *rcvptr;
     char payload[];
 } webdav_data_t;
 
+static void propfind_free (propfind_t *pf)
+{
+    while(pf->level)
+        vfs_closedir(pf->dir[--pf->level]);
+
+    free(pf);
+}
+
+static char *upload_path (webdav_data_t *dav, char *path, const char *ext)
+{
+    return strcat(strcpy(path, dav->uri), ext);
+}
+
+// Records the length of the data committed to the partial file of a resumable upload.
+static bool upload_save (webdav_data_t *dav, size_t committed)
+{
+    bool ok;
+    char path[WEBDAV_PATH_MAX], buf[24];
+    vfs_file_t *file;
+
+    if((ok = (file = vfs_open(upload_path(dav, path, WEBDAV_UPLOAD_STATE_EXT), "w")) != NULL)) {
+        sprintf(buf, "%lu %lu\n", (unsigned long)committed, (unsigned long)dav->total);
+        ok = vfs_write(buf, 1, strlen(buf), file) == strlen(buf);
+        vfs_close(file);
+    }
+
+    return ok;
+}
+
+// Returns false if there is no upload in progress for the resource with the same total length.
+static bool upload_load (webdav_data_t *dav, size_t *committed)
+{
+    size_t len;
+    char path[WEBDAV_PATH_MAX], buf[24], *end;
+    vfs_file_t *file;
+
+    if((file = vfs_open(upload_path(dav, path, WEBDAV_UPLOAD_STATE_EXT), "r")) == NULL)
+        return false;
+
+    len = vfs_read(buf, 1, sizeof(buf) - 1, file);
+    vfs_close(file);
+    buf[len] = '\0';
+
+    *committed = strtoul(buf, &end, 10);
+
+    return end != buf && strtoul(end, NULL, 10) == dav->total;
+}
+
+// Adds the range of data committed to the response, 308 Resume Incomplete.
+static void upload_incomplete (http_request_t *request, size_t committed)
+{
+    char range[32];
+
+    if(committed) {
+        sprintf(range, "bytes=0-%lu", (unsigned long)committed - 1);
+        http_set_response_header(request, "Range", range);
+    }
+
+    http_set_response_status(request, "308 Resume Incomplete");
+}
+
+static void dav_copy_step (void *arg);
+static void dav_copy_free (dav_copy_t *cp, bool ok);
+
 static void dav_request_completed (void *data)
 {
     webdav_data_t *dav = (webdav_data_t *)data;
+    bool ok = dav->wb == NULL || writebehind_close(dav->wb);
+
+    // The connection was lost during a resumable upload, record how far it got.
+    if(ok && dav->resumable && dav->vfsh) {
+        vfs_close(dav->vfsh);
+        dav->vfsh = NULL;
+        upload_save(dav, dav->offset + dav->received);
+    }
+
+    if(dav->propfind)
+        propfind_free(dav->propfind);
+
+    // The connection was lost during COPY or MOVE, the partially copied file is removed.
+    if(dav->copy) {
+        sys_untimeout(dav_copy_step, dav->copy);
+        dav_copy_free(dav->copy, false);
+    }
 
     if(dav->vfsh)
         vfs_close(dav->vfsh);
@@ -91,14 +291,10 @@ static err_t dav_receive_payload (http_request_t *request, struct pbuf *p)
     struct pbuf *q = p;
     webdav_data_t *dav = (webdav_data_t *)request->private_data;
 
-    if(dav) {
-        memcpy(dav->rcvptr, p->payload, p->len);
-        dav->rcvptr += p->len;
-        while((q = q->next)) {
-            memcpy(dav->rcvptr, p->payload, p->len);
-            dav->rcvptr += p->len;
-        }
-    }
+    if(dav) do {
+        memcpy(dav->rcvptr, q->payload, q->len);
+        dav->rcvptr += q->len;
+    } while((q = q->next));
 
     httpd_free_pbuf(request, p);
 
@@ -124,13 +320,18 @@ static err_t dav_init_request (http_request_t *request, http_method_t method, ch
         free(value);
     }
 
-    if((request->private_data = dav = malloc(sizeof(webdav_data_t) + (method == HTTP_Put ? 0 : content_len))) == NULL)
+    if((request->private_data = dav = malloc(sizeof(webdav_data_t) + (method == HTTP_Put ? 0 : content_len + 1))) == NULL)
         return ERR_MEM;
 
     dav->depth = -1;
     dav->content_len = content_len;
     dav->type = Resource_NotExist;
     dav->vfsh = NULL;
+    dav->wb = NULL;
+    dav->resumable = false;
+    dav->total = dav->received = 0;
+    dav->propfind = NULL;
+    dav->copy = NULL;
     dav->rcvptr = dav->payload;
     strcpy(dav->uri, uri);
 
@@ -140,10 +341,8 @@ static err_t dav_init_request (http_request_t *request, http_method_t method, ch
 
     *uri = '\0';
 
-    vfs_stat_t st;
-
-    if (vfs_stat(vfs_fixpath(dav->uri), &st) == 0)
-        dav->type = st.st_mode.directory ? Resource_Directory : Resource_File;
+    if (vfs_stat(vfs_fixpath(dav->uri), &dav->st) == 0)
+        dav->type = dav->st.st_mode.directory ? Resource_Directory : Resource_File;
 
     request->on_request_completed = dav_request_completed;
 
@@ -157,186 +356,496 @@ static err_t dav_init_request (http_request_t *request, http_method_t method, ch
     return ERR_OK;
 }
 
-static void propfind_add_properties (char *fname, u32_t size, struct tm *created, struct tm *modified, bool is_dir, vfs_file_t *file)
+// Evaluates the If-Match, If-None-Match and If-Unmodified-Since headers against the requested resource,
+// sets the response status to 412 and returns false if the request is not to be performed.
+static bool dav_preconditions (http_request_t *request)
 {
-    char buffer[LWIP_HTTPD_MAX_REQUEST_URI_LEN + 1];
+    webdav_data_t *dav = (webdav_data_t *)request->private_data;
 
-    if(strlen(fname) > 1 && strrchr(fname, '/'))
-        fname = strrchr(fname, '/') + 1;
+    if(http_check_preconditions(request, dav->type == Resource_NotExist ? NULL : &dav->st) == 0)
+        return true;
 
-    urlencode(fname, buffer, sizeof(buffer) - 1);
+    http_set_response_status(request, "412 Precondition Failed");
 
-    vfs_puts("<D:response><D:href>", file);
-    vfs_puts(buffer, file);
-    vfs_puts("</D:href><D:propstat>", file);
+    return false;
+}
 
-    vfs_puts("<D:status>HTTP/1.1 200 OK</D:status><D:prop>", file);
+static void pf_puts (propfind_t *pf, const char *s)
+{
+    size_t len = strlen(s);
 
-    vfs_puts("<D:displayname>", file);
-    vfs_puts(strcmp(fname, "/") ? fname : "root", file);
-    vfs_puts("</D:displayname>", file);
+    if(pf->out_len + len < sizeof(pf->out)) {
+        memcpy(pf->out + pf->out_len, s, len);
+        pf->out_len += len;
+    } else
+        pf->overflow = true;
+}
 
-    vfs_puts("<D:creationdate>", file);
-    vfs_puts(strtointernetdt(created), file);
-    vfs_puts("</D:creationdate>", file);
+// Outputs a string with the XML special characters escaped.
+static void pf_puts_xml (propfind_t *pf, const char *s)
+{
+    char c[2] = {0};
 
-    vfs_puts("<D:getlastmodified>", file);
-    vfs_puts(strtointernetdt(modified), file);
-    vfs_puts("</D:getlastmodified>", file);
+    while(*s) switch((c[0] = *s++)) {
+        case '&':
+            pf_puts(pf, "&amp;");
+            break;
+        case '<':
+            pf_puts(pf, "&lt;");
+            break;
+        case '>':
+            pf_puts(pf, "&gt;");
+            break;
+        default:
+            pf_puts(pf, c);
+            break;
+    }
+}
 
-    if (!is_dir) {
-        vfs_puts("<D:getcontentlength>", file);
-        vfs_puts(uitoa(size), file);
-        vfs_puts("</D:getcontentlength><D:getcontenttype>text/plain</D:getcontenttype><D:resourcetype/>", file);
-    } else
-        vfs_puts("<D:resourcetype><D:collection/></D:resourcetype>", file);
+// Outputs a path URL encoded, path separators are kept.
+static void pf_puts_href (propfind_t *pf, const char *path)
+{
+    static const char hex[] = "0123456789ABCDEF";
 
-#if WEBDAV_ENABLE_LOCK
+    char c[4] = {0};
+
+    while((c[0] = *path++)) {
+        if(isalnum((unsigned char)c[0]) || strchr("/-._~", c[0]))
+            c[1] = '\0';
+        else {
+            c[1] = hex[(uint8_t)c[0] >> 4];
+            c[2] = hex[c[0] & 0x0F];
+            c[0] = '%';
+        }
+        pf_puts(pf, c);
+    }
+}
 
-    vfs_puts("<D:supportedlock>");
+// Outputs the start tag of a property if requested, returns true if the value is to be output.
+// The propstat element for the found properties is started with the first one.
+static bool pf_prop_start (propfind_t *pf, uint32_t prop, const char *name)
+{
+    if(!(pf->props & prop))
+        return false;
 
-    vfs_puts("<D:lockentry>");
-    vfs_puts("<D:lockscope>");
-    vfs_puts("<D:exclusive/>");
-    vfs_puts("</D:lockscope>");
-    vfs_puts("<D:locktype>");
-    vfs_puts("<D:write/>");
-    vfs_puts("</D:locktype>");
-    vfs_puts("</D:lockentry>");
+    if(!pf->found)
+        pf_puts(pf, "<D:propstat><D:prop>");
 
-    vfs_puts("</D:supportedlock>");
+    pf->found |= prop;
 
-#endif
+    pf_puts(pf, "<D:");
+    pf_puts(pf, name);
+    pf_puts(pf, pf->names ? "/>" : ">");
 
-    vfs_puts("</D:prop></D:propstat></D:response>", file);
+    return !pf->names;
 }
 
-static void propfind_scan (char *uri, int depth, vfs_file_t *file)
+static void pf_prop_end (propfind_t *pf, const char *name)
 {
-    char path[50];
-    bool has_subdirs = false;
+    pf_puts(pf, "</D:");
+    pf_puts(pf, name);
+    pf_puts(pf, ">");
+}
 
-    vfs_stat_t st;
-    vfs_dir_t *vfs_dir;
-    vfs_dirent_t *dir_ent;
-    struct tm *c_time, *m_time;
-    time_t current_time = (time_t)-1;
+static void propfind_add_properties (propfind_t *pf, const char *path, vfs_stat_t *st)
+{
+    char buf[32];
+    const char *name = strrchr(path, '/');
+#ifdef ESP_PLATFORM
+    time_t mtime = st->st_mtim;
+#else
+    time_t mtime = st->st_mtime;
+#endif
+
+    if(mtime == 0 && st->st_mode.directory) {
+        mtime = (time_t)-1;
 #ifndef __IMXRT1062__
-    time(&current_time);
+        time(&mtime);
 #endif
-    c_time = gmtime(&current_time);
+    }
 
-    if((vfs_dir = vfs_opendir(uri))) {
+    name = name && name[1] ? name + 1 : "root";
 
-        while((dir_ent = vfs_readdir(vfs_dir))) {
+    uint_fast8_t i;
+    uint32_t missing;
 
-            strcpy(path, uri);
-            if(strlen(uri) > 1 && uri[strlen(uri) - 1] != '/')
-                strcat(path, "/");
-            strcat(path, dir_ent->name);
+    pf->overflow = false;
+    pf->found = 0;
 
-            vfs_stat(path, &st);
+    pf_puts(pf, "<D:response><D:href>");
+    pf_puts_href(pf, path);
+    if(st->st_mode.directory && strcmp(path, "/"))
+        pf_puts(pf, "/");
+    pf_puts(pf, "</D:href>");
 
-            has_subdirs |= st.st_mode.directory;
+    if(pf_prop_start(pf, DAVProp_DisplayName, "displayname")) {
+        pf_puts_xml(pf, name);
+        pf_prop_end(pf, "displayname");
+    }
 
-            if(!st.st_mode.directory) {
-#ifdef ESP_PLATFORM
-                m_time = gmtime(&st.st_mtim);
-#else
-                m_time = gmtime(&st.st_mtime);
+    if(pf_prop_start(pf, DAVProp_CreationDate, "creationdate")) {
+        struct tm *tm = gmtime(&mtime);
+        sprintf(buf, "%04d-%02d-%02dT%02d:%02d:%02dZ", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+        pf_puts(pf, buf);
+        pf_prop_end(pf, "creationdate");
+    }
+
+    if(pf_prop_start(pf, DAVProp_GetLastModified, "getlastmodified")) {
+        pf_puts(pf, strtointernetdt(gmtime(&mtime)));
+        pf_prop_end(pf, "getlastmodified");
+    }
+
+    if(!st->st_mode.directory) {
+
+        if(pf_prop_start(pf, DAVProp_GetContentLength, "getcontentlength")) {
+            pf_puts(pf, uitoa(st->st_size));
+            pf_prop_end(pf, "getcontentlength");
+        }
+
+        if(pf_prop_start(pf, DAVProp_GetContentType, "getcontenttype")) {
+            pf_puts(pf, "text/plain");
+            pf_prop_end(pf, "getcontenttype");
+        }
+
+        if((pf->names || http_get_etag(st, buf)) && pf_prop_start(pf, DAVProp_GetETag, "getetag")) {
+            pf_puts_xml(pf, buf);
+            pf_prop_end(pf, "getetag");
+        }
+    }
+
+    if(pf_prop_start(pf, DAVProp_ResourceType, "resourcetype")) {
+        if(st->st_mode.directory)
+            pf_puts(pf, "<D:collection/>");
+        pf_prop_end(pf, "resourcetype");
+    }
+
+#if WEBDAV_ENABLE_LOCK
+    if(pf_prop_start(pf, DAVProp_SupportedLock, "supportedlock")) {
+        pf_puts(pf, "<D:lockentry><D:lockscope><D:exclusive/></D:lockscope><D:locktype><D:write/></D:locktype></D:lockentry>");
+        pf_prop_end(pf, "supportedlock");
+    }
 #endif
-                propfind_add_properties(path, st.st_size, c_time, m_time, st.st_mode.directory, file);
+
+    missing = pf->named ? pf->props & ~pf->found : 0;
+
+    if(pf->found || !(missing || *pf->unknown))
+        pf_puts(pf, pf->found ? "</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat>"
+                              : "<D:propstat><D:prop/><D:status>HTTP/1.1 200 OK</D:status></D:propstat>");
+
+    // Requested properties that are unknown or do not apply to the resource, RFC 4918 9.1.
+    if(missing || *pf->unknown) {
+        pf_puts(pf, "<D:propstat><D:prop>");
+        for(i = 0; i < sizeof(dav_props) / sizeof(dav_props[0]); i++) {
+            if(missing & (1 << i)) {
+                pf_puts(pf, "<D:");
+                pf_puts(pf, dav_props[i]);
+                pf_puts(pf, "/>");
             }
         }
+        pf_puts(pf, pf->unknown);
+        pf_puts(pf, "</D:prop><D:status>HTTP/1.1 404 Not Found</D:status></D:propstat>");
+    }
+
+    pf_puts(pf, "</D:response>");
+
+    // Drop the entry if it does not fit in the buffer.
+    if(pf->overflow)
+        pf->out_len = 0;
+}
+
+static bool propfind_push (propfind_t *pf)
+{
+    vfs_dir_t *dir;
+
+    if(pf->level == WEBDAV_MAX_DEPTH) {
+        pf->truncated = true;
+        return false;
+    }
 
-        vfs_closedir(vfs_dir);
+    if((dir = vfs_opendir(pf->path)) == NULL)
+        return false;
+
+    pf->dir[pf->level] = dir;
+    pf->path_len[pf->level++] = strlen(pf->path);
+
+    return true;
+}
+
+// Outputs the next entry of the innermost open directory and descends into it if a directory
+// and within the requested depth, closes the directory when there are no more entries.
+static void propfind_walk (propfind_t *pf)
+{
+    vfs_stat_t st;
+    vfs_dirent_t *dirent;
+    size_t len = pf->path_len[pf->level - 1];
+
+    pf->path[len] = '\0';
+
+    if((dirent = vfs_readdir(pf->dir[pf->level - 1])) == NULL) {
+        vfs_closedir(pf->dir[--pf->level]);
+        return;
     }
 
-    if(has_subdirs && (vfs_dir = vfs_opendir(uri))) {
+    if(len + strlen(dirent->name) + 2 > sizeof(pf->path))
+        return;
 
-        while((dir_ent = vfs_readdir(vfs_dir))) {
+    if(pf->entries == WEBDAV_PROPFIND_MAX_ENTRIES) {
+        pf->truncated = true;
+        while(pf->level)
+            vfs_closedir(pf->dir[--pf->level]);
+        return;
+    }
 
-            strcpy(path, uri);
-            if(strlen(uri) > 1 && uri[strlen(uri) - 1] != '/')
-                strcat(path, "/");
-            strcat(path, dir_ent->name);
+    pf->entries++;
 
-            vfs_stat(path, &st);
+    if(len > 1)
+        pf->path[len++] = '/';
+    strcpy(pf->path + len, dirent->name);
 
-            if(st.st_mode.directory) {
+    // The directory entry has the size and mode, stat only when the timestamp is needed.
+    if(pf->names || !(pf->props & (DAVProp_CreationDate|DAVProp_GetLastModified|DAVProp_GetETag)) || vfs_stat(pf->path, &st) != 0) {
+        memset(&st, 0, sizeof(vfs_stat_t));
+        st.st_size = dirent->size;
+        st.st_mode = dirent->st_mode;
+    }
 
-                propfind_add_properties(path, st.st_size, c_time, c_time, st.st_mode.directory, file);
+    propfind_add_properties(pf, pf->path, &st);
 
-                if(depth != 0)
-                    propfind_scan(path, depth - 1, file);
+    if(st.st_mode.directory && (pf->depth < 0 || pf->level < pf->depth))
+        propfind_push(pf);
+}
+
+// Renders the next part of the response into the output buffer, returns false when done.
+static bool propfind_next (propfind_t *pf)
+{
+    switch(pf->state) {
+
+        case PropFind_Header:
+            pf_puts(pf, "<?xml version=\"1.0\" encoding=\"utf-8\"?><D:multistatus xmlns:D=\"DAV:\">");
+            pf->state = PropFind_Resource;
+            break;
+
+        case PropFind_Resource:
+            if(pf->exists) {
+                pf->entries++;
+                propfind_add_properties(pf, pf->path, &pf->st);
+                pf->state = pf->st.st_mode.directory && pf->depth != 0 && propfind_push(pf) ? PropFind_Walk : PropFind_Footer;
+            } else {
+                pf_puts(pf, "<D:response><D:href>");
+                pf_puts_href(pf, pf->path);
+                pf_puts(pf, "</D:href><D:propstat><D:status>HTTP/1.1 404 Not found</D:status></D:propstat></D:response>");
+                pf->state = PropFind_Footer;
             }
+            break;
+
+        case PropFind_Walk:
+            if(pf->level)
+                propfind_walk(pf);
+            else
+                pf->state = PropFind_Footer;
+            break;
+
+        case PropFind_Footer:
+            if(pf->truncated) {
+                // RFC 4918, 16: the listing was limited by the server.
+                pf->path[pf->root_len] = '\0';
+                pf_puts(pf, "<D:response><D:href>");
+                pf_puts_href(pf, pf->path);
+                pf_puts(pf, "</D:href><D:status>HTTP/1.1 507 Insufficient Storage</D:status><D:error><D:number-of-matches-within-limits/></D:error></D:response>");
+            }
+            pf_puts(pf, "</D:multistatus>");
+            pf->state = PropFind_Done;
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Response generator, called by the HTTP daemon as the send buffer drains.
+static int propfind_generate (http_request_t *request, char *buf, size_t size)
+{
+    size_t len = 0, count;
+    propfind_t *pf = ((webdav_data_t *)request->private_data)->propfind;
+
+    while(len < size) {
+
+        if(pf->out_pos == pf->out_len) {
+            pf->out_pos = pf->out_len = 0;
+            if(!propfind_next(pf))
+                break;
         }
 
-        vfs_closedir(vfs_dir);
+        if((count = pf->out_len - pf->out_pos) > size - len)
+            count = size - len;
+
+        memcpy(buf + len, pf->out + pf->out_pos, count);
+        pf->out_pos += count;
+        len += count;
     }
+
+    return (int)len;
 }
 
-static void propfind_receive_finished (http_request_t *request, char *response_uri, u16_t response_uri_len)
+// Returns a pointer past the name of the next XML start or end tag, NULL if none.
+// name is set to the local name (without namespace prefix).
+static const char *xml_next_tag (const char *s, const char **name, size_t *len, bool *end)
 {
-    vfs_stat_t st;
-    webdav_data_t *dav = (webdav_data_t *)request->private_data;
+    const char *n;
 
-    vfs_fixpath(dav->uri);
+    while((s = strchr(s, '<'))) {
 
-    dav->vfsh = vfs_open("/ram/data.xml", "w");
+        if((*end = *++s == '/'))
+            s++;
 
-    http_set_response_status(request, "207 Multi-Status");
+        if(*s == '?' || *s == '!')
+            continue;
 
-    vfs_puts("<?xml version=\"1.0\" encoding=\"utf-8\"?>", dav->vfsh);
-    vfs_puts("<D:multistatus xmlns:D=\"DAV:\">", dav->vfsh);
+        for(n = s; *s && !strchr(" \t\r\n/>", *s); s++) {
+            if(*s == ':')
+                n = s + 1;
+        }
 
-    if(vfs_stat(dav->uri, &st) == 0 || !strcmp(dav->uri, "/")) {
+        *name = n;
+        *len = s - n;
 
-        struct tm *c_time, *m_time;
-        time_t current_time = (time_t)-1;
-    #ifndef __IMXRT1062__
-        time(&current_time);
-    #endif
-        c_time = gmtime(&current_time);
+        return s;
+    }
 
-        if(!strcmp(dav->uri, "/")) {
-            m_time = c_time;
-            st.st_mode.directory = true;
-        } else {
-    #ifdef ESP_PLATFORM
-            m_time = gmtime(&st.st_mtim);
-    #else
-            m_time = gmtime(&st.st_mtime);
-    #endif
+    return NULL;
+}
+
+#define XML_IS(name, len, s) (len == sizeof(s) - 1 && !strncmp(name, s, len))
+
+// Returns the namespace bound to the prefix of a tag, NULL if none. The declaration is looked up anywhere in the body.
+static const char *xml_namespace (const char *body, const char *prefix, size_t prefix_len, size_t *len)
+{
+    const char *s = body, *uri;
+
+    while((s = strstr(s, "xmlns"))) {
+
+        s += 5;
+
+        if(prefix_len ? (*s == ':' && !strncmp(s + 1, prefix, prefix_len) && s[prefix_len + 1] == '=') : *s == '=') {
+            s += prefix_len ? prefix_len + 2 : 1;
+            if((*s == '"' || *s == '\'') && (uri = strchr(s + 1, *s))) {
+                *len = uri - s - 1;
+                return s + 1;
+            }
         }
+    }
 
-        if(st.st_mode.directory) {
+    return NULL;
+}
 
-            if(dav->depth == 0)
-                propfind_add_properties(dav->uri, 0, c_time, m_time, true, dav->vfsh);
+// Adds an unknown requested property to the list reported as not found, properties not fitting are dropped.
+static void propfind_add_unknown (propfind_t *pf, const char *body, const char *name, size_t len)
+{
+    const char *prefix = name, *ns;
+    size_t prefix_len = 0, ns_len = 0, used = strlen(pf->unknown);
 
-            if(dav->depth != 0)
-                propfind_scan(dav->uri, dav->depth - 1, dav->vfsh);
+    while(prefix > body && prefix[-1] != '<')
+        prefix--;
 
-        } else
-            propfind_add_properties(dav->uri, st.st_size, c_time, m_time, false, dav->vfsh);
+    if(prefix != name)
+        prefix_len = name - prefix - 1;
 
-    } else {
-        char uri[LWIP_HTTPD_MAX_REQUEST_URI_LEN + 1];
+    if((ns = xml_namespace(body, prefix, prefix_len, &ns_len)) == NULL)
+        ns = "";
 
-        http_set_response_status(request, "404 Not found");
-        urlencode(dav->uri, uri, LWIP_HTTPD_MAX_REQUEST_URI_LEN);
-        vfs_puts("<D:response><D:href>", dav->vfsh);
-        vfs_puts(uri, dav->vfsh);
-        vfs_puts("</D:href><D:propstat><D:status>HTTP/1.1 404 Not found</D:status></D:propstat></D:response>", dav->vfsh);
+    if(ns_len == 4 && !strncmp(ns, "DAV:", 4)) {
+        if(used + len + 6 <= sizeof(pf->unknown))
+            sprintf(pf->unknown + used, "<D:%.*s/>", (int)len, name);
+    } else if(used + len + ns_len + 19 <= sizeof(pf->unknown))
+        sprintf(pf->unknown + used, "<X:%.*s xmlns:X=\"%.*s\"/>", (int)len, name, (int)ns_len, ns);
+}
+
+// Parses the properties requested in a PROPFIND body, all if no body or allprop.
+// Only the elements directly below the first prop element are requested properties.
+static void propfind_parse (propfind_t *pf, const char *body)
+{
+    bool end, in_prop = false;
+    size_t len;
+    uint_fast8_t i, depth = 0;
+    const char *name, *s = body;
+
+    pf->props = 0;
+
+    while((s = xml_next_tag(s, &name, &len, &end))) {
+
+        if(!in_prop) {
+
+            if(XML_IS(name, len, "allprop"))
+                break;
+
+            if(XML_IS(name, len, "propname")) {
+                pf->names = true;
+                break;
+            }
+
+            if(XML_IS(name, len, "prop") && !end)
+                pf->named = in_prop = true;
+
+        } else if(end) {
+            if(depth == 0)
+                break; // End of prop
+            depth--;
+        } else {
+            if(depth == 0) {
+                for(i = 0; i < sizeof(dav_props) / sizeof(dav_props[0]); i++) {
+                    if(len == strlen(dav_props[i]) && !strncmp(name, dav_props[i], len))
+                        break;
+                }
+                if(i < sizeof(dav_props) / sizeof(dav_props[0]))
+                    pf->props |= 1 << i;
+                else
+                    propfind_add_unknown(pf, body, name, len);
+            }
+            // Property with a value, e.g. in a PROPPATCH body.
+            if((s = strchr(s, '>')) == NULL)
+                break;
+            if(s[-1] != '/')
+                depth++;
+        }
     }
 
-    vfs_puts("</D:multistatus>", dav->vfsh);
+    if(!pf->named)
+        pf->props = DAVProp_All;
+}
 
-    vfs_close(dav->vfsh);
-    dav->vfsh = NULL;
+static void propfind_receive_finished (http_request_t *request, char *response_uri, u16_t response_uri_len)
+{
+    propfind_t *pf;
+    webdav_data_t *dav = (webdav_data_t *)request->private_data;
+
+    vfs_fixpath(dav->uri);
 
-    strcpy(response_uri, "/ram/data.xml");
+    *response_uri = '\0';
+
+    if((pf = dav->propfind = malloc(sizeof(propfind_t))) == NULL) {
+        http_set_response_status(request, "500 Internal Server Error");
+        return;
+    }
+
+    memset(pf, 0, offsetof(propfind_t, out));
+
+    *dav->rcvptr = '\0';
+
+    pf->depth = dav->depth;
+    propfind_parse(pf, dav->payload);
+    strcpy(pf->path, dav->uri);
+    pf->root_len = strlen(pf->path);
+
+    if(!(pf->exists = vfs_stat(pf->path, &pf->st) == 0) && !strcmp(pf->path, "/")) {
+        memset(&pf->st, 0, sizeof(vfs_stat_t));
+        pf->st.st_mode.directory = pf->exists = true;
+    }
+
+    http_set_response_status(request, pf->exists ? "207 Multi-Status" : "404 Not found");
+    http_set_response_header(request, "Content-Type", "application/xml; charset=\"utf-8\"");
+    http_set_response_generator(request, propfind_generate);
 }
 
 static void proppatch_receive_finished (http_request_t *request, char *response_uri, u16_t response_uri_len)
@@ -360,17 +869,51 @@ static void proppatch_receive_finished (http_request_t *request, char *response_
         }
     }
 
+    // Report the patched properties of the resource only.
+    dav->depth = 0;
+
     propfind_receive_finished(request, response_uri, response_uri_len);
+
+    // Properties that cannot be patched are not reported as not found.
+    if(dav->propfind) {
+        dav->propfind->named = false;
+        *dav->propfind->unknown = '\0';
+    }
+}
+
+static void put_committed (void *ctx, size_t length, bool ok)
+{
+    http_recved((http_request_t *)ctx, length);
 }
 
 static err_t put_receive_data (http_request_t *request, struct pbuf *p)
 {
     struct pbuf *q = p;
+    webdav_data_t *dav = (webdav_data_t *)request->private_data;
+
+    do {
+        sha1_update(&dav->sha1, q->payload, q->len);
+    } while((q = q->next));
+
+    q = p;
+
+    if(dav->wb) {
 
-    vfs_write(q->payload, 1, q->len, ((webdav_data_t *)request->private_data)->vfsh);
+        while(q && writebehind_write(dav->wb, q->payload, q->len)) {
+            dav->received += q->len;
+            q = q->next;
+        }
+
+        // The receive window is opened when the data has been written, see put_committed().
+        writebehind_hold(dav->wb, p->tot_len);
+        pbuf_free(p);
+
+        return ERR_OK;
+    }
 
-    while((q = q->next))
-        vfs_write(q->payload, 1, q->len, ((webdav_data_t *)request->private_data)->vfsh);
+    do {
+        dav->received += vfs_write(q->payload, 1, q->len, dav->vfsh);
+    } while((q = q->next));
 
     httpd_free_pbuf(request, p);
 
@@ -380,18 +923,418 @@ static err_t put_receive_data (http_request_t *request, struct pbuf *p)
 static void put_receive_finished (http_request_t *request, char *response_uri, u16_t response_uri_len)
 {
     webdav_data_t *dav = (webdav_data_t *)request->private_data;
+    bool ok = dav->wb == NULL || writebehind_close(dav->wb);
 
+    dav->wb = NULL;
     vfs_close(dav->vfsh);
     dav->vfsh = NULL;
 
-    if(dav->type == Resource_File)
-        http_set_response_status(request, "200 OK");
-    else
-        http_set_response_status(request, "201 Created");
+    if(ok) {
+
+        vfs_stat_t st;
+        uint8_t sha1[SHA1_BLOCK_SIZE];
+        char digest[HTTP_DIGEST_LEN];
+
+        sha1_final(&dav->sha1, sha1);
+        http_set_response_digest(request, sha1, digest);
+
+        // Delete the file if it does not match the digest provided by the client,
+        // the data of a resumable upload is discarded from the start of the range.
+        if(*dav->digest && strcmp(dav->digest, digest)) {
+            if(dav->resumable)
+                upload_save(dav, dav->offset);
+            else
+                vfs_unlink(dav->uri);
+            http_set_response_status(request, "400 Bad Request");
+        } else if(dav->resumable && dav->offset + dav->received < dav->total) {
+            if(upload_save(dav, dav->offset + dav->received))
+                upload_incomplete(request, dav->offset + dav->received);
+            else
+                http_set_response_status(request, "500 Internal Server Error");
+        } else {
+
+            // Resumable upload complete, replace the resource with the partial file.
+            if(dav->resumable) {
+
+                char path[WEBDAV_PATH_MAX];
+
+                if(dav->type == Resource_File)
+                    vfs_unlink(dav->uri);
+
+                if(vfs_rename(upload_path(dav, path, WEBDAV_UPLOAD_PART_EXT), dav->uri) == 0)
+                    vfs_unlink(upload_path(dav, path, WEBDAV_UPLOAD_STATE_EXT));
+                else
+                    ok = false;
+            }
+
+            if(ok && vfs_stat(dav->uri, &st) == 0)
+                http_set_response_validators(request, &st);
+
+            http_set_response_status(request, !ok ? "500 Internal Server Error" : (dav->type == Resource_File ? "200 OK" : "201 Created"));
+        }
+    } else
+        http_set_response_status(request, "500 Internal Server Error");
 
     *response_uri = '\0';
 }
 
+// Opens the file to PUT. With a Content-Range header (bytes first-last/total) the data is written to a partial file
+// at the given offset, which must not be beyond the data committed by earlier requests. A request with a
+// bytes */total range and no body returns the length committed, see upload_incomplete().
+// Returns false with the response status set if the body is not to be received.
+static bool put_open (http_request_t *request)
+{
+    bool ok = true;
+    char *value, *s, path[WEBDAV_PATH_MAX];
+    size_t committed = 0, last = 0;
+    int vlen;
+    webdav_data_t *dav = (webdav_data_t *)request->private_data;
+
+    if((vlen = http_get_header_value_len(request, "Content-Range")) <= 0) {
+        if((dav->vfsh = vfs_open(dav->uri, "w")) == NULL)
+            http_set_response_status(request, "404 Not found");
+        return dav->vfsh != NULL;
+    }
+
+    if((value = malloc(vlen + 1)) == NULL) {
+        http_set_response_status(request, "500 Internal Server Error");
+        return false;
+    }
+
+    http_get_header_value(request, "Content-Range", value, vlen);
+
+    if((ok = !strncmp(value, "bytes ", 6) && (s = strchr(value, '/')) && isdigit((int)s[1]))) {
+        dav->total = strtoul(s + 1, NULL, 10);
+        if(value[6] == '*')
+            dav->offset = SIZE_MAX;
+        else {
+            dav->offset = strtoul(value + 6, &s, 10);
+            ok = *s == '-' && (last = strtoul(s + 1, NULL, 10)) >= dav->offset && last < dav->total &&
+                  last - dav->offset + 1 == dav->content_len;
+        }
+    }
+
+    free(value);
+
+    if(!ok || strlen(dav->uri) + 6 > sizeof(path)) {
+        http_set_response_status(request, "400 Bad Request");
+        return false;
+    }
+
+    // Status query
+    if(dav->offset == SIZE_MAX) {
+        if(upload_load(dav, &committed))
+            upload_incomplete(request, committed);
+        else if(dav->type == Resource_File && dav->st.st_size == dav->total)
+            http_set_response_status(request, "200 OK");
+        else
+            upload_incomplete(request, 0);
+        return false;
+    }
+
+    if(dav->offset == 0) {
+        if((dav->vfsh = vfs_open(upload_path(dav, path, WEBDAV_UPLOAD_PART_EXT), "w")) && !upload_save(dav, 0)) {
+            vfs_close(dav->vfsh);
+            dav->vfsh = NULL;
+        }
+    } else if(!upload_load(dav, &committed) || dav->offset > committed) {
+        sprintf(path, "bytes */%lu", (unsigned long)dav->total);
+        http_set_response_header(request, "Content-Range", path);
+        if(dav->offset > committed)
+            upload_incomplete(request, committed);
+        http_set_response_status(request, "416 Range Not Satisfiable");
+        return false;
+    } else if((dav->vfsh = vfs_open(upload_path(dav, path, WEBDAV_UPLOAD_PART_EXT), "r+b")) && vfs_seek(dav->vfsh, dav->offset) != 0) {
+        vfs_close(dav->vfsh);
+        dav->vfsh = NULL;
+    }
+
+    if(dav->vfsh == NULL)
+        http_set_response_status(request, "500 Internal Server Error");
+
+    return (dav->resumable = dav->vfsh != NULL);
+}
+
+// Deletes the resource at path, collections with all members.
+// The directory is reopened after each deletion as the VFS may not allow
+// entries to be removed while it is being read, path is restored on return.
+static bool dav_delete_tree (char *path, bool directory)
+{
+    bool ok = true;
+    vfs_dir_t *dir;
+    vfs_dirent_t *dirent;
+    uint_fast8_t level = 0;
+    size_t len[WEBDAV_MAX_DEPTH + 1];
+
+    if(!directory)
+        return vfs_unlink(path) == 0;
+
+    len[0] = strlen(path);
+
+    while(ok) {
+
+        if((ok = (dir = vfs_opendir(path)) != NULL)) {
+
+            while((dirent = vfs_readdir(dir)) && (!strcmp(dirent->name, ".") || !strcmp(dirent->name, "..")));
+
+            if(dirent && (ok = len[level] + strlen(dirent->name) + 2 <= WEBDAV_PATH_MAX)) {
+                strcat(strcat(path, "/"), dirent->name);
+                directory = dirent->st_mode.directory;
+            }
+
+            vfs_closedir(dir);
+
+            if(!ok)
+                break;
+
+            if(dirent == NULL) {
+                if((ok = vfs_rmdir(path) == 0) && level)
+                    path[len[--level]] = '\0';
+                else
+                    break;
+            } else if(directory) {
+                if((ok = level < WEBDAV_MAX_DEPTH))
+                    len[++level] = strlen(path);
+            } else {
+                ok = vfs_unlink(path) == 0;
+                path[len[level]] = '\0';
+            }
+        }
+    }
+
+    path[len[0]] = '\0';
+
+    return ok && level == 0;
+}
+
+// Opens the file pair for copying cp->src to cp->dst.
+static bool dav_copy_open (dav_copy_t *cp)
+{
+    if((cp->src_file = vfs_open(cp->src, "r")) && (cp->dst_file = vfs_open(cp->dst, "w")) == NULL) {
+        vfs_close(cp->src_file);
+        cp->src_file = NULL;
+    }
+
+    return cp->src_file != NULL;
+}
+
+// Closes the file being copied, the partial destination file is removed if not ok.
+static void dav_copy_close (dav_copy_t *cp, bool ok)
+{
+    vfs_close(cp->src_file);
+    vfs_close(cp->dst_file);
+    cp->src_file = cp->dst_file = NULL;
+
+    if(!ok)
+        vfs_unlink(cp->dst);
+}
+
+static void dav_copy_free (dav_copy_t *cp, bool ok)
+{
+    if(cp->src_file)
+        dav_copy_close(cp, ok);
+
+    while(cp->level)
+        vfs_closedir(cp->dir[--cp->level]);
+
+    free(cp);
+}
+
+static bool dav_copy_push (dav_copy_t *cp)
+{
+    if(cp->level == WEBDAV_MAX_DEPTH || (cp->dir[cp->level] = vfs_opendir(cp->src)) == NULL)
+        return false;
+
+    cp->src_len[cp->level] = strlen(cp->src);
+    cp->dst_len[cp->level++] = strlen(cp->dst);
+
+    return true;
+}
+
+// Sets up copying cp->src to cp->dst, collections with members if depth is not 0.
+// Returns false on failure, cp->src_file and cp->level are both 0 if there is nothing more to copy.
+static bool dav_copy_start (dav_copy_t *cp, bool directory, int depth)
+{
+    if(!directory)
+        return dav_copy_open(cp);
+
+    return vfs_mkdir(cp->dst) == 0 && (depth == 0 || dav_copy_push(cp));
+}
+
+// Deletes the source of a MOVE and sends the deferred response.
+static void dav_copy_done (dav_copy_t *cp, bool ok)
+{
+    http_request_t *request = cp->request;
+    webdav_data_t *dav = (webdav_data_t *)request->private_data;
+
+    if(ok && cp->move)
+        ok = dav_delete_tree(strcpy(cp->src, dav->uri), dav->type == Resource_Directory);
+
+    http_set_response_status(request, ok ? (cp->exists ? "204 No Content" : "201 Created") : "500 Internal Server Error");
+
+    dav->copy = NULL;
+    dav_copy_free(cp, ok);
+
+    http_send_deferred_response(request, NULL);
+}
+
+// Copies up to WEBDAV_COPY_BLOCKS blocks or directory entries, called from a lwIP timeout.
+static void dav_copy_step (void *arg)
+{
+    bool ok = true;
+    size_t len;
+    dav_copy_t *cp = (dav_copy_t *)arg;
+    vfs_dirent_t *dirent;
+    uint_fast16_t blocks = WEBDAV_COPY_BLOCKS;
+
+    while(ok && blocks && (cp->src_file || cp->level)) {
+
+        blocks--;
+
+        if(cp->src_file) {
+            if((len = vfs_read(cp->buf, 1, sizeof(cp->buf), cp->src_file)) > 0)
+                ok = vfs_write(cp->buf, 1, len, cp->dst_file) == len;
+            else
+                dav_copy_close(cp, true);
+            continue;
+        }
+
+        cp->src[cp->src_len[cp->level - 1]] = cp->dst[cp->dst_len[cp->level - 1]] = '\0';
+
+        if((dirent = vfs_readdir(cp->dir[cp->level - 1])) == NULL) {
+            vfs_closedir(cp->dir[--cp->level]);
+            continue;
+        }
+
+        if(!strcmp(dirent->name, ".") || !strcmp(dirent->name, ".."))
+            continue;
+
+        if(!(ok = cp->src_len[cp->level - 1] + strlen(dirent->name) + 2 <= sizeof(cp->src) &&
+                   cp->dst_len[cp->level - 1] + strlen(dirent->name) + 2 <= sizeof(cp->dst)))
+            break;
+
+        strcat(strcat(cp->src, "/"), dirent->name);
+        strcat(strcat(cp->dst, "/"), dirent->name);
+
+        ok = dav_copy_start(cp, dirent->st_mode.directory, -1);
+    }
+
+    if(ok && (cp->src_file || cp->level))
+        sys_timeout(WEBDAV_COPY_INTERVAL, dav_copy_step, cp);
+    else
+        dav_copy_done(cp, ok);
+}
+
+// Gets the path part of the Destination header, returns false if missing or not on this server.
+static bool dav_get_destination (http_request_t *request, char *path)
+{
+    char *destination, *s;
+    int len = http_get_header_value_len(request, "Destination");
+
+    if(len <= 0 || (destination = malloc(len + 1)) == NULL)
+        return false;
+
+    http_get_header_value(request, "Destination", destination, len + 1);
+
+    // Absolute URI or absolute path.
+    if((s = strstr(destination, "://")))
+        s = strchr(s + 3, '/');
+    else
+        s = *destination == '/' ? destination : NULL;
+
+    if(s) {
+        if(strchr(s, '?'))
+            *strchr(s, '?') = '\0';
+        urldecode(s, s);
+        if(strlen(s) < WEBDAV_PATH_MAX)
+            vfs_fixpath(strcpy(path, s));
+        else
+            s = NULL;
+    }
+
+    free(destination);
+
+    return s != NULL;
+}
+
+// Server side COPY and MOVE, MOVE falls back to copy and delete when the resource
+// cannot be renamed, e.g. when the destination is on another mount.
+// The copy is done in steps by dav_copy_step() and the response is sent when it completes.
+static void dav_copy_move (http_request_t *request, http_method_t method)
+{
+    bool overwrite = true, exists = false;
+    char *value, *parent;
+    vfs_stat_t st, pst;
+    dav_copy_t *cp;
+    int vlen;
+    webdav_data_t *dav = (webdav_data_t *)request->private_data;
+
+    if(dav->type == Resource_NotExist) {
+        http_set_response_status(request, "404 Not found");
+        return;
+    }
+
+    if(!dav_preconditions(request))
+        return;
+
+    if((vlen = http_get_header_value_len(request, "Overwrite")) > 0 && (value = malloc(vlen + 1))) {
+        http_get_header_value(request, "Overwrite", value, vlen + 1);
+        overwrite = *value != 'F' && *value != 'f';
+        free(value);
+    }
+
+    if((cp = malloc(sizeof(dav_copy_t))) == NULL) {
+        http_set_response_status(request, "500 Internal Server Error");
+        return;
+    }
+
+    cp->request = request;
+    cp->move = method == HTTP_Move;
+    cp->level = 0;
+    cp->src_file = cp->dst_file = NULL;
+    strcpy(cp->src, dav->uri);
+
+    if(!dav_get_destination(request, cp->dst) || (method == HTTP_Copy && dav->depth == 1))
+        http_set_response_status(request, "400 Bad Request");
+
+    else if(!strcmp(cp->src, cp->dst) || !strcmp(cp->dst, "/") || (dav->type == Resource_Directory &&
+              !strncmp(cp->src, cp->dst, strlen(cp->src)) && (cp->dst[strlen(cp->src)] == '/' || !strcmp(cp->src, "/"))))
+        http_set_response_status(request, "403 Forbidden");
+
+    else if((exists = vfs_stat(cp->dst, &st) == 0) && !overwrite)
+        http_set_response_status(request, "412 Precondition Failed");
+
+    else {
+
+        // The parent collection of the destination must exist.
+        if((parent = strrchr(cp->dst, '/')) && parent != cp->dst) {
+            *parent = '\0';
+            if(vfs_stat(cp->dst, &pst) != 0 || !pst.st_mode.directory)
+                parent = NULL;
+            else
+                *parent = '/';
+        }
+
+        if(parent == NULL)
+            http_set_response_status(request, "409 Conflict");
+        else if(exists && !dav_delete_tree(cp->dst, st.st_mode.directory))
+            http_set_response_status(request, "500 Internal Server Error");
+        else if(method == HTTP_Move && vfs_rename(cp->src, cp->dst) == 0)
+            http_set_response_status(request, exists ? "204 No Content" : "201 Created");
+        else if(!dav_copy_start(cp, dav->type == Resource_Directory, method == HTTP_Move ? -1 : dav->depth))
+            http_set_response_status(request, "500 Internal Server Error");
+        else {
+            cp->exists = exists;
+            dav->copy = cp;
+            http_defer_response(request);
+            sys_timeout(WEBDAV_COPY_INTERVAL, dav_copy_step, cp);
+            return;
+        }
+    }
+
+    dav_copy_free(cp, false);
+}
+
 static err_t dav_process_request (http_request_t *request, http_method_t method, char *uri, u16_t uri_len)
 {
     err_t ret = ERR_OK;
@@ -404,11 +1347,21 @@ static err_t dav_process_request (http_request_t *request, http_method_t method,
 
                 webdav_data_t *dav = (webdav_data_t *)request->private_data;
 
-                if((dav->vfsh = vfs_open(dav->uri, "w"))) {
+                // Respond before the body is transferred if a precondition fails.
+                if(!dav_preconditions(request))
+                    break;
+
+                if(put_open(request)) {
                     if(dav->content_len) {
                         request->post_receive_data = put_receive_data;
                         request->post_finished = put_receive_finished;
 
+                        sha1_init(&dav->sha1);
+                        http_get_request_digest(request, dav->digest);
+
+                        if((dav->wb = writebehind_create(dav->vfsh, dav->resumable ? dav->offset : 0, TCP_WND, put_committed, request)))
+                            http_set_manual_window(request);
+
                         return http_get_payload(request, dav->content_len);
                     } else {
                         vfs_close(dav->vfsh);
@@ -418,46 +1371,15 @@ static err_t dav_process_request (http_request_t *request, http_method_t method,
                         else
                             http_set_response_status(request, "201 Created");
                     }
-                } else {
+                } else if(dav->total == 0)
                     uri = "404.html";
-                    http_set_response_status(request, "404 Not found");
-                }
             }
             break;
 
+        case HTTP_Copy:
         case HTTP_Move:
-            if((ret = dav_init_request(request, method, uri)) == ERR_OK) {
-
-                webdav_data_t *dav = (webdav_data_t *)request->private_data;
-
-                if (dav->type == Resource_NotExist) {
-                    uri = "404.html";
-                } else {
-
-                    char *destination = NULL, *host = NULL, *renameto;
-                    int clen = http_get_header_value_len(request, "Destination");
-
-                    if(clen > 0 && (destination = malloc(clen + 1))) {
-
-                        http_get_header_value(request, "Destination", destination, clen + 1);
-                        urldecode(destination, destination);
-
-                        clen = http_get_header_value_len(request, "Host");
-                        if(clen > 0 && (host = malloc(clen + 1))) {
-                            http_get_header_value(request, "Host", host, clen + 1);
-                            if((renameto = strstr(destination, host))) {
-                                renameto += clen;
-                                vfs_rename(dav->uri, renameto);
-                            }
-                        }
-                    }
-
-                    if(destination)
-                        free(destination);
-                    if(host)
-                        free(host);
-                }
-            }
+            if((ret = dav_init_request(request, method, uri)) == ERR_OK)
+                dav_copy_move(request, method);
             break;
 
         case HTTP_Delete:
@@ -467,7 +1389,7 @@ static err_t dav_process_request (http_request_t *request, http_method_t method,
 
                 if(dav->type == Resource_NotExist) {
                     uri = "404.html";
-                } else {
+                } else if(dav_preconditions(request)) {
 
                     if(dav->type == Resource_Directory)
                         vfs_rmdir(vfs_fixpath(dav->uri));
@@ -54,6 +54,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "utils.h"
 #include "strutils.h"
 #include "websocketd.h"
+#include "streambuffer.h"
 
 #include "grbl/grbl.h"
 #include "grbl/protocol.h"
@@ -77,6 +78,42 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define WEBUI_MAX_CLIENTS 4
 #endif
 
+// Default output flush policy, may be changed at run time by websocketd_set_flush_policy()
+
+#ifndef WEBSOCKETD_NODELAY
+#define WEBSOCKETD_NODELAY 1
+#endif
+
+#ifndef WEBSOCKETD_FLUSH_ON_EOL
+#define WEBSOCKETD_FLUSH_ON_EOL 1
+#endif
+
+#ifndef WEBSOCKETD_COALESCE_BYTES
+#define WEBSOCKETD_COALESCE_BYTES TCP_MSS
+#endif
+
+#ifndef WEBSOCKETD_COALESCE_US
+#define WEBSOCKETD_COALESCE_US 2000
+#endif
+
+// Per client output queue for frames not sent via the stream buffers
+
+#ifndef WEBSOCKETD_QUEUE_SIZE
+#define WEBSOCKETD_QUEUE_SIZE 4096  // Max number of bytes queued, the slow consumer policy is applied when exceeded
+#endif
+
+#ifndef WEBSOCKETD_QUEUE_HIGH_WATERMARK
+#define WEBSOCKETD_QUEUE_HIGH_WATERMARK (WEBSOCKETD_QUEUE_SIZE * 3 / 4)
+#endif
+
+#ifndef WEBSOCKETD_QUEUE_LOW_WATERMARK
+#define WEBSOCKETD_QUEUE_LOW_WATERMARK (WEBSOCKETD_QUEUE_SIZE / 4)
+#endif
+
+#ifndef WEBSOCKETD_SLOW_CONSUMER_POLICY
+#define WEBSOCKETD_SLOW_CONSUMER_POLICY WsSlowConsumer_Coalesce
+#endif
+
 #define WEBSOCKETD_MAGIC 1819047252
 
 PROGMEM static const char WS_GUID[]  = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -139,6 +176,23 @@ typedef struct {
     void *payload;
 } packet_chain_t;
 
+typedef struct ws_frame {
+    struct ws_frame *next;
+    uint16_t len;
+    uint16_t sent;
+    bool status_report;
+    uint8_t data[];
+} ws_frame_t;
+
+typedef struct {
+    ws_frame_t *head;
+    ws_frame_t *tail;
+    uint32_t bytes;
+    uint32_t dropped;
+    bool blocked;
+    websocket_slow_consumer_policy_t policy;
+} ws_txqueue_t;
+
 typedef union {
     uint8_t value;
     struct {
@@ -162,6 +216,8 @@ typedef struct ws_sessiondata
     uint32_t timeoutMax;
     struct tcp_pcb *pcb;
     packet_chain_t packet;
+    uint_fast16_t tx_frame_rem;
+    ws_txqueue_t txq;
     TickType_t lastSendTime;
     err_t lastErr;
     uint8_t errorCount;
@@ -176,6 +232,7 @@ typedef struct ws_sessiondata
 
 typedef struct {
     ws_sessiondata_t *session;
+    bool rx_eol;
     stream_rx_buffer_t rxbuf;
     stream_tx_buffer_t txbuf;
 } ws_streambuffers_t;
@@ -186,6 +243,7 @@ typedef struct {
 } ws_stream_t;
 
 static void websocket_stream_handler (ws_sessiondata_t *session);
+static bool websocket_enqueue (ws_sessiondata_t *session, const uint8_t *hdr, uint_fast8_t hdr_len, const void *payload, size_t size, bool status_report);
 
 static const ws_frame_start_t wshdr_txt = {
   .fin    = true,
@@ -215,6 +273,15 @@ static const ws_sessiondata_t defaultSettings =
     .timeoutMax = SOCKET_TIMEOUT,
     .pcb = NULL,
     .packet = {0},
+    .tx_frame_rem = 0,
+    .txq = {
+        .head = NULL,
+        .tail = NULL,
+        .bytes = 0,
+        .dropped = 0,
+        .blocked = false,
+        .policy = WEBSOCKETD_SLOW_CONSUMER_POLICY
+    },
     .header = {0},
     .lastSendTime = 0,
     .errorCount = 0,
@@ -233,6 +300,12 @@ static const io_stream_t *claim_stream (uint32_t baud_rate);
 static tcp_server_t ws_server;
 static ws_sessiondata_t clients[WEBUI_MAX_CLIENTS] = {0};
 static ws_streambuffers_t streambuffers = {0};
+static stream_flush_t ws_flush = {
+    .policy.nodelay = WEBSOCKETD_NODELAY,
+    .policy.flush_on_eol = WEBSOCKETD_FLUSH_ON_EOL,
+    .policy.coalesce_bytes = WEBSOCKETD_COALESCE_BYTES,
+    .policy.coalesce_us = WEBSOCKETD_COALESCE_US
+};
 static ws_stream_t ws_streams[] = {
     {
         .state.connected = Off,
@@ -300,24 +373,18 @@ static bool streamSuspendInput (bool suspend)
     return stream_rx_suspend(&streambuffers.rxbuf, suspend);
 }
 
-bool websocketd_RxPutC (char c)
+static uint_fast16_t streamRxPut (const uint8_t *data, uint_fast16_t length)
 {
-    bool ok, overflow = false;
+    uint_fast16_t taken = length;
 
     // discard input if MPG has taken over...
-    if((ok = streambuffers.session && streambuffers.session->state == WsState_Connected && hal.stream.type != StreamType_MPG)) {
+    if(hal.stream.type != StreamType_MPG) {
 #if ESP_PLATFORM
         taskENTER_CRITICAL(&rx_mux);
 #else
         taskENTER_CRITICAL();
 #endif
-        if(!enqueue_realtime_command(c)) {                          // If not a real time command attempt to buffer it
-            uint_fast16_t next_head = BUFNEXT(streambuffers.rxbuf.head, streambuffers.rxbuf);
-            if((overflow = next_head == streambuffers.rxbuf.tail))  // If buffer full
-                streambuffers.rxbuf.overflow = true;                // flag overflow
-            streambuffers.rxbuf.data[streambuffers.rxbuf.head] = c; // add data to buffer
-            streambuffers.rxbuf.head = next_head;                   // and update pointer
-        }
+        taken = stream_rx_ingest(&streambuffers.rxbuf, (const char *)data, length, enqueue_realtime_command, &streambuffers.rx_eol);
 #if ESP_PLATFORM
         taskEXIT_CRITICAL(&rx_mux);
 #else
@@ -325,11 +392,31 @@ bool websocketd_RxPutC (char c)
 #endif
     }
 
-    return ok && !overflow;
+    return taken;
+}
+
+bool websocketd_RxPutC (char c)
+{
+    return streambuffers.session && streambuffers.session->state == WsState_Connected && streamRxPut((uint8_t *)&c, 1) == 1;
+}
+
+// Block the stream owner via hal.stream_blocking_callback() while its output queue
+// is above the high watermark and until it has drained below the low watermark.
+static bool streamTxWait (void)
+{
+    while(streambuffers.session && streambuffers.session->txq.blocked) {
+        if(!hal.stream_blocking_callback())
+            return false;
+    }
+
+    return true;
 }
 
 static bool streamPutC (const char c)
 {
+    if(!streamTxWait())
+        return false;
+
     uint_fast16_t next_head = BUFNEXT(streambuffers.txbuf.head, streambuffers.txbuf);
 
     while(streambuffers.txbuf.tail == next_head) {                               // Buffer full, block until space is available...
@@ -340,43 +427,23 @@ static bool streamPutC (const char c)
     streambuffers.txbuf.data[streambuffers.txbuf.head] = c;                     // Add data to buffer
     streambuffers.txbuf.head = next_head;                                       // and update head pointer
 
+    stream_flush_mark(&ws_flush, &c, 1);
+
     return true;
 }
 
 static void streamWriteS (const char *data)
 {
-    char c, *ptr = (char *)data;
+    uint_fast16_t length = strlen(data);
 
-    while((c = *ptr++) != '\0')
-        streamPutC(c);
+    if(streamTxWait() && stream_tx_write(&streambuffers.txbuf, data, length))
+        stream_flush_mark(&ws_flush, data, length);
 }
 
 static void streamWrite (const char *data, uint16_t length)
 {
-    char *ptr = (char *)data;
-
-    while(length--)
-        streamPutC(*ptr++);
-}
-
-static uint16_t streamTxCount (void) {
-
-    uint_fast16_t head = streambuffers.txbuf.head, tail = streambuffers.txbuf.tail;
-
-    return BUFCOUNT(head, tail, TX_BUFFER_SIZE);
-}
-
-static int16_t streamTxGetC (void)
-{
-    int16_t data;
-
-    if(streambuffers.txbuf.tail == streambuffers.txbuf.head)
-        return SERIAL_NO_DATA; // no data available else EOF
-
-    data = streambuffers.txbuf.data[streambuffers.txbuf.tail];                          // Get next character
-    streambuffers.txbuf.tail = BUFNEXT(streambuffers.txbuf.tail, streambuffers.txbuf);  // and update pointer
-
-    return data;
+    if(streamTxWait() && stream_tx_write(&streambuffers.txbuf, data, length))
+        stream_flush_mark(&ws_flush, data, length);
 }
 
 static void streamTxFlush (void)
@@ -460,32 +527,30 @@ static const io_stream_t *claim_stream (uint32_t baud_rate)
 
 bool websocket_send_frame (websocket_t *session, const void *data, size_t size, bool is_binary)
 {
-    uint8_t *msg;
-    size_t hdr_len = size >= 126 ? 4 : 2;
+    uint8_t hdr[4];
+    uint_fast8_t hdr_len = size >= 126 ? 4 : 2;
 
-    if(session == NULL || ((ws_sessiondata_t *)session)->magic != WEBSOCKETD_MAGIC)
+    if(session == NULL || ((ws_sessiondata_t *)session)->magic != WEBSOCKETD_MAGIC || size > 0xFFFF - 4)
         return false;
 
-    if((msg = malloc(size + hdr_len))) {
-
-        memcpy(msg + hdr_len, data, size);
-
-        msg[0] = is_binary ? wshdr_bin.token : wshdr_txt.token;
-        msg[1] = size < 126 ? size : 126;
-        if(size >= 126) {
-            msg[2] = (size >> 8) & 0xFF;
-            msg[3] = size & 0xFF;
-        }
+    hdr[0] = is_binary ? wshdr_bin.token : wshdr_txt.token;
+    hdr[1] = size < 126 ? size : 126;
+    if(size >= 126) {
+        hdr[2] = (size >> 8) & 0xFF;
+        hdr[3] = size & 0xFF;
+    }
 
-        if(tcp_write(((ws_sessiondata_t *)session)->pcb, msg, (u16_t)(size + hdr_len), TCP_WRITE_FLAG_COPY) == ERR_OK)
-            tcp_output(((ws_sessiondata_t *)session)->pcb);
+    return websocket_enqueue((ws_sessiondata_t *)session, hdr, hdr_len, data, size, !is_binary && size && *(char *)data == '<');
+}
 
-        ((ws_sessiondata_t *)session)->lastSendTime = xTaskGetTickCount();
+bool websocket_set_slow_consumer_policy (websocket_t *session, websocket_slow_consumer_policy_t policy)
+{
+    if(session == NULL || ((ws_sessiondata_t *)session)->magic != WEBSOCKETD_MAGIC)
+        return false;
 
-        free(msg);
-    }
+    ((ws_sessiondata_t *)session)->txq.policy = policy;
 
-    return msg != 0;
+    return true;
 }
 
 bool websocket_broadcast_frame (const void *data, size_t size, bool is_binary)
@@ -542,6 +607,18 @@ static void websocket_state_free (ws_sessiondata_t *session)
         free(session->header.frame);
         session->header.frame = NULL;
     }
+
+    // Free any frames queued for output
+    ws_frame_t *frame;
+
+    while((frame = session->txq.head)) {
+        session->txq.head = frame->next;
+        free(frame);
+    }
+
+    session->txq.tail = NULL;
+    session->txq.bytes = 0;
+    session->txq.blocked = false;
 }
 
 static void websocket_unlink_session (ws_sessiondata_t *session)
@@ -734,18 +811,22 @@ static uint32_t websocket_msg_parse (ws_sessiondata_t *session, uint8_t *payload
                         }
                     } else if(session == streambuffers.session && session->stream_state.connected) { // Unmask and push into RX buffer on the go
 
-                        uint_fast16_t i = session->header.rx_index;
+                        uint_fast16_t i = session->header.rx_index, j, taken;
 
                         streambuffers.rxbuf.overflow = false;
 
-                        while (payload_len--) {
-                            if(!websocketd_RxPutC(*payload++ ^ mask[i % 4]))
-                                break; // If overflow pend buffering rest of data until next polling
-                            plen--;
-                            i++;
-                        }
+                        // Unmask data in place and push it to the RX buffer in one go
+                        for(j = 0; j < payload_len; j++)
+                            payload[j] ^= mask[(i + j) % 4];
+
+                        taken = streamRxPut(payload, payload_len);
 
-                        session->header.rx_index = i;
+                        // If overflow restore masking of the remaining data and pend buffering it until next polling
+                        for(j = taken; j < payload_len; j++)
+                            payload[j] ^= mask[(i + j) % 4];
+
+                        plen -= taken;
+                        session->header.rx_index = i + taken;
                         frame_done = (session->header.payload_rem = session->header.payload_len - session->header.rx_index) == 0;
 
                     } else { // No client, sink payload
@@ -795,8 +876,7 @@ static uint32_t websocket_msg_parse (ws_sessiondata_t *session, uint8_t *payload
                             for(j = 0; j < session->header.payload_len; j++)
                                 *buf++ = *pm++ ^ mask[i++ % 4];
 
-                            tcp_write(session->pcb, pong, session->header.payload_len + hdr_len, TCP_WRITE_FLAG_COPY);
-                            tcp_output(session->pcb);
+                            websocket_enqueue(session, pong, hdr_len, pong + hdr_len, session->header.payload_len, false);
                             free(pong);
                         }
                     }
@@ -896,10 +976,14 @@ static err_t websocket_recv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err
     return ERR_OK;
 }
 
+static void websocket_queue_flush (ws_sessiondata_t *session);
+
 static err_t websocket_sent (void *arg, struct tcp_pcb *pcb, u16_t ui16len)
 {
     ((ws_sessiondata_t *)arg)->timeout = 0;
 
+    websocket_queue_flush((ws_sessiondata_t *)arg);
+
     return ERR_OK;
 }
 
@@ -946,6 +1030,129 @@ static void http_write_error (ws_sessiondata_t *session, const char *status)
     session->state = WsState_Closing;
 }
 
+//
+// Output queue handling
+//
+
+static void websocket_queue_flush (ws_sessiondata_t *session)
+{
+    u16_t len;
+    ws_frame_t *frame;
+    bool sent = false;
+
+    if(session->pcb == NULL)
+        return;
+
+    // Queued frames are only sent when no stream frame is in progress
+    while(session->tx_frame_rem == 0 && (frame = session->txq.head)) {
+
+        if((len = frame->len - frame->sent) > tcp_sndbuf(session->pcb) && (len = tcp_sndbuf(session->pcb)) == 0)
+            break;
+
+        if(http_write(session->pcb, frame->data + frame->sent, &len, TCP_WRITE_FLAG_COPY) != ERR_OK)
+            break;
+
+        sent = true;
+        session->txq.bytes -= len;
+
+        if((frame->sent += len) == frame->len) {
+            if((session->txq.head = frame->next) == NULL)
+                session->txq.tail = NULL;
+            free(frame);
+        }
+    }
+
+    if(session->txq.blocked && session->txq.bytes <= WEBSOCKETD_QUEUE_LOW_WATERMARK)
+        session->txq.blocked = false;
+
+    if(sent) {
+        tcp_output(session->pcb);
+        session->lastSendTime = xTaskGetTickCount();
+    }
+}
+
+// Remove queued status reports that have not been started on, they are superseded by a newer one
+static void websocket_queue_coalesce (ws_sessiondata_t *session)
+{
+    ws_frame_t *frame = session->txq.head, *prev = NULL, *next;
+
+    while(frame) {
+        next = frame->next;
+        if(frame->status_report && frame->sent == 0) {
+            if(prev)
+                prev->next = next;
+            else
+                session->txq.head = next;
+            if(session->txq.tail == frame)
+                session->txq.tail = prev;
+            session->txq.bytes -= frame->len;
+            session->txq.dropped++;
+            free(frame);
+        } else
+            prev = frame;
+        frame = next;
+    }
+}
+
+//
+// Send a frame or add it to the session output queue if it cannot be sent right away.
+// The slow consumer policy is applied when the queue is full, frames are never silently lost
+// when the stream owner is congested as it is blocked via hal.stream_blocking_callback() instead.
+// The limits apply to the backlog already queued, a frame is always accepted into an empty queue
+// even when it is larger than WEBSOCKETD_QUEUE_SIZE.
+//
+static bool websocket_enqueue (ws_sessiondata_t *session, const uint8_t *hdr, uint_fast8_t hdr_len, const void *payload, size_t size, bool status_report)
+{
+    ws_frame_t *frame;
+    size_t len = hdr_len + size;
+
+    if(session->pcb == NULL || session->state != WsState_Connected)
+        return false;
+
+    if(session->txq.bytes >= WEBSOCKETD_QUEUE_HIGH_WATERMARK) {
+
+        if(session->txq.policy == WsSlowConsumer_Coalesce && status_report)
+            websocket_queue_coalesce(session);
+
+        if(session == streambuffers.session)
+            session->txq.blocked = true;
+    }
+
+    if(session->txq.bytes >= WEBSOCKETD_QUEUE_SIZE) {
+
+        session->txq.dropped++;
+
+        if(session->txq.policy == WsSlowConsumer_Disconnect)
+            session->state = WsState_Closing;
+
+        return false;
+    }
+
+    if((frame = malloc(sizeof(ws_frame_t) + len)) == NULL)
+        return false;
+
+    memcpy(frame->data, hdr, hdr_len);
+    if(size)
+        memcpy(frame->data + hdr_len, payload, size);
+
+    frame->next = NULL;
+    frame->len = (uint16_t)len;
+    frame->sent = 0;
+    frame->status_report = status_report;
+
+    if(session->txq.tail)
+        session->txq.tail->next = frame;
+    else
+        session->txq.head = frame;
+
+    session->txq.tail = frame;
+    session->txq.bytes += len;
+
+    websocket_queue_flush(session);
+
+    return true;
+}
+
 bool websocket_claim_stream (websocket_t *websocket)
 {
     const io_stream_t *stream;
@@ -961,6 +1168,7 @@ bool websocket_claim_stream (websocket_t *websocket)
         if(hal.stream.type == StreamType_WebSocket || hal.stream.state.webui_connected) {
             session->stream = stream;
             streambuffers.session = session;
+            streambuffers.rx_eol = true;
             hal.stream.state.webui_connected = session->stream_state.webui_connected;
         }
 
@@ -970,6 +1178,125 @@ bool websocket_claim_stream (websocket_t *websocket)
     return hal.stream.type == StreamType_WebSocket;
 }
 
+//
+// Send the 101 Switching Protocols response and switch the session over to the websocket protocol.
+// key and protocols are the Sec-WebSocket-Key and Sec-WebSocket-Protocol header values, protocols may be NULL.
+// Shared by the standalone listener and connections handed over from httpd.
+//
+static bool websocket_handshake (ws_sessiondata_t *session, const char *key, const char *protocols)
+{
+    char *protocol = NULL, *prots = NULL, *argp;
+
+    if(protocols && *protocols && (prots = malloc(strlen(protocols) + 1))) {
+
+        bool is_binary = false;
+
+        strcpy(prots, protocols);
+
+        if(websocket.on_protocol_select)
+            protocol = websocket.on_protocol_select(session, prots, &is_binary);
+
+        if(protocol == NULL) {
+
+            protocol = prots;
+
+            // Switch to binary frames if protocol is arduino or webui
+            if(strlookup(prots, "arduino", ',') >= 0) {
+                strcpy(protocol, "arduino");
+                session->ftype = wshdr_bin;
+            } else if((argp = strchr(prots, ','))) // Select the first protocol if more than one and not arduino
+                *argp = '\0';
+        } else if(is_binary)
+            session->ftype = wshdr_bin;
+    }
+
+    if(key && strlen(key) + sizeof(WS_GUID) <= 64 && (protocol == NULL || strlen(protocol) < 200 - sizeof(WS_RSP) - sizeof(WS_PROT) - 32)) {
+
+        char keys[64];
+        char rsp[200];
+
+        // Copy base response header to response buffer
+        char *response = memcpy(rsp, WS_RSP, sizeof(WS_RSP) - 1);
+
+        // Concatenate keys
+        strcpy(keys, key);
+        strcat(keys, WS_GUID);
+
+        // Get SHA1 of keys
+        BYTE sha1sum[SHA1_BLOCK_SIZE];
+        SHA1_CTX ctx;
+        sha1_init(&ctx);
+        sha1_update(&ctx, (BYTE *)keys, strlen(keys));
+        sha1_final(&ctx, sha1sum);
+
+        // Base64 encode SHA1
+        size_t olen = base64_encode((BYTE *)sha1sum, (BYTE *)&response[sizeof(WS_RSP) - 1], SHA1_BLOCK_SIZE, 0);
+
+        // Upgrade...
+        if (olen) {
+            response[olen + sizeof(WS_RSP) - 1] = '\0';
+            if(protocol) {
+                strcat(response, CRLF);
+                strcat(response, WS_PROT);
+                strcat(response, protocol);
+            }
+            strcat(response, CRLF CRLF);
+#ifdef WSDEBUG
+    DEBUG_PRINT(response);
+#endif
+            u16_t len = strlen(response);
+            http_write(session->pcb, response, (u16_t *)&len, TCP_WRITE_FLAG_COPY);
+            session->state = WsState_Connected;
+            session->lastSendTime = xTaskGetTickCount();
+        }
+    }
+
+    if(prots)
+        free(prots);
+
+    if(session->state == WsState_Connected) {
+
+        tcp_recv(session->pcb, websocket_recv);
+
+        if(websocket.on_client_connect)
+            websocket.on_client_connect(session);
+
+        if(session->stream_state.connected)
+            websocket_claim_stream(session);
+    }
+
+    return session->state == WsState_Connected;
+}
+
+// Trims leading and trailing spaces in place.
+static char *trim (char *value)
+{
+    char *end = strchr(value, '\0');
+
+    while(*value == ' ')
+        value++;
+
+    while(end > value && *(end - 1) == ' ')
+        end--;
+
+    *end = '\0';
+
+    return value;
+}
+
+// Terminates and trims the header value in place, returns NULL if not terminated by CRLF.
+static char *get_header_value (char *value)
+{
+    char *end;
+
+    if(value == NULL || (end = strstr(value, CRLF)) == NULL)
+        return NULL;
+
+    *end = '\0';
+
+    return trim(value);
+}
+
 //
 // Process connection handshake
 //
@@ -1040,133 +1367,25 @@ static err_t http_recv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t er
     DEBUG_PRINT(session->http_request);
 #endif
 
-        char c = '\r', *argp, *argend, *protocols = NULL, *protocol = NULL;
-
-        if((argend = stristr(session->http_request, WS_PROT))) {
-
-            argp = argend + sizeof(WS_PROT) - 1;
-
-            if((argend = strstr(argp, CRLF))) {
-
-                *argend = '\0';
-
-                // Trim leading spaces from protocol
-                while(*argp == ' ')
-                    argp++;
-
-                // Trim trailing spaces from protocol
-                while(*(argend - 1) == ' ') {
-                    *argend = c;
-                    c = *(--argend);
-                    *argend = '\0';
-                }
-
-                if((protocols = malloc(strlen(argp) + 1))) {
-
-                    bool is_binary = false;
-
-                    memcpy(protocols, argp, strlen(argp) + 1);
-
-                    if(websocket.on_protocol_select)
-                        protocol = websocket.on_protocol_select(session, protocols, &is_binary);
-
-                    if(protocol == NULL) {
+        char *key = stristr(session->http_request, WS_KEY), *protocols = stristr(session->http_request, WS_PROT);
 
-                        protocol = protocols;
-
-                        // Switch to binary frames if protocol is arduino or webui
-                        if(strlookup(protocols, "arduino", ',') >= 0) {
-                            strcpy(protocol, "arduino");
-                            session->ftype = wshdr_bin;
-                        } else if((argp = strchr(protocols, ','))) // Select the first protocol if more than one and not arduino
-                            *argp = '\0';
-                    } else if(is_binary)
-                        session->ftype = wshdr_bin;
-                }
-
-                *argend = c;
-            }
-        }
-
-        if((argend = stristr(session->http_request, WS_KEY))) {
-
-            argp = argend + sizeof(WS_KEY) - 1;
-
-            if((argend = strstr(argp, CRLF))) {
-
-                char key[64];
-                char rsp[200];
-
-                *argend = '\0';
-
-                // Trim leading spaces from key
-                while(*argp == ' ')
-                    argp++;
-
-                // Trim trailing spaces from key
-                while(*(argend - 1) == ' ') {
-                    *argend = c;
-                    c = *(--argend);
-                    *argend = '\0';
-                }
-
-                // Copy base response header to response buffer
-                char *response = memcpy(rsp /*session->http_request*/, WS_RSP, sizeof(WS_RSP) - 1);
-
-                // Concatenate keys
-                strcpy(key, argp);
-                strcat(key, WS_GUID);
-
-                *argend = c;
-
-                // Get SHA1 of keys
-                BYTE sha1sum[SHA1_BLOCK_SIZE];
-                SHA1_CTX ctx;
-                sha1_init(&ctx);
-                sha1_update(&ctx, (BYTE *)key, strlen(key));
-                sha1_final(&ctx, sha1sum);
+        // Locate both values before terminating them in place
+        if(key)
+            key += sizeof(WS_KEY) - 1;
+        if(protocols)
+            protocols += sizeof(WS_PROT) - 1;
 
-                // Base64 encode SHA1
-                size_t olen = base64_encode((BYTE *)sha1sum, (BYTE *)&response[sizeof(WS_RSP) - 1], SHA1_BLOCK_SIZE, 0);
+        key = get_header_value(key);
+        protocols = get_header_value(protocols);
 
-                // Upgrade...
-                if (olen) {
-                    response[olen + sizeof(WS_RSP) - 1] = '\0';
-                    if(protocol) {
-                        strcat(response, CRLF);
-                        strcat(response, WS_PROT);
-                        strcat(response, protocol);
-                    }
-                    strcat(response, CRLF CRLF);
-#ifdef WSDEBUG
-    DEBUG_PRINT(response);
-#endif
-                    u16_t len = strlen(response);
-                    http_write(session->pcb, response, (u16_t *)&len, TCP_WRITE_FLAG_COPY);
-                    session->state = WsState_Connected;
-                    session->lastSendTime = xTaskGetTickCount();
-                }
-            }
-        }
+        websocket_handshake(session, key, protocols);
 
         free(session->http_request);
-        if(protocols)
-            free(protocols);
 
         session->http_request = NULL;
         session->hdrsize = MAX_HTTP_HEADER_SIZE;
 
-        if(session->state == WsState_Connected) {
-
-            tcp_recv(pcb, websocket_recv);
-
-            if(websocket.on_client_connect)
-                websocket.on_client_connect(session);
-
-            if(session->stream_state.connected)
-                websocket_claim_stream(session);
-
-        } else
+        if(session->state != WsState_Connected)
             websocket_unlink_session(session);
     }
 
@@ -1184,7 +1403,7 @@ static err_t http_recv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t er
     return ERR_OK;
 }
 
-static err_t websocketd_accept (void *arg, struct tcp_pcb *pcb, err_t err)
+static ws_sessiondata_t *websocket_session_alloc (struct tcp_pcb *pcb)
 {
     ws_sessiondata_t *session = NULL;
 
@@ -1199,7 +1418,35 @@ static err_t websocketd_accept (void *arg, struct tcp_pcb *pcb, err_t err)
         }
     } while(idx);
 
-    if(session == NULL) {
+    if(session) {
+
+        streamClose(session);
+
+        session->pcb = pcb;
+        session->ftype = wshdr_txt;
+
+        tcp_setprio(pcb, WEBSOCKETD_TCP_PRIO);
+        if(ws_flush.policy.nodelay)
+            tcp_nagle_disable(pcb);
+    }
+
+    return session;
+}
+
+static void websocket_session_attach (ws_sessiondata_t *session, tcp_recv_fn recv)
+{
+    tcp_arg(session->pcb, session);
+    tcp_recv(session->pcb, recv);
+    tcp_err(session->pcb, websocket_err);
+    tcp_poll(session->pcb, websocket_poll, WEBSOCKETD_POLL_INTERVAL);
+    tcp_sent(session->pcb, websocket_sent);
+}
+
+static err_t websocketd_accept (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    ws_sessiondata_t *session;
+
+    if((session = websocket_session_alloc(pcb)) == NULL) {
 
         if(!ws_server.link_lost)
             return ERR_CONN; // Busy, refuse connection
@@ -1215,22 +1462,53 @@ static err_t websocketd_accept (void *arg, struct tcp_pcb *pcb, err_t err)
         return ERR_ABRT;
     }
 
-    streamClose(session);
-
-    session->pcb = pcb;
-    session->ftype = wshdr_txt;
-
     tcp_accepted(pcb);
-    tcp_setprio(pcb, WEBSOCKETD_TCP_PRIO);
-    tcp_arg(pcb, session);
-    tcp_recv(pcb, http_recv);
-    tcp_err(pcb, websocket_err);
-    tcp_poll(pcb, websocket_poll, WEBSOCKETD_POLL_INTERVAL);
-    tcp_sent(pcb, websocket_sent);
+    websocket_session_attach(session, http_recv);
 
     return ERR_OK;
 }
 
+#if HTTP_ENABLE && !LWIP_ALTCP
+
+//
+// Take over a connection accepted by httpd that requests an upgrade to the websocket protocol.
+// The request headers have already been parsed by httpd.
+//
+static bool websocket_on_upgrade (http_request_t *request, struct altcp_pcb *pcb, const char *uri)
+{
+    int len;
+    char *key = NULL, *protocols = NULL;
+    ws_sessiondata_t *session;
+
+    if(http_get_header_value_len(request, "Sec-WebSocket-Key") <= 0 || (session = websocket_session_alloc(pcb)) == NULL)
+        return false;
+
+    if((len = http_get_header_value_len(request, "Sec-WebSocket-Key")) > 0 && (key = malloc(len + 1)))
+        http_get_header_value(request, "Sec-WebSocket-Key", key, len);
+
+    if((len = http_get_header_value_len(request, "Sec-WebSocket-Protocol")) > 0 && (protocols = malloc(len + 1)))
+        http_get_header_value(request, "Sec-WebSocket-Protocol", protocols, len);
+
+    websocket_handshake(session, key ? trim(key) : NULL, protocols ? trim(protocols) : NULL);
+
+    if(key)
+        free(key);
+    if(protocols)
+        free(protocols);
+
+    if(session->state == WsState_Connected)
+        websocket_session_attach(session, websocket_recv);
+    else {
+        // Leave the connection to httpd for the error response
+        session->pcb = NULL;
+        websocket_unlink_session(session);
+    }
+
+    return session->state == WsState_Connected;
+}
+
+#endif // HTTP_ENABLE && !LWIP_ALTCP
+
 static void websocket_ping (ws_sessiondata_t *session)
 {
     uint8_t txbuf[5];
@@ -1239,7 +1517,7 @@ static void websocket_ping (ws_sessiondata_t *session)
     // Disconnect session after 3 failed pings (9 seconds).
     if(session->pingCount > 3)
         session->state = WsState_Closing;
-    else if(session->state != WsState_Closing && (xTaskGetTickCount() - session->lastSendTime) > (3 * configTICK_RATE_HZ)) {
+    else if(session->state != WsState_Closing && session->tx_frame_rem == 0 && session->txq.head == NULL && (xTaskGetTickCount() - session->lastSendTime) > (3 * configTICK_RATE_HZ)) {
         if(tcp_sndbuf(session->pcb) > 4) {
             txbuf[0] = wshdr_ping.token;
             txbuf[1] = 2;
@@ -1254,8 +1532,6 @@ static void websocket_ping (ws_sessiondata_t *session)
 
 static void websocket_stream_handler (ws_sessiondata_t *session)
 {
-    static uint8_t txbuf[TX_BUFFER_SIZE + 4];
-
     uint_fast16_t len;
 
     // 1. Process pending input packet
@@ -1296,41 +1572,67 @@ static void websocket_stream_handler (ws_sessiondata_t *session)
     }
 
     // 2. Process output stream
-    if((len = streamTxCount()) && tcp_sndbuf(session->pcb) > 4) {
 
-        int16_t c;
+    websocket_queue_flush(session);
+
+    // Start a new frame unless the payload of the previous one or queued frames are still pending.
+    // Only output after the current send position counts towards the flush policy, the payload is copied
+    // to lwIP and committed as it is sent so the TX buffer tail is the send position.
+    if(session->tx_frame_rem == 0 && session->txq.head == NULL && stream_flush_due(&ws_flush, (len = stream_tx_count(&streambuffers.txbuf))) && tcp_sndbuf(session->pcb) > 4) {
+
+        uint8_t hdr[4];
         uint_fast16_t idx = 0;
 
+        // Client cannot keep up, let the newest status report replace any unsent older ones.
+        if(len > tcp_sndbuf(session->pcb) - 4 && stream_tx_coalesce_status(&streambuffers.txbuf))
+            len = stream_tx_count(&streambuffers.txbuf);
+
         if(len > tcp_sndbuf(session->pcb) - 4)
             len = tcp_sndbuf(session->pcb) - 4;
 
-        txbuf[idx++] = session->ftype.token;
-        txbuf[idx++] = len < 126 ? len : 126;
+        hdr[idx++] = session->ftype.token;
+        hdr[idx++] = len < 126 ? len : 126;
         if(len >= 126) {
-            txbuf[idx++] = (len >> 8) & 0xFF;
-            txbuf[idx++] = len & 0xFF;
+            hdr[idx++] = (len >> 8) & 0xFF;
+            hdr[idx++] = len & 0xFF;
         }
 
-        while(len) {
-            if((c = (uint8_t)streamTxGetC()) == SERIAL_NO_DATA)
+        if(tcp_write(session->pcb, hdr, (u16_t)idx, TCP_WRITE_FLAG_COPY|TCP_WRITE_FLAG_MORE) == ERR_OK)
+            session->tx_frame_rem = len;
+    }
+
+    if(session->tx_frame_rem) {
+
+        u16_t plen;
+        const char *data;
+        bool sent = false;
+
+        // Hand the contiguous region(s) of the ring buffer directly to lwIP
+        while(session->tx_frame_rem && (len = stream_tx_peek(&streambuffers.txbuf, &data))) {
+
+            if(len > session->tx_frame_rem)
+                len = session->tx_frame_rem;
+
+            plen = (u16_t)len;
+
+            if(http_write(session->pcb, data, &plen, len < session->tx_frame_rem ? TCP_WRITE_FLAG_COPY|TCP_WRITE_FLAG_MORE : TCP_WRITE_FLAG_COPY) != ERR_OK)
                 break;
-            txbuf[idx++] = (uint8_t)c;
-            len--;
+
+            stream_tx_commit(&streambuffers.txbuf, plen);
+            session->tx_frame_rem -= plen;
+            sent = true;
         }
 
 #ifdef WSDEBUG
-    DEBUG_PRINT(uitoa(txbuf[1]));
-    DEBUG_PRINT(" - ");
-    DEBUG_PRINT(uitoa(idx));
-    DEBUG_PRINT(" - ");
-    DEBUG_PRINT(uitoa(plen));
+    DEBUG_PRINT(uitoa(session->tx_frame_rem));
     DEBUG_PRINT("\r\n");
 #endif
 
-        tcp_write(session->pcb, txbuf, (u16_t)idx, TCP_WRITE_FLAG_COPY);
-        tcp_output(session->pcb);
-
-        session->lastSendTime = xTaskGetTickCount();
+        if(sent) {
+            tcp_output(session->pcb);
+            stream_flush_done(&ws_flush, stream_tx_count(&streambuffers.txbuf) == 0);
+            session->lastSendTime = xTaskGetTickCount();
+        }
     }
 }
 
@@ -1347,12 +1649,40 @@ void websocketd_poll (void)
         if(client->state == WsState_Connected) {
             if(client->stream)
                 websocket_stream_handler(client);
+            else if(client->txq.head)
+                websocket_queue_flush(client);
             websocket_ping(client);
         } else if(client->state == WsState_Closing)
             websocket_close_conn(client, client->pcb);
     } while(idx);
 }
 
+void websocketd_set_flush_policy (const stream_flush_policy_t *policy)
+{
+    uint_fast16_t idx = WEBUI_MAX_CLIENTS;
+
+    stream_flush_init(&ws_flush, policy);
+
+    do {
+        if(clients[--idx].pcb) {
+            if(policy->nodelay)
+                tcp_nagle_disable(clients[idx].pcb);
+            else
+                tcp_nagle_enable(clients[idx].pcb);
+        }
+    } while(idx);
+}
+
+stream_flush_stats_t websocketd_get_flush_stats (bool reset)
+{
+    stream_flush_stats_t stats = ws_flush.stats;
+
+    if(reset)
+        memset(&ws_flush.stats, 0, sizeof(stream_flush_stats_t));
+
+    return stats;
+}
+
 void websocketd_notify_link_status (bool up)
 {
     if(!up)
@@ -1395,6 +1725,10 @@ void websocketd_stop (void)
 
     if(ws_server.pcb != NULL)
         tcp_close(ws_server.pcb);
+
+#if HTTP_ENABLE && !LWIP_ALTCP
+    httpd.on_websocket_upgrade = NULL;
+#endif
 }
 
 bool websocketd_init (uint16_t port)
@@ -1404,19 +1738,32 @@ bool websocketd_init (uint16_t port)
         .streams = &ws_streams[0].prop,
     };
 
-    err_t err;
+    err_t err = ERR_OK;
 
     ws_server.port = port;
     ws_server.link_lost = false;
 
-    struct tcp_pcb *pcb = tcp_new();
+#if HTTP_ENABLE && !LWIP_ALTCP
+    // Accept upgrade requests on the HTTP server port, a separate listener is only created if a port is specified.
+    httpd.on_websocket_upgrade = websocket_on_upgrade;
+#else
+    if(port == 0)
+        return false;
+#endif
 
-    if((err = tcp_bind(pcb, IP_ADDR_ANY, port)) == ERR_OK) {
-        ws_server.pcb = tcp_listen(pcb);
-        tcp_accept(ws_server.pcb, websocketd_accept);
-        stream_register_streams(&streams);
+    if(port) {
+
+        struct tcp_pcb *pcb = tcp_new();
+
+        if((err = tcp_bind(pcb, IP_ADDR_ANY, port)) == ERR_OK) {
+            ws_server.pcb = tcp_listen(pcb);
+            tcp_accept(ws_server.pcb, websocketd_accept);
+        }
     }
 
+    if(err == ERR_OK)
+        stream_register_streams(&streams);
+
     return err == ERR_OK;
 }
 
@@ -38,7 +38,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __WSSTREAM_H__
 #define __WSSTREAM_H__
 
+#include "streambuffer.h"
+
 typedef void websocket_t;
+
+typedef enum {
+    WsSlowConsumer_Coalesce = 0,    // Newer status reports replaces queued ones, drop other frames when queue is full.
+    WsSlowConsumer_Drop,            // Drop frames when queue is full.
+    WsSlowConsumer_Disconnect       // Close the connection when queue is full.
+} websocket_slow_consumer_policy_t;
+
 typedef char *(*websocket_on_protocol_select_ptr)(websocket_t *websocket, char *protocols, bool *is_binary);
 typedef void (*websocket_on_client_connect_ptr)(websocket_t *websocket);
 typedef void (*websocket_on_client_disconnect_ptr)(websocket_t *websocket);
@@ -58,10 +67,13 @@ void websocketd_notify_link_status (bool link_up);
 bool websocketd_RxPutC (char c);
 void websocketd_stop (void);
 void websocketd_close_connections (void);
+void websocketd_set_flush_policy (const stream_flush_policy_t *policy);
+stream_flush_stats_t websocketd_get_flush_stats (bool reset);
 bool websocket_register_frame_handler (websocket_t *websocket, websocket_on_frame_received_ptr handler, bool binary);
 bool websocket_send_frame (websocket_t *websocket, const void *data, size_t size, bool is_binary);
 bool websocket_broadcast_frame (const void *data, size_t size, bool is_binary);
 bool websocket_set_stream_flags (websocket_t *session, io_stream_state_t stream_flags);
 bool websocket_claim_stream (websocket_t *session);
+bool websocket_set_slow_consumer_policy (websocket_t *session, websocket_slow_consumer_policy_t policy);
 
 #endif
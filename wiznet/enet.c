@@ -229,7 +229,12 @@ static void netif_status_callback (struct netif *netif)
 
 #if WEBSOCKET_ENABLE
     if(network.services.websocket && !services.websocket)
+  #if HTTP_ENABLE
+        // Upgrade requests are accepted on the HTTP port, only open a separate listener if another port is configured
+        services.websocket = websocketd_init(services.http && network.websocket_port == network.http_port ? 0 : network.websocket_port);
+  #else
         services.websocket = websocketd_init(network.websocket_port);
+  #endif
 #endif
 
 #if MDNS_ENABLE
@@ -0,0 +1,253 @@
+//
+// writebehind.c - sector aligned write-behind buffering of network uploads into the VFS
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+//
+// Data received from the network is accumulated in blocks that are written to the file
+// from a lwIP timeout, outside of the receive callback, in sector sized and aligned chunks.
+// The received bytes are held back from the TCP window until the block containing them has been
+// written so that the sender is throttled to the speed of the storage device.
+// Writes are done synchronously in the caller context only when all blocks are in use.
+//
+
+#ifdef ARDUINO
+#include "../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#if FTP_ENABLE || (WEBDAV_ENABLE && HTTP_ENABLE) || (WEBUI_ENABLE && SDCARD_ENABLE)
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/timeouts.h"
+
+#include "writebehind.h"
+
+#if WRITEBEHIND_BLOCK_SIZE % WRITEBEHIND_SECTOR_SIZE
+#error "WRITEBEHIND_BLOCK_SIZE must be a multiple of WRITEBEHIND_SECTOR_SIZE"
+#endif
+
+typedef struct {
+    uint8_t *data;
+    size_t len;     // Number of bytes buffered.
+    size_t limit;   // Block is committed when this many bytes has been buffered.
+    size_t held;    // Number of bytes to release to the TCP window on commit.
+} wb_block_t;
+
+struct writebehind {
+    vfs_file_t *file;
+    writebehind_committed_ptr committed;
+    void *ctx;
+    size_t offset;              // File offset of the block being filled.
+    size_t block_size;
+    size_t window;
+    bool error;
+    bool scheduled;
+    uint_fast8_t head;          // Oldest block, blocks from head up to fill are ready to be written.
+    uint_fast8_t fill;          // Block being filled.
+    wb_block_t block[WRITEBEHIND_BLOCKS];
+};
+
+static void wb_commit (writebehind_t *wb)
+{
+    size_t held;
+    wb_block_t *block = &wb->block[wb->head];
+
+    if(!wb->error && block->len && vfs_write(block->data, 1, block->len, wb->file) != block->len)
+        wb->error = true;
+
+    held = block->held;
+    block->len = block->held = 0;
+    wb->head = (wb->head + 1) % WRITEBEHIND_BLOCKS;
+
+    if(wb->committed)
+        wb->committed(wb->ctx, held, !wb->error);
+}
+
+static void wb_timeout (void *arg)
+{
+    writebehind_t *wb = (writebehind_t *)arg;
+
+    wb->scheduled = false;
+
+    if(wb->head != wb->fill)
+        wb_commit(wb);
+
+    if(wb->head != wb->fill) {
+        wb->scheduled = true;
+        sys_timeout(0, wb_timeout, wb);
+    }
+}
+
+// Hands the block being filled over for writing and starts filling the next,
+// the limit of the next block is set so that it ends on a sector boundary.
+static void wb_advance (writebehind_t *wb)
+{
+    uint_fast8_t next = (wb->fill + 1) % WRITEBEHIND_BLOCKS;
+
+    wb->offset += wb->block[wb->fill].len;
+
+    if(next == wb->head)    // All blocks in use, write the oldest now.
+        wb_commit(wb);
+
+    wb->fill = next;
+    wb->block[next].len = wb->block[next].held = 0;
+    wb->block[next].limit = wb->block_size - (wb->offset & (WRITEBEHIND_SECTOR_SIZE - 1));
+
+    if(!wb->scheduled && wb->head != wb->fill) {
+        wb->scheduled = true;
+        sys_timeout(0, wb_timeout, wb);
+    }
+}
+
+//
+// offset is the file position writing starts at, used for sector alignment.
+// window is the size of the TCP receive window, the block size is reduced to
+// at most half of it so that the sender can fill the next block while one is written. Pass 0 if the
+// window is not managed by the caller, committed may then be NULL.
+//
+writebehind_t *writebehind_create (vfs_file_t *file, size_t offset, size_t window, writebehind_committed_ptr committed, void *ctx)
+{
+    uint_fast8_t i;
+    uint8_t *data;
+    writebehind_t *wb;
+    size_t block_size = WRITEBEHIND_BLOCK_SIZE;
+
+    if(window && (window / 2) < block_size && (block_size = (window / 2) & ~(WRITEBEHIND_SECTOR_SIZE - 1)) == 0)
+        block_size = WRITEBEHIND_SECTOR_SIZE;
+
+    if((wb = malloc(sizeof(writebehind_t) + WRITEBEHIND_BLOCKS * block_size)) == NULL)
+        return NULL;
+
+    memset(wb, 0, sizeof(writebehind_t));
+
+    wb->file = file;
+    wb->offset = offset;
+    wb->window = window;
+    wb->block_size = block_size;
+    wb->committed = committed;
+    wb->ctx = ctx;
+
+    data = (uint8_t *)wb + sizeof(writebehind_t);
+    for(i = 0; i < WRITEBEHIND_BLOCKS; i++)
+        wb->block[i].data = data + i * block_size;
+
+    wb->block[0].limit = block_size - (offset & (WRITEBEHIND_SECTOR_SIZE - 1));
+
+    return wb;
+}
+
+// Returns false if a previous write to the file failed, the data is then discarded.
+bool writebehind_write (writebehind_t *wb, const void *data, size_t length)
+{
+    size_t len;
+    wb_block_t *block;
+
+    while(length && !wb->error) {
+
+        block = &wb->block[wb->fill];
+
+        if((len = block->limit - block->len) > length)
+            len = length;
+
+        memcpy(block->data + block->len, data, len);
+        block->len += len;
+        data = (const uint8_t *)data + len;
+        length -= len;
+
+        if(block->len == block->limit)
+            wb_advance(wb);
+    }
+
+    return !wb->error;
+}
+
+//
+// Adds length bytes to be released to the TCP window when the data written so far has been committed,
+// to be called after the data from a received pbuf has been passed to writebehind_write().
+// length may differ from the number of bytes written, e.g. when the data is decompressed.
+//
+void writebehind_hold (writebehind_t *wb, size_t length)
+{
+    wb_block_t *block = &wb->block[wb->fill];
+
+    if(!wb->committed || !wb->window)
+        return;
+
+    block->held += length;
+
+    // The sender stalls when the held bytes reaches the window size, commit early if the block cannot be filled before that.
+    if(block->held + block->limit - block->len > wb->window) {
+        if(block->len)
+            wb_advance(wb);
+        else {
+            length = block->held;
+            block->held = 0;
+            wb->committed(wb->ctx, length, !wb->error);
+        }
+    }
+}
+
+//
+// Writes any remaining data and frees the write-behind buffer, the committed callback is not called.
+// The file is not closed.
+// Returns false if any write failed.
+//
+bool writebehind_close (writebehind_t *wb)
+{
+    bool ok;
+
+    if(wb->scheduled)
+        sys_untimeout(wb_timeout, wb);
+
+    wb->committed = NULL;
+
+    while(wb->head != wb->fill)
+        wb_commit(wb);
+
+    wb_commit(wb);
+
+    ok = !wb->error;
+
+    free(wb);
+
+    return ok;
+}
+
+#endif
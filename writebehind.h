@@ -0,0 +1,71 @@
+//
+// writebehind.h - sector aligned write-behind buffering of network uploads into the VFS
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef __WRITEBEHIND_H__
+#define __WRITEBEHIND_H__
+
+#ifdef ARDUINO
+#include "../grbl/vfs.h"
+#else
+#include "grbl/vfs.h"
+#endif
+
+#ifndef WRITEBEHIND_SECTOR_SIZE
+#define WRITEBEHIND_SECTOR_SIZE 512
+#endif
+// Max size of each block, must be a multiple of the sector size.
+#ifndef WRITEBEHIND_BLOCK_SIZE
+#define WRITEBEHIND_BLOCK_SIZE 4096
+#endif
+#ifndef WRITEBEHIND_BLOCKS
+#define WRITEBEHIND_BLOCKS 2
+#endif
+
+typedef struct writebehind writebehind_t;
+
+// Called when a block has been written to the file, length is the number of bytes
+// added by writebehind_hold() for the block and can be released to the TCP window.
+// ok is false if the file write failed, subsequent writes are then discarded.
+typedef void (*writebehind_committed_ptr)(void *ctx, size_t length, bool ok);
+
+writebehind_t *writebehind_create (vfs_file_t *file, size_t offset, size_t window, writebehind_committed_ptr committed, void *ctx);
+bool writebehind_write (writebehind_t *wb, const void *data, size_t length);
+void writebehind_hold (writebehind_t *wb, size_t length);
+bool writebehind_close (writebehind_t *wb);
+
+#endif
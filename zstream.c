@@ -0,0 +1,828 @@
+//
+// zstream.c - streaming zlib format (RFC 1950/1951) compression and decompression with bounded memory use
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+//
+// The compressor emits a single fixed Huffman code block using greedy LZ77 matching over a small window,
+// the decompressor handles stored, fixed and dynamic blocks.
+// Neither depends on the grblHAL or lwIP headers so the code can be built and tested on a host.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "zstream.h"
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_CHAIN 32
+
+#define WSIZE (1U << ZSTREAM_DEFLATE_WINDOW_BITS)
+#define WMASK (WSIZE - 1)
+#define MIN_LOOKAHEAD (MAX_MATCH + MIN_MATCH + 1)
+#define MAX_DIST (WSIZE - MIN_LOOKAHEAD)
+#define HASH_BITS (ZSTREAM_DEFLATE_WINDOW_BITS - 1)
+#define HASH_SIZE (1U << HASH_BITS)
+
+#define DEFLATE_MIN_OUT 8   // Output space needed for the largest symbol, a length/distance pair is at most 31 bits.
+#define DEFLATE_TRAILER 12  // Output space needed for the end of block code, an empty final block and the checksum.
+
+#define ADLER_BASE 65521U
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static uint32_t adler32 (uint32_t adler, const uint8_t *data, size_t length)
+{
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    size_t n;
+
+    while(length) {
+        n = length > 5552 ? 5552 : length; // Largest n before b may overflow
+        length -= n;
+        while(n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+
+    return (b << 16) | a;
+}
+
+/*
+ * Compressor
+ */
+
+struct zs_deflate {
+    uint32_t strstart;      // Start of the string to be matched.
+    uint32_t lookahead;     // Number of bytes in the window after strstart.
+    uint32_t adler;
+    uint32_t bitbuf;
+    uint_fast8_t bitcount;
+    bool header;            // Stream and block header emitted.
+    bool done;              // Trailer emitted.
+    uint16_t head[HASH_SIZE];
+    uint16_t prev[WSIZE];
+    uint8_t window[2 * WSIZE];
+};
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+} zs_out_t;
+
+static inline void put_bits (zs_deflate_t *z, zs_out_t *out, uint32_t value, uint_fast8_t bits)
+{
+    z->bitbuf |= value << z->bitcount;
+    z->bitcount += bits;
+
+    while(z->bitcount >= 8) {
+        out->data[out->length++] = (uint8_t)z->bitbuf;
+        z->bitbuf >>= 8;
+        z->bitcount -= 8;
+    }
+}
+
+// Huffman codes are sent most significant bit first.
+static inline void put_code (zs_deflate_t *z, zs_out_t *out, uint32_t code, uint_fast8_t bits)
+{
+    uint32_t rev = 0;
+    uint_fast8_t i = bits;
+
+    while(i--) {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+
+    put_bits(z, out, rev, bits);
+}
+
+// Fixed literal/length code, RFC 1951 3.2.6
+static void put_symbol (zs_deflate_t *z, zs_out_t *out, uint_fast16_t symbol)
+{
+    if(symbol < 144)
+        put_code(z, out, 0x30 + symbol, 8);
+    else if(symbol < 256)
+        put_code(z, out, 0x190 + symbol - 144, 9);
+    else if(symbol < 280)
+        put_code(z, out, symbol - 256, 7);
+    else
+        put_code(z, out, 0xC0 + symbol - 280, 8);
+}
+
+static void put_match (zs_deflate_t *z, zs_out_t *out, uint_fast16_t length, uint_fast16_t distance)
+{
+    uint_fast8_t code = 28;
+
+    while(length < length_base[code])
+        code--;
+
+    put_symbol(z, out, 257 + code);
+    if(length_extra[code])
+        put_bits(z, out, length - length_base[code], length_extra[code]);
+
+    code = 29;
+    while(distance < dist_base[code])
+        code--;
+
+    put_code(z, out, code, 5);
+    if(dist_extra[code])
+        put_bits(z, out, distance - dist_base[code], dist_extra[code]);
+}
+
+static inline uint_fast16_t hash (const uint8_t *s)
+{
+    return (((uint32_t)s[0] << 16 | (uint32_t)s[1] << 8 | s[2]) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline void insert_string (zs_deflate_t *z, uint32_t pos)
+{
+    uint_fast16_t h = hash(&z->window[pos]);
+
+    z->prev[pos & WMASK] = z->head[h];
+    z->head[h] = (uint16_t)pos;
+}
+
+// Moves the upper half of the window down when the window is full.
+static void slide_window (zs_deflate_t *z)
+{
+    uint32_t i;
+
+    memcpy(z->window, z->window + WSIZE, WSIZE);
+    z->strstart -= WSIZE;
+
+    for(i = 0; i < HASH_SIZE; i++)
+        z->head[i] = z->head[i] >= WSIZE ? z->head[i] - WSIZE : 0;
+
+    for(i = 0; i < WSIZE; i++)
+        z->prev[i] = z->prev[i] >= WSIZE ? z->prev[i] - WSIZE : 0;
+}
+
+static uint_fast16_t longest_match (zs_deflate_t *z, uint_fast16_t *distance)
+{
+    uint_fast16_t chain = MAX_CHAIN, best = 0, len, max = z->lookahead > MAX_MATCH ? MAX_MATCH : z->lookahead;
+    uint32_t limit = z->strstart > MAX_DIST ? z->strstart - MAX_DIST : 0;
+    uint32_t cand = z->head[hash(&z->window[z->strstart])];
+    const uint8_t *scan = &z->window[z->strstart], *match;
+
+    // Position 0 doubles as the empty marker and is never matched.
+    while(cand > limit && chain--) {
+
+        match = &z->window[cand];
+
+        if(match[best] == scan[best] && match[0] == scan[0]) {
+
+            len = 1;
+            while(len < max && match[len] == scan[len])
+                len++;
+
+            if(len > best) {
+                best = len;
+                *distance = z->strstart - cand;
+                if(len == max)
+                    break;
+            }
+        }
+
+        cand = z->prev[cand & WMASK];
+    }
+
+    return best;
+}
+
+zs_deflate_t *zs_deflate_create (void)
+{
+    zs_deflate_t *z;
+
+    if((z = malloc(sizeof(zs_deflate_t)))) {
+        memset(z, 0, offsetof(zs_deflate_t, window));
+        z->adler = 1;
+    }
+
+    return z;
+}
+
+//
+// Compresses the data in the input buffer, in_length is updated with the number of bytes consumed.
+// Input is buffered internally until enough is available for matching, set finish to
+// flush it out and complete the stream when there is no more data. Call again with
+// finish set until zs_deflate_done() returns true.
+// Returns the number of bytes written to the output buffer.
+//
+size_t zs_deflate (zs_deflate_t *z, const uint8_t *in, size_t *in_length, uint8_t *out, size_t out_size, bool finish)
+{
+    size_t consumed = 0, length = *in_length, n;
+    uint_fast16_t len, distance = 0;
+    zs_out_t o = { .data = out, .length = 0 };
+
+    if(z->done) {
+        *in_length = 0;
+        return 0;
+    }
+
+    if(!z->header) {
+
+        if(out_size < 2 + DEFLATE_MIN_OUT) {
+            *in_length = 0;
+            return 0;
+        }
+
+        uint16_t header = ((ZSTREAM_DEFLATE_WINDOW_BITS - 8) << 12) | (8 << 8);
+        header += 31 - (header % 31);
+
+        out[o.length++] = header >> 8;
+        out[o.length++] = header & 0xFF;
+        put_bits(z, &o, 0b010, 3);      // Not last block, fixed Huffman codes
+        z->header = true;
+    }
+
+    while(true) {
+
+        // Move input into the window.
+
+        if(z->strstart >= 2 * WSIZE - MIN_LOOKAHEAD)
+            slide_window(z);
+
+        if((n = 2 * WSIZE - (z->strstart + z->lookahead)) > length - consumed)
+            n = length - consumed;
+
+        if(n) {
+            memcpy(&z->window[z->strstart + z->lookahead], in + consumed, n);
+            z->adler = adler32(z->adler, in + consumed, n);
+            z->lookahead += n;
+            consumed += n;
+        }
+
+        if(z->lookahead == 0 || (z->lookahead < MIN_LOOKAHEAD && !(finish && consumed == length)))
+            break;
+
+        if(out_size - o.length < DEFLATE_MIN_OUT)
+            break;
+
+        len = 0;
+
+        if(z->lookahead >= MIN_MATCH) {
+            len = longest_match(z, &distance);
+            insert_string(z, z->strstart);
+        }
+
+        if(len >= MIN_MATCH) {
+
+            put_match(z, &o, len, distance);
+
+            z->lookahead -= len;
+            while(--len) {
+                if(z->lookahead >= MIN_MATCH)
+                    insert_string(z, z->strstart + 1);
+                z->strstart++;
+            }
+            z->strstart++;
+        } else {
+            put_symbol(z, &o, z->window[z->strstart]);
+            z->strstart++;
+            z->lookahead--;
+        }
+    }
+
+    *in_length = consumed;
+
+    if(finish && consumed == length && z->lookahead == 0 && out_size - o.length >= DEFLATE_TRAILER) {
+
+        put_symbol(z, &o, 256);         // End of block
+        put_bits(z, &o, 0b011, 3);      // Last block, fixed Huffman codes
+        put_symbol(z, &o, 256);         // End of block
+        if(z->bitcount)
+            put_bits(z, &o, 0, 8 - z->bitcount);
+
+        out[o.length++] = z->adler >> 24;
+        out[o.length++] = (z->adler >> 16) & 0xFF;
+        out[o.length++] = (z->adler >> 8) & 0xFF;
+        out[o.length++] = z->adler & 0xFF;
+
+        z->done = true;
+    }
+
+    return o.length;
+}
+
+bool zs_deflate_done (zs_deflate_t *z)
+{
+    return z->done;
+}
+
+void zs_deflate_free (zs_deflate_t *z)
+{
+    free(z);
+}
+
+/*
+ * Decompressor
+ */
+
+typedef enum {
+    Inflate_Header = 0,
+    Inflate_BlockHeader,
+    Inflate_StoredLength,
+    Inflate_Stored,
+    Inflate_TableHeader,
+    Inflate_TableCodeLengths,
+    Inflate_TableLengths,
+    Inflate_Data,
+    Inflate_Trailer,
+    Inflate_Done
+} inflate_state_t;
+
+typedef struct {
+    uint16_t count[16];     // Number of codes of each length.
+    uint16_t symbol[288];   // Symbols ordered by code.
+} huffman_t;
+
+struct zs_inflate {
+    zstream_write_ptr write;
+    void *ctx;
+    inflate_state_t state;
+    zstream_status_t status;
+    bool last;
+    uint64_t bitbuf;
+    uint_fast8_t bitcount;
+    uint8_t *window;
+    uint32_t wsize;
+    uint32_t wpos;          // Write position in window.
+    uint32_t wflushed;      // Start of data not yet passed to the write callback.
+    uint32_t total;         // Bytes output, saturates at wsize.
+    uint32_t adler;
+    uint32_t stored;        // Remaining bytes of stored block.
+    uint16_t nlen, ndist, ncode, index;
+    uint8_t lengths[286 + 30];
+    huffman_t lencode;
+    huffman_t distcode;
+};
+
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+} zs_in_t;
+
+static const uint8_t clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Tops up the bit buffer from the input.
+static inline void fill_bits (zs_inflate_t *z, zs_in_t *in)
+{
+    while(z->bitcount <= 56 && in->length) {
+        z->bitbuf |= (uint64_t)*in->data++ << z->bitcount;
+        z->bitcount += 8;
+        in->length--;
+    }
+}
+
+static inline uint32_t peek_bits (zs_inflate_t *z, uint_fast8_t offset, uint_fast8_t bits)
+{
+    return (uint32_t)(z->bitbuf >> offset) & ((1UL << bits) - 1);
+}
+
+static inline void drop_bits (zs_inflate_t *z, uint_fast8_t bits)
+{
+    z->bitbuf >>= bits;
+    z->bitcount -= bits;
+}
+
+static bool build_huffman (huffman_t *h, const uint8_t *length, uint_fast16_t n)
+{
+    uint_fast16_t symbol, len, offs[16];
+    int_fast32_t left = 1;
+
+    memset(h->count, 0, sizeof(h->count));
+
+    for(symbol = 0; symbol < n; symbol++)
+        h->count[length[symbol]]++;
+
+    for(len = 1; len < 16; len++) {
+        left <<= 1;
+        if((left -= h->count[len]) < 0)
+            return false;       // Over-subscribed
+    }
+
+    offs[1] = 0;
+    for(len = 1; len < 15; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+
+    for(symbol = 0; symbol < n; symbol++) {
+        if(length[symbol])
+            h->symbol[offs[length[symbol]]++] = symbol;
+    }
+
+    return true;
+}
+
+//
+// Decodes a symbol from the bit buffer starting at offset without consuming it.
+// Returns the symbol and sets bits to the code length, -1 on invalid code or -2 if more input is needed.
+//
+static int_fast16_t decode (zs_inflate_t *z, const huffman_t *h, uint_fast8_t offset, uint_fast8_t *bits)
+{
+    int_fast32_t code = 0, first = 0, index = 0, count;
+    uint64_t buf = z->bitbuf >> offset;
+    uint_fast8_t len, avail = z->bitcount - offset;
+
+    for(len = 1; len < 16; len++) {
+
+        if(len > avail)
+            return -2;
+
+        code |= buf & 1;
+        buf >>= 1;
+        count = h->count[len];
+
+        if(code - count < first) {
+            *bits = len;
+            return h->symbol[index + (code - first)];
+        }
+
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+
+    return -1;
+}
+
+static bool flush_window (zs_inflate_t *z)
+{
+    if(z->wpos > z->wflushed) {
+
+        z->adler = adler32(z->adler, &z->window[z->wflushed], z->wpos - z->wflushed);
+
+        if(!z->write(z->ctx, &z->window[z->wflushed], z->wpos - z->wflushed))
+            return false;
+    }
+
+    if(z->wpos == z->wsize)
+        z->wpos = 0;
+
+    z->wflushed = z->wpos;
+
+    return true;
+}
+
+static inline bool put_byte (zs_inflate_t *z, uint8_t c)
+{
+    z->window[z->wpos++] = c;
+
+    if(z->total < z->wsize)
+        z->total++;
+
+    return z->wpos < z->wsize || flush_window(z);
+}
+
+static void fixed_tables (zs_inflate_t *z)
+{
+    uint_fast16_t symbol;
+
+    for(symbol = 0; symbol < 288; symbol++)
+        z->lengths[symbol] = symbol < 144 ? 8 : (symbol < 256 ? 9 : (symbol < 280 ? 7 : 8));
+
+    build_huffman(&z->lencode, z->lengths, 288);
+
+    for(symbol = 0; symbol < 30; symbol++)
+        z->lengths[symbol] = 5;
+
+    build_huffman(&z->distcode, z->lengths, 30);
+}
+
+static zstream_status_t inflate_data (zs_inflate_t *z, zs_in_t *in)
+{
+    int_fast16_t symbol, dsymbol;
+    uint_fast8_t bits, dbits, extra, dextra;
+    uint_fast16_t length;
+    uint32_t distance, from;
+
+    while(true) {
+
+        fill_bits(z, in);
+
+        if((symbol = decode(z, &z->lencode, 0, &bits)) < 0)
+            return symbol == -2 ? ZStream_OK : ZStream_DataError;
+
+        if(symbol < 256) {
+            drop_bits(z, bits);
+            if(!put_byte(z, (uint8_t)symbol))
+                return ZStream_WriteError;
+            continue;
+        }
+
+        if(symbol == 256) {
+            drop_bits(z, bits);
+            z->state = z->last ? Inflate_Trailer : Inflate_BlockHeader;
+            return ZStream_OK;
+        }
+
+        if((symbol -= 257) >= 29)
+            return ZStream_DataError;
+
+        // The complete length/distance pair has to be available before anything is consumed.
+
+        extra = length_extra[symbol];
+        if(bits + extra > z->bitcount)
+            return ZStream_OK;
+
+        length = length_base[symbol] + peek_bits(z, bits, extra);
+
+        if((dsymbol = decode(z, &z->distcode, bits + extra, &dbits)) < 0)
+            return dsymbol == -2 ? ZStream_OK : ZStream_DataError;
+
+        if(dsymbol >= 30)
+            return ZStream_DataError;
+
+        dextra = dist_extra[dsymbol];
+        if(bits + extra + dbits + dextra > z->bitcount)
+            return ZStream_OK;
+
+        distance = dist_base[dsymbol] + peek_bits(z, bits + extra + dbits, dextra);
+
+        if(distance > z->total)
+            return ZStream_DataError;
+
+        drop_bits(z, bits + extra + dbits + dextra);
+
+        from = (z->wpos - distance) & (z->wsize - 1);
+        while(length--) {
+            uint8_t c = z->window[from];
+            from = (from + 1) & (z->wsize - 1);
+            if(!put_byte(z, c))
+                return ZStream_WriteError;
+        }
+    }
+}
+
+// Runs the decoder state machine one step, returns false when done with the input or on error.
+static bool inflate_step (zs_inflate_t *z, zs_in_t *in, zstream_status_t *status)
+{
+    int_fast16_t symbol;
+    uint_fast8_t bits, extra, cnt;
+    uint8_t value;
+
+    fill_bits(z, in);
+
+    switch(z->state) {
+
+        case Inflate_Header:
+            if(z->bitcount < 16)
+                return (*status = ZStream_OK, false);
+            {
+                uint_fast16_t cmf = peek_bits(z, 0, 8), flg = peek_bits(z, 8, 8);
+
+                if((cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 || (flg & 0x20) || (cmf >> 4) + 8 > ZSTREAM_INFLATE_WINDOW_BITS)
+                    return (*status = ZStream_DataError, false);
+
+                drop_bits(z, 16);
+                z->wsize = 1UL << ((cmf >> 4) + 8);
+                if((z->window = malloc(z->wsize)) == NULL)
+                    return (*status = ZStream_MemError, false);
+            }
+            z->state = Inflate_BlockHeader;
+            break;
+
+        case Inflate_BlockHeader:
+            if(z->bitcount < 3)
+                return (*status = ZStream_OK, false);
+            z->last = peek_bits(z, 0, 1);
+            switch(peek_bits(z, 1, 2)) {
+                case 0:
+                    z->state = Inflate_StoredLength;
+                    break;
+                case 1:
+                    fixed_tables(z);
+                    z->state = Inflate_Data;
+                    break;
+                case 2:
+                    z->state = Inflate_TableHeader;
+                    break;
+                default:
+                    return (*status = ZStream_DataError, false);
+            }
+            drop_bits(z, 3);
+            break;
+
+        case Inflate_StoredLength:
+            if(z->bitcount < (z->bitcount & 7) + 32)
+                return (*status = ZStream_OK, false);
+            drop_bits(z, z->bitcount & 7);
+            if(peek_bits(z, 0, 16) != (~peek_bits(z, 16, 16) & 0xFFFF))
+                return (*status = ZStream_DataError, false);
+            z->stored = peek_bits(z, 0, 16);
+            drop_bits(z, 32);
+            z->state = Inflate_Stored;
+            break;
+
+        case Inflate_Stored:
+            while(z->stored) {
+                if(z->bitcount < 8) {
+                    fill_bits(z, in);
+                    if(z->bitcount < 8)
+                        return (*status = ZStream_OK, false);
+                }
+                value = (uint8_t)peek_bits(z, 0, 8);
+                drop_bits(z, 8);
+                z->stored--;
+                if(!put_byte(z, value))
+                    return (*status = ZStream_WriteError, false);
+            }
+            z->state = z->last ? Inflate_Trailer : Inflate_BlockHeader;
+            break;
+
+        case Inflate_TableHeader:
+            if(z->bitcount < 14)
+                return (*status = ZStream_OK, false);
+            z->nlen = peek_bits(z, 0, 5) + 257;
+            z->ndist = peek_bits(z, 5, 5) + 1;
+            z->ncode = peek_bits(z, 10, 4) + 4;
+            drop_bits(z, 14);
+            if(z->nlen > 286 || z->ndist > 30)
+                return (*status = ZStream_DataError, false);
+            memset(z->lengths, 0, 19);
+            z->index = 0;
+            z->state = Inflate_TableCodeLengths;
+            break;
+
+        case Inflate_TableCodeLengths:
+            while(z->index < z->ncode) {
+                if(z->bitcount < 3) {
+                    fill_bits(z, in);
+                    if(z->bitcount < 3)
+                        return (*status = ZStream_OK, false);
+                }
+                z->lengths[clen_order[z->index++]] = peek_bits(z, 0, 3);
+                drop_bits(z, 3);
+            }
+            if(!build_huffman(&z->lencode, z->lengths, 19))
+                return (*status = ZStream_DataError, false);
+            z->index = 0;
+            z->state = Inflate_TableLengths;
+            break;
+
+        case Inflate_TableLengths:
+            while(z->index < z->nlen + z->ndist) {
+
+                fill_bits(z, in);
+
+                if((symbol = decode(z, &z->lencode, 0, &bits)) < 0)
+                    return (*status = symbol == -2 ? ZStream_OK : ZStream_DataError, false);
+
+                if(symbol < 16) {
+                    drop_bits(z, bits);
+                    z->lengths[z->index++] = (uint8_t)symbol;
+                    continue;
+                }
+
+                extra = symbol == 16 ? 2 : (symbol == 17 ? 3 : 7);
+                if(bits + extra > z->bitcount)
+                    return (*status = ZStream_OK, false);
+
+                if(symbol == 16) {
+                    if(z->index == 0)
+                        return (*status = ZStream_DataError, false);
+                    value = z->lengths[z->index - 1];
+                    cnt = 3 + peek_bits(z, bits, 2);
+                } else {
+                    value = 0;
+                    cnt = symbol == 17 ? 3 + peek_bits(z, bits, 3) : 11 + peek_bits(z, bits, 7);
+                }
+
+                drop_bits(z, bits + extra);
+
+                if(z->index + cnt > z->nlen + z->ndist)
+                    return (*status = ZStream_DataError, false);
+
+                while(cnt--)
+                    z->lengths[z->index++] = value;
+            }
+            if(z->lengths[256] == 0 ||
+                !build_huffman(&z->lencode, z->lengths, z->nlen) ||
+                 !build_huffman(&z->distcode, z->lengths + z->nlen, z->ndist))
+                return (*status = ZStream_DataError, false);
+            z->state = Inflate_Data;
+            break;
+
+        case Inflate_Data:
+            {
+                inflate_state_t state = z->state;
+
+                if((*status = inflate_data(z, in)) != ZStream_OK || z->state == state)
+                    return false;
+            }
+            break;
+
+        case Inflate_Trailer:
+            if(z->bitcount < (z->bitcount & 7) + 32)
+                return (*status = ZStream_OK, false);
+            if(!flush_window(z))
+                return (*status = ZStream_WriteError, false);
+            drop_bits(z, z->bitcount & 7);
+            if(((peek_bits(z, 0, 8) << 24) | (peek_bits(z, 8, 8) << 16) | (peek_bits(z, 16, 8) << 8) | peek_bits(z, 24, 8)) != z->adler)
+                return (*status = ZStream_DataError, false);
+            drop_bits(z, 32);
+            z->state = Inflate_Done;
+            return (*status = ZStream_StreamEnd, false);
+
+        case Inflate_Done:
+            return (*status = ZStream_StreamEnd, false);
+    }
+
+    return true;
+}
+
+zs_inflate_t *zs_inflate_create (zstream_write_ptr write, void *ctx)
+{
+    zs_inflate_t *z;
+
+    if((z = malloc(sizeof(zs_inflate_t)))) {
+        memset(z, 0, sizeof(zs_inflate_t));
+        z->write = write;
+        z->ctx = ctx;
+        z->adler = 1;
+    }
+
+    return z;
+}
+
+//
+// Decompresses a chunk of the stream, the output is passed to the write callback.
+// All input is consumed, returns ZStream_OK when more input is needed,
+// ZStream_StreamEnd when the stream is complete or an error status.
+//
+zstream_status_t zs_inflate (zs_inflate_t *z, const uint8_t *in, size_t length)
+{
+    zstream_status_t status;
+    zs_in_t input = { .data = in, .length = length };
+
+    if(z->status != ZStream_OK)
+        return z->status;
+
+    while(inflate_step(z, &input, &status));
+
+    if(status == ZStream_OK && z->window && !flush_window(z))
+        status = ZStream_WriteError;
+
+    return z->status = status;
+}
+
+void zs_inflate_free (zs_inflate_t *z)
+{
+    if(z->window)
+        free(z->window);
+
+    free(z);
+}
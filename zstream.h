@@ -0,0 +1,79 @@
+//
+// zstream.h - streaming zlib format (RFC 1950/1951) compression and decompression with bounded memory use
+//
+// v0.1 / 2026-10-16 / Io Engineering / Terje
+//
+
+/*
+
+Copyright (c) 2026, Terje Io
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef __ZSTREAM_H__
+#define __ZSTREAM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// History size of the compressor, memory use is approx. 5 * 2^bits bytes.
+#ifndef ZSTREAM_DEFLATE_WINDOW_BITS
+#define ZSTREAM_DEFLATE_WINDOW_BITS 11
+#endif
+
+// Largest history size accepted by the decompressor, streams declaring a larger window are rejected.
+// The window is allocated as declared by the stream header, zlib uses 32K (15 bits) by default.
+#ifndef ZSTREAM_INFLATE_WINDOW_BITS
+#define ZSTREAM_INFLATE_WINDOW_BITS 15
+#endif
+
+typedef enum {
+    ZStream_OK = 0,         // More input is needed.
+    ZStream_StreamEnd,      // The end of the stream has been reached and the checksum verified.
+    ZStream_DataError,      // Invalid or corrupt stream.
+    ZStream_MemError,       // Window could not be allocated.
+    ZStream_WriteError      // The output callback failed.
+} zstream_status_t;
+
+typedef bool (*zstream_write_ptr)(void *ctx, const uint8_t *data, size_t length);
+
+typedef struct zs_deflate zs_deflate_t;
+typedef struct zs_inflate zs_inflate_t;
+
+zs_deflate_t *zs_deflate_create (void);
+size_t zs_deflate (zs_deflate_t *z, const uint8_t *in, size_t *in_length, uint8_t *out, size_t out_size, bool finish);
+bool zs_deflate_done (zs_deflate_t *z);
+void zs_deflate_free (zs_deflate_t *z);
+
+zs_inflate_t *zs_inflate_create (zstream_write_ptr write, void *ctx);
+zstream_status_t zs_inflate (zs_inflate_t *z, const uint8_t *in, size_t length);
+void zs_inflate_free (zs_inflate_t *z);
+
+#endif